@@ -0,0 +1,700 @@
+/**
+ * Benchmark the encoder and the page path.
+ *
+ * Synthetic pages of several kinds are generated at 300, 600, and 1200 DPI
+ * (letter size), and recorded pages may be given as arguments in the form
+ * RESOLUTION:FILE (raw raster data at the given resolution, letter size).
+ * Each page is run through compress() (each printable row against the row
+ * before it), then the compressed rows are packed into blocks on their own
+ * (raster_data), then the whole of pcl_page() is run, then the page is given
+ * to a library job (ohb_page_data(), with its output handed to a function).
+ * Each is the best of many runs. Every measurement is made with each
+ * compression mode.
+ *
+ * The output of each page is also decoded (see decode.c) and checked
+ * against the page, and the time to decode it is reported. Then random
+ * pages (runs, repeats, small changes from row to row, and blank rows) are
+ * encoded and decoded in every resolution mode, with each compression mode
+ * and block placement, with and without padding. Any difference stops the
+ * benchmark with an error.
+ *
+ * Halftoning of 8-bit gray input is measured on its own, with each screen,
+ * on a synthetic gray page (a photo-like mix of gradients and noise). Its
+ * rates are in gray input bytes.
+ *
+ * Results are written to standard output as one JSON object per line so
+ * they can be kept and compared between versions.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "compress.h"
+#include "decode.h"
+#include "halftone.h"
+#include "ohbrother.h"
+#include "output.h"
+#include "parameters.h"
+#include "pcl.h"
+#include "scan.h"
+#include <ctype.h>
+#include <err.h>
+#include <fcntl.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+
+// Minimum time to spend on each measurement, in seconds.
+#define MIN_TIME 0.2
+
+// Shortest time which is reported as a rate (shorter is reported as 0).
+#define MIN_RESOLUTION 1e-7
+
+// Random pages encoded and decoded for each combination of modes.
+#define FUZZ_PAGES 2
+
+/**
+ * A page of raster data to benchmark.
+ */
+struct page {
+	const char *kind;
+	uint8_t *data;
+	size_t row_length;
+	size_t row_count;
+};
+
+/**
+ * Results of one measurement.
+ */
+struct result {
+	double seconds; // Time for one page
+	size_t out_bytes; // Output bytes for one page
+};
+
+static void generate(struct page *page, const char *kind);
+static void load(struct page *page, const char *path);
+static void bench(const char *resolution, struct page *page);
+static struct result time_compress(struct page *page);
+static struct result time_raster();
+static struct result time_page(struct page *page);
+static struct result time_library(const char *resolution, struct page *page);
+static int tally(void *context, const void *data, size_t length);
+static struct result time_decode(struct page *page);
+static void gather(struct output *out);
+static void check(const struct page *page);
+static void fuzz();
+static void generate_random(struct page *page);
+static void bench_halftone(const char *resolution);
+static void report(const char *resolution, const struct page *page,
+	const char *stage, double seconds, size_t out_bytes);
+static double now();
+static uint32_t random_bits();
+static void setup(const char *resolution);
+
+static const char *resolutions[] = {"300", "600", "1200"};
+static const char *kinds[] = {
+	"blank", "form", "text", "halftone", "photo", "barcode", "black"
+};
+static const char *compressions[] = {"GREEDY", "BEST"};
+static const char *screens[] = {"THRESHOLD", "BAYER", "CLUSTERED"};
+static const char *modes[] = {
+	"300", "600", "1200", "HQ1200A", "HQ1200B", "600x300"
+};
+static const char *placements[] = {"FIXED", "PLANNED"};
+
+static int null_fd;
+
+// Printable rows of the last page compressed, one after another.
+static uint8_t *rows;
+static size_t *row_lengths;
+static size_t row_count;
+
+// Output of the last page encoded, and the page decoded from it.
+static uint8_t *encoded;
+static size_t encoded_length;
+static size_t encoded_capacity;
+static struct decoded decoded;
+
+int main(int argc, char **argv) {
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd < 0) err(EX_OSERR, "open /dev/null");
+	param_reset();
+	scan_init();
+
+	// Synthetic pages.
+	for (size_t r = 0; r < sizeof(resolutions) / sizeof(*resolutions); r++)
+		for (size_t k = 0; k < sizeof(kinds) / sizeof(*kinds); k++) {
+			setup(resolutions[r]);
+			struct page page;
+			generate(&page, kinds[k]);
+			bench(resolutions[r], &page);
+			free(page.data);
+		}
+
+	// Encoding and decoding of random pages.
+	fuzz();
+
+	// Halftoning of gray pages.
+	for (size_t r = 0; r < sizeof(resolutions) / sizeof(*resolutions); r++) {
+		setup(resolutions[r]);
+		bench_halftone(resolutions[r]);
+	}
+
+	// Recorded pages.
+	for (int i = 1; i < argc; i++) {
+		char *path = strchr(argv[i], ':');
+		if (!path) errx(EX_USAGE, "recorded pages must be RESOLUTION:FILE");
+		*path++ = '\0';
+		setup(argv[i]);
+		struct page page;
+		load(&page, path);
+		bench(argv[i], &page);
+		free(page.data);
+	}
+}
+
+/**
+ * Set parameters for a resolution on letter-size paper.
+ *
+ * @param resolution Resolution (as for the -resolution option)
+ */
+static void setup(const char *resolution) {
+	param_resolution(resolution);
+	p_width = 0;
+	p_height = 0;
+	param_validate();
+}
+
+/**
+ * Benchmark one page and report the results.
+ *
+ * @param resolution Resolution of the page
+ * @param page Page to benchmark
+ */
+static void bench(const char *resolution, struct page *page) {
+	for (size_t c = 0; c < sizeof(compressions) / sizeof(*compressions);
+			c++) {
+		param_compression(compressions[c]);
+		struct result compressed = time_compress(page);
+		struct result packed = time_raster();
+		struct result paged = time_page(page);
+		struct result library = time_library(resolution, page);
+		report(resolution, page, "compress", compressed.seconds,
+			compressed.out_bytes);
+		report(resolution, page, "raster_data", packed.seconds,
+			packed.out_bytes);
+		report(resolution, page, "pcl_page", paged.seconds, paged.out_bytes);
+		report(resolution, page, "ohb_page", library.seconds,
+			library.out_bytes);
+		struct result decoding = time_decode(page);
+		report(resolution, page, "decode", decoding.seconds,
+			decoding.out_bytes);
+	}
+	p_compression = CM_GREEDY;
+}
+
+/**
+ * Time compress() over the printable rows of a page (as pcl_layout() finds
+ * them), and keep the compressed rows.
+ *
+ * @param page Page to compress
+ * @return Best time and output size for one page
+ */
+static struct result time_compress(struct page *page) {
+	size_t margin_rows, margin_bytes, length;
+	pcl_layout(page->row_length, page->row_count, &margin_rows, &margin_bytes,
+		&length, &row_count);
+	free(rows);
+	free(row_lengths);
+	rows = malloc(row_count * (2 * length + p_padding));
+	row_lengths = malloc(row_count * sizeof(*row_lengths));
+	if (!rows || !row_lengths) err(EX_OSERR, "allocate compressed rows");
+
+	struct result result = {.seconds = DBL_MAX};
+	double start = now(), end;
+	do {
+		double run = now();
+		result.out_bytes = 0;
+		uint8_t *in = page->data + margin_rows * page->row_length +
+			margin_bytes;
+		for (size_t row = 0; row < row_count; row++) {
+			row_lengths[row] = compress(rows + result.out_bytes, in,
+				row % 128 ? in - page->row_length : NULL, length, NULL);
+			result.out_bytes += row_lengths[row];
+			in += page->row_length;
+		}
+		end = now();
+		if (end - run < result.seconds) result.seconds = end - run;
+	} while (end - start < MIN_TIME);
+	return result;
+}
+
+/**
+ * Time packing the rows kept by time_compress() into blocks with
+ * pcl_raster(), without writing them.
+ *
+ * @return Best time and output size for one page
+ */
+static struct result time_raster() {
+	struct output out = {0};
+	struct result result = {.seconds = DBL_MAX};
+	double start = now(), end;
+	do {
+		double run = now();
+		pcl_raster(&out, rows, row_lengths, row_count);
+		end = now();
+		result.out_bytes = 0;
+		for (size_t i = 0; i < out.segment_count; i++)
+			result.out_bytes += out.segments[i].length;
+		output_discard(&out);
+		if (end - run < result.seconds) result.seconds = end - run;
+	} while (end - start < MIN_TIME);
+
+	output_free(&out);
+	return result;
+}
+
+/**
+ * Time pcl_page() over a page, including writing its output to /dev/null.
+ *
+ * @param page Page to emit
+ * @return Best time and output size for one page
+ */
+static struct result time_page(struct page *page) {
+	struct output out = {0};
+	struct result result = {.seconds = DBL_MAX};
+	double start = now(), end;
+	do {
+		double run = now();
+		pcl_page(&out, page->data, page->row_length, page->row_count);
+		result.out_bytes = output_flush(&out, null_fd);
+		end = now();
+		if (end - run < result.seconds) result.seconds = end - run;
+	} while (end - start < MIN_TIME);
+
+	output_free(&out);
+	return result;
+}
+
+/**
+ * Time ohb_page_data() over a page, in a library job with the same
+ * resolution and compression, handing its output to a function which only
+ * counts it.
+ *
+ * @param resolution Resolution of the page
+ * @param page Page to emit
+ * @return Best time and output size for one page
+ */
+static struct result time_library(const char *resolution, struct page *page) {
+	// The job sets the parameters of this thread from its options.
+	struct params params;
+	param_get(&params);
+	const char *options[] = {
+		"-resolution", resolution, "-compression",
+		compressions[p_compression], NULL
+	};
+	size_t bytes = 0;
+	struct ohb_job *job = ohb_job_begin(options, tally, &bytes);
+	if (!job) errx(EX_SOFTWARE, "library job: %s", ohb_error());
+	size_t row_length, row_count;
+	ohb_job_size(job, &row_length, &row_count);
+	if (row_length != page->row_length || row_count != page->row_count)
+		errx(EX_SOFTWARE, "library job: pages are %zu by %zu bytes, not %zu "
+			"by %zu", row_length, row_count, page->row_length,
+			page->row_count);
+
+	struct result result = {.seconds = DBL_MAX};
+	double start = now(), end;
+	do {
+		double run = now();
+		bytes = 0;
+		ohb_page_data(job, page->data);
+		end = now();
+		result.out_bytes = bytes;
+		if (end - run < result.seconds) result.seconds = end - run;
+	} while (end - start < MIN_TIME);
+
+	ohb_job_end(job);
+	param_set(&params);
+	return result;
+}
+
+/**
+ * Count the output of a library job.
+ */
+static int tally(void *context, const void *data, size_t length) {
+	(void)data;
+	*(size_t *)context += length;
+	return 0;
+}
+
+/**
+ * Time decoding the output of pcl_page() for a page, after checking it.
+ *
+ * @param page Page to encode and decode
+ * @return Best time to decode the page, and the size of its output
+ */
+static struct result time_decode(struct page *page) {
+	struct output out = {0};
+	pcl_page(&out, page->data, page->row_length, page->row_count);
+	gather(&out);
+	output_free(&out);
+	check(page);
+
+	struct result result = {
+		.seconds = DBL_MAX,
+		.out_bytes = encoded_length
+	};
+	double start = now(), end;
+	do {
+		double run = now();
+		const uint8_t *in = encoded;
+		decode_next(&in, encoded + encoded_length);
+		decode_page(&decoded, &in, encoded + encoded_length);
+		end = now();
+		if (end - run < result.seconds) result.seconds = end - run;
+	} while (end - start < MIN_TIME);
+	return result;
+}
+
+/**
+ * Gather the output of a page into one buffer, and empty the output.
+ *
+ * @param out Output of the page
+ */
+static void gather(struct output *out) {
+	encoded_length = 0;
+	for (size_t i = 0; i < out->segment_count; i++) {
+		struct segment *segment = &out->segments[i];
+		uint8_t *base = segment->block ? out->blocks[segment->block - 1] :
+			out->text;
+		if (encoded_length + segment->length > encoded_capacity) {
+			encoded_capacity = 2 * (encoded_length + segment->length);
+			encoded = realloc(encoded, encoded_capacity);
+			if (!encoded) err(EX_OSERR, "allocate output buffer");
+		}
+		memcpy(encoded + encoded_length, base + segment->offset,
+			segment->length);
+		encoded_length += segment->length;
+	}
+	output_flush(out, null_fd);
+}
+
+/**
+ * Decode the output of the last page encoded and check that it's the
+ * printable part of the page (with any padding, and with rows encoded twice
+ * where the resolution mode calls for it).
+ *
+ * @param page Page which was encoded
+ */
+static void check(const struct page *page) {
+	size_t margin_rows, margin_bytes, length, rows;
+	pcl_layout(page->row_length, page->row_count, &margin_rows, &margin_bytes,
+		&length, &rows);
+	size_t padding = p_padding > 1 ? p_padding : 0;
+	bool doubled = p_resolution == RES_600x300 || p_scale_y == SCALE_UP;
+	bool skipped = p_resolution == RES_HQ1200A && p_scale_y != SCALE_UP;
+
+	const uint8_t *in = encoded;
+	const char *error = decode_next(&in, encoded + encoded_length) ?
+		decode_page(&decoded, &in, encoded + encoded_length) :
+		"no page found";
+	if (error)
+		errx(EX_SOFTWARE, "%s page (%s, %s): %s", page->kind,
+			compressions[p_compression], placements[p_blocks], error);
+	if (decoded.row_count != (doubled ? 2 * rows : rows) ||
+			decoded.row_length > padding + length)
+		errx(EX_SOFTWARE, "%s page (%s, %s): decoded %zu rows of %zu bytes",
+			page->kind, compressions[p_compression], placements[p_blocks],
+			decoded.row_count, decoded.row_length);
+
+	// Rows may be decoded short of the padding and printable length where
+	// the rest is white.
+	for (size_t row = 0; row < decoded.row_count; row++) {
+		size_t from = doubled ? row / 2 : skipped ? row & ~(size_t)1 : row;
+		const uint8_t *expected = page->data + (margin_rows + from) *
+			page->row_length + margin_bytes;
+		const uint8_t *got = decoded.rows + row * decoded.row_length;
+		bool same = true;
+		for (size_t i = 0; i < padding + length; i++) {
+			uint8_t want = i < padding ? 0 : expected[i - padding];
+			if ((i < decoded.row_length ? got[i] : 0) != want) same = false;
+		}
+		if (!same)
+			errx(EX_SOFTWARE, "%s page (%s, %s): row %zu doesn't match",
+				page->kind, compressions[p_compression],
+				placements[p_blocks], row);
+	}
+}
+
+/**
+ * Encode and decode random pages in every resolution mode, with each
+ * compression mode and block placement, and check them.
+ */
+static void fuzz() {
+	size_t count = 0;
+	for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++)
+		for (size_t c = 0; c < sizeof(compressions) / sizeof(*compressions);
+				c++)
+			for (size_t b = 0; b < sizeof(placements) / sizeof(*placements);
+					b++)
+				for (size_t i = 0; i < FUZZ_PAGES; i++) {
+					// Every other page is narrower than the paper, so it's
+					// padded.
+					setup(modes[m]);
+					if (i & 1) {
+						p_width -= 304;
+						param_validate();
+					}
+					param_compression(compressions[c]);
+					param_blocks(placements[b]);
+					struct page page;
+					generate_random(&page);
+					struct output out = {0};
+					pcl_page(&out, page.data, page.row_length,
+						page.row_count);
+					gather(&out);
+					output_free(&out);
+					check(&page);
+					free(page.data);
+					count++;
+				}
+	p_compression = CM_GREEDY;
+	p_blocks = BL_FIXED;
+	printf("{\"stage\":\"round_trip\",\"pages\":%zu}\n", count);
+	fflush(stdout);
+}
+
+/**
+ * Time halftone_page() over a gray page with each screen, and report the
+ * results.
+ *
+ * @param resolution Resolution of the page
+ */
+static void bench_halftone(const char *resolution) {
+	struct page page = {
+		.kind = "gray",
+		.row_length = p_width,
+		.row_count = p_height
+	};
+	page.data = malloc(page.row_length * page.row_count);
+	uint8_t *out = malloc(((p_width + 7) >> 3) * p_height);
+	if (!page.data || !out) err(EX_OSERR, "allocate page buffer");
+	for (size_t y = 0; y < page.row_count; y++)
+		for (size_t x = 0; x < page.row_length; x++)
+			page.data[y * page.row_length + x] = (x * 255 / p_width +
+				y * 255 / p_height) / 2 + (random_bits() & 0x1f) - 16;
+
+	for (size_t s = 0; s < sizeof(screens) / sizeof(*screens); s++) {
+		param_screen(screens[s]);
+		double best = DBL_MAX, start = now(), end;
+		do {
+			double run = now();
+			halftone_page(out, page.data, p_width, p_height, 0);
+			end = now();
+			if (end - run < best) best = end - run;
+		} while (end - start < MIN_TIME);
+		char stage[32];
+		snprintf(stage, sizeof(stage), "halftone_%s", screens[s]);
+		for (char *c = stage; *c; c++)
+			*c = tolower(*c);
+		report(resolution, &page, stage, best, ((p_width + 7) >> 3) * p_height);
+	}
+	p_screen = SC_CLUSTERED;
+
+	free(out);
+	free(page.data);
+}
+
+/**
+ * Report the results of one measurement as a line of JSON.
+ */
+static void report(const char *resolution, const struct page *page,
+		const char *stage, double seconds, size_t out_bytes) {
+	size_t in_bytes = page->row_length * page->row_count;
+	if (seconds < MIN_RESOLUTION) seconds = 0;
+	printf("{\"resolution\":\"%s\",\"page\":\"%s\",\"stage\":\"%s\","
+		"\"compression\":\"%s\",\"kernels\":\"%s\",\"in_bytes\":%zu,\"out_bytes\":%zu,"
+		"\"ratio\":%.3f,\"seconds\":%.6f,\"mb_per_s\":%.1f,"
+		"\"rows_per_s\":%.0f}\n",
+		resolution, page->kind, stage, compressions[p_compression],
+		scan_name(scan_kernels), in_bytes,
+		out_bytes, out_bytes ? (double)in_bytes / out_bytes : 0.0, seconds,
+		seconds > 0 ? in_bytes / seconds / 1e6 : 0.0,
+		seconds > 0 ? page->row_count / seconds : 0.0);
+	fflush(stdout);
+}
+
+/**
+ * Generate a synthetic page the size of the selected paper.
+ *
+ * @param page Page to fill in
+ * @param kind Kind of page: blank, form, text, halftone, photo, barcode, or
+ * black
+ */
+static void generate(struct page *page, const char *kind) {
+	page->kind = kind;
+	page->row_length = (p_width + 7) >> 3;
+	page->row_count = p_height;
+	page->data = calloc(page->row_count, page->row_length);
+	if (!page->data) err(EX_OSERR, "allocate page buffer");
+
+	size_t dpi = p_width / 85 * 10; // 8-1/2" paper
+	size_t margin_rows = dpi / 2, margin_bytes = dpi / 16;
+	for (size_t y = margin_rows; y < page->row_count - margin_rows; y++) {
+		uint8_t *row = page->data + y * page->row_length;
+		size_t x0 = margin_bytes, x1 = page->row_length - margin_bytes;
+		if (!strcmp(kind, "black")) {
+			memset(row, 0xff, page->row_length);
+		} else if (!strcmp(kind, "form")) {
+			// Ruled lines every 1/3", otherwise empty.
+			if ((y - margin_rows) % (dpi / 3) < dpi / 150 + 1)
+				memset(row + x0, 0xff, x1 - x0);
+		} else if (!strcmp(kind, "text")) {
+			// 10 point text at 6 lines per inch: glyph rows take up most
+			// of each line, with a word space every few characters.
+			size_t line = dpi / 6, glyph_height = line * 2 / 3;
+			size_t line_row = (y - margin_rows) % line;
+			if (line_row >= glyph_height) continue;
+			size_t glyph_bytes = dpi / 96 ? dpi / 96 : 1;
+			for (size_t x = x0; x + glyph_bytes <= x1; x += glyph_bytes) {
+				size_t character = x / glyph_bytes;
+				if (character % 7 == 6) continue;
+				uint32_t seed = (character * 2654435761u) ^
+					(line_row * 40503u) ^ ((y / line) * 97u);
+				for (size_t i = 0; i < glyph_bytes; i++)
+					row[x + i] = (seed >> (i % 4 * 8)) & 0x7e;
+			}
+		} else if (!strcmp(kind, "halftone")) {
+			// Ordered dither of a horizontal gradient.
+			static const uint8_t bayer[4][4] = {
+				{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}
+			};
+			for (size_t x = x0; x < x1; x++) {
+				uint8_t byte = 0;
+				for (int bit = 0; bit < 8; bit++) {
+					size_t dot = x * 8 + bit;
+					size_t level = dot * 16 / (page->row_length * 8);
+					if (level > bayer[y % 4][dot % 4]) byte |= 0x80 >> bit;
+				}
+				row[x] = byte;
+			}
+		} else if (!strcmp(kind, "photo")) {
+			// Dithered noise with density varying across the image.
+			for (size_t x = x0; x < x1; x++) {
+				uint8_t byte = 0;
+				uint32_t density = (x * 7 + y * 3) % 256;
+				for (int bit = 0; bit < 8; bit++)
+					if ((random_bits() & 0xff) < density) byte |= 0x80 >> bit;
+				row[x] = byte;
+			}
+		} else if (!strcmp(kind, "barcode")) {
+			// Linear barcodes 1/2" high, 1/4" apart, with a 1/4" quiet
+			// zone at each side: bars and spaces of one to four modules
+			// (1/100" each), the same on every row of a barcode.
+			size_t barcode_row = (y - margin_rows) % (dpi * 3 / 4);
+			if (barcode_row >= dpi / 2) continue;
+			if (barcode_row) {
+				memcpy(row, row - page->row_length, page->row_length);
+				continue;
+			}
+			size_t module = dpi / 100;
+			size_t dot = x0 * 8 + dpi / 4, end = x1 * 8 - dpi / 4;
+			for (bool bar = true; dot < end; bar = !bar) {
+				size_t next = dot + (random_bits() % 4 + 1) * module;
+				if (next > end) next = end;
+				for (; bar && dot < next; dot++)
+					row[dot >> 3] |= 0x80 >> (dot & 7);
+				dot = next;
+			}
+		}
+		// Blank pages have nothing more to do.
+	}
+}
+
+/**
+ * Generate a random page the size of the selected paper, to try the encoder
+ * with rows it wouldn't often see: random bytes, runs of every length
+ * (including longer than a row), rows the same as the last row but for a
+ * few bytes, and blank rows.
+ *
+ * @param page Page to fill in
+ */
+static void generate_random(struct page *page) {
+	page->kind = "random";
+	page->row_length = (p_width + 7) >> 3;
+	page->row_count = p_height;
+	page->data = calloc(page->row_count, page->row_length);
+	if (!page->data) err(EX_OSERR, "allocate page buffer");
+
+	for (size_t y = 0; y < page->row_count; y++) {
+		uint8_t *row = page->data + y * page->row_length;
+		switch (random_bits() % 8) {
+			case 0:
+				// Blank.
+				break;
+			case 1:
+			case 2:
+				// The same as the last row but for a few bytes.
+				if (y) memcpy(row, row - page->row_length, page->row_length);
+				for (uint32_t n = random_bits() % 8; n--;)
+					row[random_bits() % page->row_length] = random_bits();
+				break;
+			case 3:
+				// The same as the last row.
+				if (y) memcpy(row, row - page->row_length, page->row_length);
+				break;
+			case 4:
+				// Random bytes.
+				for (size_t x = 0; x < page->row_length; x++)
+					row[x] = random_bits();
+				break;
+			default:
+				// Runs of random lengths, some short, some very long.
+				for (size_t x = 0; x < page->row_length;) {
+					uint32_t bits = random_bits();
+					size_t run = bits & 0x100 ? bits % 5 + 1 : bits % 700 + 1;
+					if (run > page->row_length - x) run = page->row_length - x;
+					memset(row + x, bits >> 24 & 1 ? bits >> 16 : 0, run);
+					x += run;
+				}
+		}
+	}
+}
+
+/**
+ * Load the first page of a recorded raw raster file.
+ *
+ * @param page Page to fill in
+ * @param path Path of the file
+ */
+static void load(struct page *page, const char *path) {
+	page->kind = path;
+	page->row_length = (p_width + 7) >> 3;
+	page->row_count = p_height;
+	page->data = calloc(page->row_count, page->row_length);
+	if (!page->data) err(EX_OSERR, "allocate page buffer");
+	FILE *file = fopen(path, "r");
+	if (!file) err(EX_NOINPUT, "open %s", path);
+	if (fread(page->data, page->row_length, page->row_count, file) !=
+			page->row_count)
+		errx(EX_DATAERR, "%s doesn't hold a full page", path);
+	fclose(file);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t random_bits() {
+	static uint32_t state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
@@ -0,0 +1,400 @@
+/**
+ * Remember compressed bands of rows and reuse them when the same rows come
+ * up again.
+ *
+ * Business documents repeat letterheads, footers, and form rules on every
+ * page. Each band is looked up by a hash of its rows, plus a salt for
+ * anything else its compression depends on. On a hit the rows are compared
+ * in full, so a hash collision can't change the output. Entries are kept in
+ * a hash table (chained, with a power of two number of buckets, grown as
+ * entries are added) and on a list from most to least recently used. When
+ * the memory limit is reached, the least recently used entries are evicted.
+ * The cache is shared by worker threads, and by all the jobs of a process
+ * (which only use it if they give it a size themselves). Allocation failures
+ * don't end the job: a band which can't be kept is compressed again the next
+ * time it comes up.
+ *
+ * Only the hash table and the list are kept under the mutex. Entries don't
+ * change once made, so rows are compared and compressed rows copied with
+ * the mutex unlocked, while the entry is held by a count of its users. An
+ * entry evicted while in use is freed by its last user (so the cache may
+ * briefly hold more than its limit, by an entry for each thread).
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "cache.h"
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Compressed rows and the rows they were compressed from, allocated along
+ * with the entry.
+ */
+struct entry {
+	struct entry *next; // Next entry in the same bucket
+	struct entry *newer; // Entry used next after this one
+	struct entry *older; // Entry used last before this one
+	uint64_t hash;
+	uint64_t salt;
+	size_t length;
+	size_t count;
+	uint8_t *rows; // Key rows, one right after the other
+	size_t offset_count;
+	size_t *offsets; // Offset of each compressed row in the data
+	uint8_t *data;
+	size_t size; // Bytes of memory held by the entry
+	unsigned int users; // Threads using the entry with the mutex unlocked
+	bool evicted; // Out of the cache, to be freed by its last user
+};
+
+static uint64_t hash_rows(const struct cache_key *key);
+static uint64_t mix(uint64_t hash, uint64_t word);
+static uint64_t load_word(const uint8_t *bytes);
+static struct entry *find(const struct cache_key *key);
+static bool same_rows(const struct entry *entry, const struct cache_key *key);
+static void use(struct entry *entry);
+static void unlink_used(struct entry *entry);
+static bool grow();
+static struct entry *evict();
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct entry **buckets;
+static size_t bucket_count; // A power of two (or 0 before the first entry)
+static size_t entry_count;
+static struct entry *newest; // Most recently used entry
+static struct entry *oldest; // Least recently used entry
+static size_t limit; // Most bytes of memory to hold (0 if disabled)
+static size_t size; // Bytes of memory held
+static unsigned long hits;
+static unsigned long misses;
+
+/**
+ * Set the memory limit of the cache. Since the cache is shared, a job
+ * asking for less than another job asked for doesn't shrink it.
+ *
+ * @param bytes Most bytes of memory to hold (0 leaves the cache disabled)
+ */
+void cache_init(size_t bytes) {
+	pthread_mutex_lock(&mutex);
+	if (bytes > limit) limit = bytes;
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Check whether the cache is enabled.
+ *
+ * @return True if the cache has a memory limit
+ */
+bool cache_enabled() {
+	pthread_mutex_lock(&mutex);
+	bool enabled = limit;
+	pthread_mutex_unlock(&mutex);
+	return enabled;
+}
+
+/**
+ * Look up compressed rows.
+ *
+ * The hash of the key is set whether or not the rows are found, so it can
+ * be used to put the rows once compressed.
+ *
+ * @param key Rows to look up (hash is set on return)
+ * @param offsets Set to the offset of each compressed row (and the end)
+ * @param offset_count Number of offsets
+ * @param data Buffer for the compressed rows (may be reallocated)
+ * @param capacity Size of the buffer (updated if reallocated)
+ * @return True if found (false if the buffer couldn't be grown to hold them)
+ */
+bool cache_get(struct cache_key *key, size_t *offsets, size_t offset_count,
+		uint8_t **data, size_t *capacity) {
+	key->hash = hash_rows(key);
+
+	pthread_mutex_lock(&mutex);
+	struct entry *entry = find(key);
+	if (!entry || entry->offset_count != offset_count) {
+		misses++;
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+	entry->users++;
+	pthread_mutex_unlock(&mutex);
+
+	// Rows which only share a hash with the entry are a miss.
+	size_t length = entry->offsets[offset_count - 1];
+	bool hit = same_rows(entry, key);
+	if (hit && *capacity < length) {
+		uint8_t *grown = realloc(*data, length);
+		if (grown) {
+			*data = grown;
+			*capacity = length;
+		} else
+			hit = false;
+	}
+	if (hit) {
+		memcpy(offsets, entry->offsets, offset_count * sizeof(*offsets));
+		memcpy(*data, entry->data, length);
+	}
+
+	pthread_mutex_lock(&mutex);
+	entry->users--;
+	bool unused = entry->evicted && !entry->users;
+	if (hit && !entry->evicted) {
+		unlink_used(entry);
+		use(entry);
+	}
+	if (hit) hits++;
+	else misses++;
+	pthread_mutex_unlock(&mutex);
+	if (unused) free(entry);
+	return hit;
+}
+
+/**
+ * Remember compressed rows.
+ *
+ * Entries too big to fit under the memory limit on their own aren't kept,
+ * nor are entries memory can't be allocated for, nor rows with the same hash
+ * as an entry already kept.
+ *
+ * @param key Rows the compressed rows were compressed from (hash must be
+ * set by cache_get())
+ * @param offsets Offset of each compressed row in the data (and the end)
+ * @param offset_count Number of offsets
+ * @param data Compressed rows
+ */
+void cache_put(const struct cache_key *key, const size_t *offsets,
+		size_t offset_count, const uint8_t *data) {
+	size_t length = offsets[offset_count - 1];
+	size_t rows_length = key->length * key->count;
+	size_t entry_size = sizeof(struct entry) +
+		offset_count * sizeof(*offsets) + rows_length + length;
+
+	// The entry is made before the mutex is locked.
+	pthread_mutex_lock(&mutex);
+	bool fits = entry_size <= limit;
+	pthread_mutex_unlock(&mutex);
+	if (!fits) return;
+	struct entry *entry = malloc(entry_size);
+	if (!entry) return;
+	size_t *entry_offsets = (size_t *)(entry + 1);
+	*entry = (struct entry){
+		.hash = key->hash,
+		.salt = key->salt,
+		.length = key->length,
+		.count = key->count,
+		.rows = (uint8_t *)(entry_offsets + offset_count),
+		.offset_count = offset_count,
+		.offsets = entry_offsets,
+		.data = (uint8_t *)(entry_offsets + offset_count) + rows_length,
+		.size = entry_size
+	};
+	for (size_t i = 0; i < key->count; i++)
+		memcpy(entry->rows + i * key->length, key->rows + i * key->stride,
+			key->length);
+	memcpy(entry->offsets, offsets, offset_count * sizeof(*offsets));
+	memcpy(entry->data, data, length);
+
+	// Entries evicted to make room are freed once the mutex is unlocked
+	// (unless in use), as is the new entry if it isn't kept after all.
+	struct entry *unused = NULL;
+	pthread_mutex_lock(&mutex);
+	if (entry_size > limit || find(key) ||
+			(entry_count >= bucket_count && !grow() && !bucket_count)) {
+		pthread_mutex_unlock(&mutex);
+		free(entry);
+		return;
+	}
+	while (size + entry_size > limit) {
+		struct entry *evicted = evict();
+		if (evicted) {
+			evicted->next = unused;
+			unused = evicted;
+		}
+	}
+	struct entry **bucket = &buckets[key->hash & (bucket_count - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	use(entry);
+	entry_count++;
+	size += entry_size;
+	pthread_mutex_unlock(&mutex);
+	while (unused) {
+		struct entry *next = unused->next;
+		free(unused);
+		unused = next;
+	}
+}
+
+/**
+ * Write the number of hits and misses to standard error.
+ */
+void cache_report() {
+	pthread_mutex_lock(&mutex);
+	warnx("cache: %lu hits, %lu misses, %zu entries in %zu bytes", hits,
+		misses, entry_count, size);
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Free all entries (those in use are freed by their last user).
+ */
+void cache_free() {
+	pthread_mutex_lock(&mutex);
+	while (entry_count)
+		free(evict());
+	free(buckets);
+	buckets = NULL;
+	bucket_count = 0;
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Hash rows of raster data.
+ *
+ * Four lanes of words are hashed independently, so the hash runs near
+ * memory speed, then the lanes are combined.
+ *
+ * @param key Rows to hash
+ * @return Hash of the rows, their size, and the salt
+ */
+static uint64_t hash_rows(const struct cache_key *key) {
+	uint64_t lanes[4] = {
+		key->salt, key->length, key->count, 0x9e3779b97f4a7c15
+	};
+	for (size_t row = 0; row < key->count; row++) {
+		const uint8_t *bytes = key->rows + row * key->stride;
+		size_t i = 0;
+		for (; i + 32 <= key->length; i += 32)
+			for (int lane = 0; lane < 4; lane++)
+				lanes[lane] = mix(lanes[lane],
+					load_word(bytes + i + 8 * lane));
+		for (; i + 8 <= key->length; i += 8)
+			lanes[0] = mix(lanes[0], load_word(bytes + i));
+		if (i < key->length) {
+			uint64_t word = 0;
+			memcpy(&word, bytes + i, key->length - i);
+			lanes[1] = mix(lanes[1], word);
+		}
+	}
+	return mix(mix(mix(lanes[0], lanes[1]), lanes[2]), lanes[3]);
+}
+
+static uint64_t mix(uint64_t hash, uint64_t word) {
+	hash = (hash ^ word) * 0x9fb21c651e98df25;
+	return hash ^ hash >> 29;
+}
+
+static uint64_t load_word(const uint8_t *bytes) {
+	uint64_t word;
+	memcpy(&word, bytes, sizeof(word));
+	return word;
+}
+
+/**
+ * Find the entry with the hash, salt, and size of rows (which are likely,
+ * but not sure, to be the same rows). Must be called with the mutex locked.
+ *
+ * @param key Rows to find (hash must be set)
+ * @return Entry, or NULL if not found
+ */
+static struct entry *find(const struct cache_key *key) {
+	if (!bucket_count) return NULL;
+	for (struct entry *entry = buckets[key->hash & (bucket_count - 1)]; entry;
+			entry = entry->next)
+		if (entry->hash == key->hash && entry->salt == key->salt &&
+				entry->length == key->length && entry->count == key->count)
+			return entry;
+	return NULL;
+}
+
+/**
+ * Check whether an entry was made from the same rows as a key (found by
+ * find()). The mutex needn't be locked if the entry is in use.
+ *
+ * @param entry Entry
+ * @param key Rows
+ * @return True if the rows are the same
+ */
+static bool same_rows(const struct entry *entry, const struct cache_key *key) {
+	for (size_t row = 0; row < key->count; row++)
+		if (memcmp(entry->rows + row * key->length,
+				key->rows + row * key->stride, key->length))
+			return false;
+	return true;
+}
+
+/**
+ * Put an entry at the most recently used end of the list. Must be called
+ * with the mutex locked.
+ *
+ * @param entry Entry (not on the list)
+ */
+static void use(struct entry *entry) {
+	entry->newer = NULL;
+	entry->older = newest;
+	if (newest) newest->newer = entry;
+	else oldest = entry;
+	newest = entry;
+}
+
+/**
+ * Take an entry off the list of entries by use. Must be called with the
+ * mutex locked.
+ *
+ * @param entry Entry (on the list)
+ */
+static void unlink_used(struct entry *entry) {
+	if (entry->newer) entry->newer->older = entry->older;
+	else newest = entry->older;
+	if (entry->older) entry->older->newer = entry->newer;
+	else oldest = entry->newer;
+}
+
+/**
+ * Double the number of buckets (or start with 64), and move the entries
+ * to their new buckets. If memory can't be allocated, the buckets are left
+ * as they were (chains just get longer). Must be called with the mutex
+ * locked.
+ *
+ * @return True if the buckets were grown
+ */
+static bool grow() {
+	size_t count = bucket_count ? bucket_count * 2 : 64;
+	struct entry **grown = calloc(count, sizeof(*grown));
+	if (!grown) return false;
+	for (size_t i = 0; i < bucket_count; i++)
+		for (struct entry *entry = buckets[i], *next; entry; entry = next) {
+			next = entry->next;
+			struct entry **bucket = &grown[entry->hash & (count - 1)];
+			entry->next = *bucket;
+			*bucket = entry;
+		}
+	free(buckets);
+	buckets = grown;
+	bucket_count = count;
+	return true;
+}
+
+/**
+ * Evict the least recently used entry. Must be called with the mutex
+ * locked, and with at least one entry.
+ *
+ * @return Entry, to be freed by the caller, or NULL if it's in use (it's
+ * freed by its last user)
+ */
+static struct entry *evict() {
+	struct entry *entry = oldest;
+	struct entry **link = &buckets[entry->hash & (bucket_count - 1)];
+	while (*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+	unlink_used(entry);
+	size -= entry->size;
+	entry_count--;
+	entry->evicted = true;
+	return entry->users ? NULL : entry;
+}
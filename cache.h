@@ -0,0 +1,24 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Rows of raster data which compressed rows are looked up by.
+ */
+struct cache_key {
+	const uint8_t *rows; // First byte of the first row
+	size_t stride; // Distance from one row to the next
+	size_t length; // Number of bytes of each row
+	size_t count; // Number of rows
+	uint64_t salt; // Anything else the compressed rows depend on
+	uint64_t hash; // Set by cache_get()
+};
+
+void cache_init(size_t limit);
+bool cache_enabled();
+bool cache_get(struct cache_key *key, size_t *offsets, size_t offset_count,
+	uint8_t **data, size_t *capacity);
+void cache_put(const struct cache_key *key, const size_t *offsets,
+	size_t offset_count, const uint8_t *data);
+void cache_report();
+void cache_free();
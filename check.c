@@ -0,0 +1,610 @@
+/**
+ * Check the filter (./oh_brother, run from the directory the checks are run
+ * in) on input it should take or refuse, and the library.
+ *
+ * Each check of the filter runs it on input written to a temporary file and
+ * looks at how it exited and what it wrote. Any check which doesn't turn
+ * out as expected stops the checks with an error. A line is written to
+ * standard output for each check passed.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "decode.h"
+#include "ohbrother.h"
+#include "parameters.h"
+#include "pcl.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+// Most arguments given to the filter by a check.
+#define MAX_ARGS 16
+
+// Number of times each library job is run at once.
+#define JOB_RUNS 2
+
+// Number of pages split across printers (the last range is cut short).
+#define FAN_OUT_PAGES 7
+
+/**
+ * What the filter did with some input.
+ */
+struct run {
+	int status; // Exit status, or -1 if killed by a signal
+	uint8_t *out; // Standard output (kept until the next run)
+	size_t out_length;
+};
+
+/**
+ * A library job run on a thread of its own, and what it handed its sink.
+ */
+struct library_job {
+	const char *const *options;
+	const uint8_t *pages; // Pages, one after the other
+	size_t page_count;
+	uint8_t *out;
+	size_t out_length;
+	size_t out_capacity;
+	int status; // What ohb_job_end() returned (-1 if not begun)
+	char error[256]; // Message if the job failed
+};
+
+static void check_small_pages();
+static void check_mixed_sizes();
+static void check_fan_out_duplex();
+static size_t find_page(const struct decoded *pages, size_t count,
+	const struct decoded *page);
+static void check_library_errors();
+static void check_library_jobs();
+static void *library_job(void *arg);
+static int keep(void *context, const void *data, size_t length);
+static int discard(void *context, const void *data, size_t length);
+static size_t pbm_page(uint8_t *to, size_t width, size_t height,
+	size_t from_width, size_t from_height);
+static void run(struct run *result, const char *const *args,
+	const void *in, size_t in_length);
+static void write_file(const char *path, const void *data, size_t length);
+static uint8_t *read_file(const char *path, size_t *length);
+static void expect(const char *name, const struct run *result, int status);
+
+static char in_path[] = "/tmp/oh_brother_check_in.XXXXXX";
+static char out_path[] = "/tmp/oh_brother_check_out.XXXXXX";
+
+int main() {
+	int in_fd = mkstemp(in_path), out_fd = mkstemp(out_path);
+	if (in_fd < 0 || out_fd < 0) err(EX_CANTCREAT, "create temporary file");
+	close(in_fd);
+	close(out_fd);
+
+	check_small_pages();
+	check_mixed_sizes();
+	check_fan_out_duplex();
+	check_library_errors();
+	check_library_jobs();
+
+	unlink(in_path);
+	unlink(out_path);
+}
+
+/**
+ * Pages too small to have anything inside the margins are refused (as bad
+ * data) rather than encoded, whether their size is given by options or by
+ * a PBM header. The smallest page which isn't refused is encoded.
+ */
+static void check_small_pages() {
+	static const char *resolutions[] = {
+		"300", "600", "1200", "HQ1200A", "HQ1200B", "600x300"
+	};
+	static const uint8_t tiny[64 * 64 / 8];
+	static const char pbm_header[] = "P4\n64 64\n";
+	uint8_t pbm[sizeof(pbm_header) - 1 + sizeof(tiny)] = {0};
+	memcpy(pbm, pbm_header, sizeof(pbm_header) - 1);
+	param_reset();
+
+	for (size_t r = 0; r < sizeof(resolutions) / sizeof(*resolutions); r++) {
+		const char *resolution = resolutions[r];
+		char name[64];
+		struct run result;
+
+		snprintf(name, sizeof(name), "64x64 raw at %s", resolution);
+		run(&result, (const char *[]){"-resolution", resolution, "-width",
+			"64", "-height", "64", NULL}, tiny, sizeof(tiny));
+		expect(name, &result, EX_DATAERR);
+
+		snprintf(name, sizeof(name), "64x64 PBM at %s", resolution);
+		run(&result, (const char *[]){"-resolution", resolution, NULL}, pbm,
+			sizeof(pbm));
+		expect(name, &result, EX_DATAERR);
+
+		// The smallest page has one byte of one row inside the margins.
+		size_t row_length, row_count;
+		param_resolution(resolution);
+		pcl_min_size(&row_length, &row_count);
+		size_t length = row_length * row_count;
+		uint8_t *page = malloc(length);
+		if (!page) err(EX_OSERR, "allocate page");
+		memset(page, 0xff, length);
+		char width[32], height[32], narrower[32], shorter[32];
+		snprintf(width, sizeof(width), "%zu", 8 * (row_length - 1) + 1);
+		snprintf(height, sizeof(height), "%zu", row_count);
+		snprintf(narrower, sizeof(narrower), "%zu", 8 * (row_length - 1));
+		snprintf(shorter, sizeof(shorter), "%zu", row_count - 1);
+
+		snprintf(name, sizeof(name), "smallest page at %s", resolution);
+		run(&result, (const char *[]){"-resolution", resolution, "-width",
+			width, "-height", height, NULL}, page, length);
+		expect(name, &result, EX_OK);
+		if (!result.out_length)
+			errx(EX_SOFTWARE, "%s: no output", name);
+
+		snprintf(name, sizeof(name), "one dot narrower at %s", resolution);
+		run(&result, (const char *[]){"-resolution", resolution, "-width",
+			narrower, "-height", height, NULL}, page, length);
+		expect(name, &result, EX_DATAERR);
+
+		snprintf(name, sizeof(name), "one row shorter at %s", resolution);
+		run(&result, (const char *[]){"-resolution", resolution, "-width",
+			width, "-height", shorter, NULL}, page, length);
+		expect(name, &result, EX_DATAERR);
+		free(page);
+	}
+}
+
+/**
+ * A PBM page of another size than the first is cropped or padded with
+ * white to the size of the first, rather than ending the job: the output is
+ * the same as for the page already made the size of the first.
+ */
+static void check_mixed_sizes() {
+	// The last page is the largest.
+	static const size_t sizes[][2] = {
+		{5100, 6600}, {4001, 3000}, {5400, 7000}
+	};
+	size_t count = sizeof(sizes) / sizeof(*sizes);
+	size_t capacity = 0;
+	for (size_t i = 0; i < count; i++)
+		capacity += 32 + ((sizes[2][0] + 7) >> 3) * sizes[2][1];
+	uint8_t *mixed = malloc(capacity), *same = malloc(capacity);
+	if (!mixed || !same) err(EX_OSERR, "allocate pages");
+	size_t mixed_length = 0, same_length = 0;
+	for (size_t i = 0; i < count; i++) {
+		mixed_length += pbm_page(mixed + mixed_length, sizes[i][0],
+			sizes[i][1], sizes[i][0], sizes[i][1]);
+		same_length += pbm_page(same + same_length, sizes[0][0], sizes[0][1],
+			sizes[i][0], sizes[i][1]);
+	}
+
+	const char *args[] = {"-resolution", "600", NULL};
+	struct run result;
+	run(&result, args, same, same_length);
+	expect("pages of the same size", &result, EX_OK);
+	uint8_t *expected = malloc(result.out_length);
+	if (!expected) err(EX_OSERR, "allocate output");
+	size_t expected_length = result.out_length;
+	memcpy(expected, result.out, expected_length);
+	run(&result, args, mixed, mixed_length);
+	expect("pages of mixed sizes", &result, EX_OK);
+	if (result.out_length != expected_length ||
+			memcmp(result.out, expected, expected_length))
+		errx(EX_SOFTWARE, "pages of mixed sizes: output differs from pages "
+			"made the same size");
+	free(expected);
+	free(mixed);
+	free(same);
+}
+
+/**
+ * With fan-out and duplex, each printer is dealt an even number of pages
+ * at a time, so each sheet it prints has two pages of one range, in order:
+ * each target's output, decoded, is pairs of pages one after the other in
+ * the job, and only the last page of the job may be alone. Ranges of an odd
+ * number of pages are refused.
+ */
+static void check_fan_out_duplex() {
+	size_t row_length = 100, row_count = 600;
+	size_t length = row_length * row_count;
+	uint8_t *pages = malloc(FAN_OUT_PAGES * length);
+	if (!pages) err(EX_OSERR, "allocate pages");
+	for (size_t page = 0; page < FAN_OUT_PAGES; page++)
+		for (size_t y = 0; y < row_count; y++)
+			for (size_t x = 0; x < row_length; x++)
+				pages[(page * row_count + y) * row_length + x] =
+					(x * 7 + y / 3 + page * 29) & 0x5b;
+
+	// Each page as printed without fan-out.
+	const char *args[MAX_ARGS + 1] = {"-resolution", "600", "-width", "800",
+		"-height", "600", "-duplex", "LONG", NULL};
+	struct run result;
+	run(&result, args, pages, FAN_OUT_PAGES * length);
+	expect("pages for fan-out with duplex", &result, EX_OK);
+	struct decoded *expected = calloc(FAN_OUT_PAGES, sizeof(*expected));
+	if (!expected) err(EX_OSERR, "allocate decoded pages");
+	const uint8_t *in = result.out, *end = result.out + result.out_length;
+	for (size_t i = 0; i < FAN_OUT_PAGES; i++) {
+		const char *error = decode_next(&in, end) ?
+			decode_page(&expected[i], &in, end) : "page missing";
+		if (error) errx(EX_SOFTWARE, "page %zu without fan-out: %s", i + 1,
+			error);
+	}
+
+	char target_paths[2][32] = {
+		"/tmp/oh_brother_check_a.XXXXXX", "/tmp/oh_brother_check_b.XXXXXX"
+	};
+	for (size_t t = 0; t < 2; t++) {
+		int fd = mkstemp(target_paths[t]);
+		if (fd < 0) err(EX_CANTCREAT, "create temporary file");
+		close(fd);
+	}
+	char targets[2 * sizeof(*target_paths)];
+	snprintf(targets, sizeof(targets), "%s,%s", target_paths[0],
+		target_paths[1]);
+	args[8] = "-fan_out";
+	args[9] = targets;
+	args[10] = "-range_pages";
+	args[11] = "1";
+	args[12] = NULL;
+	run(&result, args, pages, FAN_OUT_PAGES * length);
+	expect("fan-out with duplex and ranges of 1 page", &result, EX_USAGE);
+
+	args[11] = "2";
+	run(&result, args, pages, FAN_OUT_PAGES * length);
+	expect("fan-out with duplex and ranges of 2 pages", &result, EX_OK);
+	bool seen[FAN_OUT_PAGES] = {false};
+	struct decoded page = {0};
+	for (size_t t = 0; t < 2; t++) {
+		size_t out_length;
+		uint8_t *out = read_file(target_paths[t], &out_length);
+		in = out;
+		end = out + out_length;
+		size_t count = 0, last = 0;
+		while (decode_next(&in, end)) {
+			const char *error = decode_page(&page, &in, end);
+			if (error) errx(EX_SOFTWARE, "%s: %s", target_paths[t], error);
+			size_t index = find_page(expected, FAN_OUT_PAGES, &page);
+			if (index == FAN_OUT_PAGES || seen[index])
+				errx(EX_SOFTWARE, "%s: page %zu isn't a page of the job, or "
+					"was printed twice", target_paths[t], count + 1);
+			if (count & 1 ? index != last + 1 : index & 1)
+				errx(EX_SOFTWARE, "%s: page %zu of the job is on a sheet "
+					"with a page of another range", target_paths[t],
+					index + 1);
+			seen[index] = true;
+			last = index;
+			count++;
+		}
+		if (count & 1 && last != FAN_OUT_PAGES - 1)
+			errx(EX_SOFTWARE, "%s: page %zu of the job is alone on a sheet",
+				target_paths[t], last + 1);
+		free(out);
+		unlink(target_paths[t]);
+	}
+	for (size_t i = 0; i < FAN_OUT_PAGES; i++)
+		if (!seen[i])
+			errx(EX_SOFTWARE, "fan-out with duplex: page %zu wasn't printed",
+				i + 1);
+	printf("fan-out with duplex decoded: ok\n");
+	fflush(stdout);
+
+	decode_free(&page);
+	for (size_t i = 0; i < FAN_OUT_PAGES; i++)
+		decode_free(&expected[i]);
+	free(expected);
+	free(pages);
+}
+
+/**
+ * Find a decoded page among others.
+ *
+ * @param pages Pages to look among
+ * @param count Number of pages
+ * @param page Page to find
+ * @return Index of the page, or the number of pages if it isn't found
+ */
+static size_t find_page(const struct decoded *pages, size_t count,
+		const struct decoded *page) {
+	for (size_t i = 0; i < count; i++)
+		if (pages[i].row_length == page->row_length &&
+				pages[i].row_count == page->row_count &&
+				!memcmp(pages[i].rows, page->rows,
+					page->row_length * page->row_count))
+			return i;
+	return count;
+}
+
+/**
+ * A library job with bad options, or options only the program takes, isn't
+ * begun, and the error is given rather than ending the process.
+ */
+static void check_library_errors() {
+	static const char *options[][3] = {
+		{"-resolution", "601", NULL},
+		{"-width", "8", NULL},
+		{"-streaming", "YES", NULL}
+	};
+	for (size_t i = 0; i < sizeof(options) / sizeof(*options); i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "library job with %s %s", options[i][0],
+			options[i][1]);
+		if (ohb_job_begin(options[i], discard, NULL))
+			errx(EX_SOFTWARE, "%s: job was begun", name);
+		if (!*ohb_error())
+			errx(EX_SOFTWARE, "%s: no error given", name);
+		printf("%s: ok\n", name);
+		fflush(stdout);
+	}
+}
+
+/**
+ * Library jobs run at once on several threads, with different options,
+ * give the same output as the filter. Pages are given to the jobs both as
+ * pointers to rows (apart from one another) and as one buffer.
+ */
+static void check_library_jobs() {
+	static const char *const options[][9] = {
+		{"-resolution", "600", NULL},
+		{"-resolution", "1200", "-threads", "4", NULL},
+		{"-resolution", "HQ1200A", "-blocks", "PLANNED", "-threads", "2",
+			NULL},
+		{"-resolution", "300", "-compression", "BEST", "-cache", "8", NULL},
+		{"-resolution", "600x300", "-paper", "A4", "-copies", "2", "-cache",
+			"8", NULL}
+	};
+	size_t count = sizeof(options) / sizeof(*options);
+	struct library_job jobs[sizeof(options) / sizeof(*options)][JOB_RUNS];
+	uint8_t *expected[sizeof(options) / sizeof(*options)];
+	size_t expected_length[sizeof(options) / sizeof(*options)];
+	uint8_t *pages[sizeof(options) / sizeof(*options)];
+
+	// Two pages for each set of options, the second like the first but
+	// shifted down, and what the filter makes of them.
+	for (size_t i = 0; i < count; i++) {
+		struct ohb_job *job = ohb_job_begin(options[i], discard, NULL);
+		if (!job) errx(EX_SOFTWARE, "library job: %s", ohb_error());
+		size_t row_length, row_count;
+		ohb_job_size(job, &row_length, &row_count);
+		ohb_job_end(job);
+		size_t length = row_length * row_count;
+		pages[i] = malloc(2 * length);
+		if (!pages[i]) err(EX_OSERR, "allocate pages");
+		for (size_t y = 0; y < 2 * row_count; y++) {
+			size_t shift = y < row_count ? 0 : row_count + 37;
+			for (size_t x = 0; x < row_length; x++)
+				pages[i][y * row_length + x] = (y - shift) % 100 < 50 ?
+					(x * 7 + (y - shift) / 3) & 0x5b : 0;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "filter with %s %s", options[i][0],
+			options[i][1]);
+		struct run result;
+		run(&result, options[i], pages[i], 2 * length);
+		expect(name, &result, EX_OK);
+		expected[i] = malloc(result.out_length);
+		if (!expected[i]) err(EX_OSERR, "allocate output");
+		memcpy(expected[i], result.out, result.out_length);
+		expected_length[i] = result.out_length;
+	}
+
+	// Every job at once.
+	pthread_t threads[sizeof(options) / sizeof(*options)][JOB_RUNS];
+	for (size_t i = 0; i < count; i++)
+		for (size_t j = 0; j < JOB_RUNS; j++) {
+			jobs[i][j] = (struct library_job){
+				.options = options[i],
+				.pages = pages[i],
+				.page_count = 2
+			};
+			int error = pthread_create(&threads[i][j], NULL, library_job,
+				&jobs[i][j]);
+			if (error) {
+				errno = error;
+				err(EX_OSERR, "start library job");
+			}
+		}
+	for (size_t i = 0; i < count; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "library jobs with %s %s",
+			options[i][0], options[i][1]);
+		for (size_t j = 0; j < JOB_RUNS; j++) {
+			struct library_job *job = &jobs[i][j];
+			pthread_join(threads[i][j], NULL);
+			if (job->status)
+				errx(EX_SOFTWARE, "%s: job ended with %d (%s)", name,
+					job->status, job->error);
+			if (job->out_length != expected_length[i] ||
+					memcmp(job->out, expected[i], expected_length[i]))
+				errx(EX_SOFTWARE, "%s: output differs from the filter's",
+					name);
+			free(job->out);
+		}
+		printf("%s: ok\n", name);
+		fflush(stdout);
+		free(expected[i]);
+		free(pages[i]);
+	}
+}
+
+/**
+ * Run a library job on its pages. Even pages are given as pointers to rows
+ * copied apart from one another, and odd pages as they are.
+ *
+ * @param arg Library job
+ * @return Nothing
+ */
+static void *library_job(void *arg) {
+	struct library_job *job = arg;
+	job->status = -1;
+	struct ohb_job *ohb = ohb_job_begin(job->options, keep, job);
+	if (!ohb) {
+		snprintf(job->error, sizeof(job->error), "%s", ohb_error());
+		return NULL;
+	}
+	size_t row_length, row_count;
+	ohb_job_size(ohb, &row_length, &row_count);
+	size_t stride = row_length + 16;
+	uint8_t *apart = malloc(stride * row_count);
+	const uint8_t **rows = malloc(row_count * sizeof(*rows));
+	if (!apart || !rows) err(EX_OSERR, "allocate rows");
+
+	for (size_t page = 0; page < job->page_count; page++) {
+		const uint8_t *data = job->pages + page * row_length * row_count;
+		if (page & 1) {
+			ohb_page_data(ohb, data);
+			continue;
+		}
+		for (size_t row = 0; row < row_count; row++) {
+			memcpy(apart + row * stride, data + row * row_length, row_length);
+			rows[row] = apart + row * stride;
+		}
+		ohb_page(ohb, rows);
+	}
+	job->status = ohb_job_end(ohb);
+	if (job->status < 0)
+		snprintf(job->error, sizeof(job->error), "%s", ohb_error());
+	free(rows);
+	free(apart);
+	return NULL;
+}
+
+/**
+ * Keep the output of a library job.
+ */
+static int keep(void *context, const void *data, size_t length) {
+	struct library_job *job = context;
+	if (job->out_length + length > job->out_capacity) {
+		size_t capacity = job->out_capacity ? job->out_capacity : 65536;
+		while (capacity < job->out_length + length) capacity *= 2;
+		uint8_t *more = realloc(job->out, capacity);
+		if (!more) err(EX_OSERR, "allocate output");
+		job->out = more;
+		job->out_capacity = capacity;
+	}
+	memcpy(job->out + job->out_length, data, length);
+	job->out_length += length;
+	return 0;
+}
+
+/**
+ * Drop the output of a library job.
+ */
+static int discard(void *context, const void *data, size_t length) {
+	(void)context;
+	(void)data;
+	(void)length;
+	return 0;
+}
+
+/**
+ * Write a PBM page of a pattern, cropped or padded with white to a size.
+ * Bits past the width of the pattern in its last byte are set, as they may
+ * be in a PBM image, unless the page is padded (then they're white).
+ *
+ * @param to Where to write the page
+ * @param width Width of the page in dots
+ * @param height Height of the page in dots
+ * @param from_width Width of the pattern in dots
+ * @param from_height Height of the pattern in dots
+ * @return Length of the page in bytes
+ */
+static size_t pbm_page(uint8_t *to, size_t width, size_t height,
+		size_t from_width, size_t from_height) {
+	size_t length = sprintf((char *)to, "P4\n%zu %zu\n", width, height);
+	size_t row_length = (width + 7) >> 3;
+	size_t from_length = (from_width + 7) >> 3;
+	for (size_t y = 0; y < height; y++) {
+		uint8_t *row = to + length + y * row_length;
+		memset(row, 0, row_length);
+		if (y >= from_height) continue;
+		for (size_t x = 0; x < row_length && x < from_length; x++)
+			row[x] = y % 100 < 50 ? (x * 7 + y / 3) & 0x5b : 0;
+		if (from_width & 7 && from_length <= row_length) {
+			uint8_t past = 0xff >> (from_width & 7);
+			if (width == from_width) row[from_length - 1] |= past;
+			else row[from_length - 1] &= ~past;
+		}
+	}
+	return length + row_length * height;
+}
+
+/**
+ * Run the filter on some input.
+ *
+ * @param result Set to what the filter did
+ * @param args Arguments, ending with NULL
+ * @param in Input
+ * @param in_length Length of the input in bytes
+ */
+static void run(struct run *result, const char *const *args,
+		const void *in, size_t in_length) {
+	write_file(in_path, in, in_length);
+	const char *argv[MAX_ARGS + 2] = {"oh_brother"};
+	for (size_t i = 0; args[i]; i++) {
+		if (i == MAX_ARGS) errx(EX_SOFTWARE, "too many arguments");
+		argv[i + 1] = args[i];
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) err(EX_OSERR, "fork");
+	if (!pid) {
+		int in_fd = open(in_path, O_RDONLY);
+		int out_fd = open(out_path, O_WRONLY | O_TRUNC);
+		int null_fd = open("/dev/null", O_WRONLY);
+		if (in_fd < 0 || out_fd < 0 || null_fd < 0 ||
+				dup2(in_fd, STDIN_FILENO) < 0 ||
+				dup2(out_fd, STDOUT_FILENO) < 0 ||
+				dup2(null_fd, STDERR_FILENO) < 0)
+			_exit(EX_OSERR);
+		execv("./oh_brother", (char *const *)argv);
+		_exit(EX_UNAVAILABLE);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) < 0) err(EX_OSERR, "wait for oh_brother");
+	result->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	static uint8_t *out;
+	free(out);
+	result->out = out = read_file(out_path, &result->out_length);
+}
+
+static void write_file(const char *path, const void *data, size_t length) {
+	FILE *file = fopen(path, "w");
+	if (!file || fwrite(data, 1, length, file) != length || fclose(file))
+		err(EX_IOERR, "write %s", path);
+}
+
+static uint8_t *read_file(const char *path, size_t *length) {
+	struct stat st;
+	FILE *file = fopen(path, "r");
+	if (!file || fstat(fileno(file), &st)) err(EX_IOERR, "read %s", path);
+	uint8_t *data = malloc(st.st_size ? st.st_size : 1);
+	if (!data) err(EX_OSERR, "allocate output");
+	*length = fread(data, 1, st.st_size, file);
+	fclose(file);
+	return data;
+}
+
+/**
+ * Check that the filter exited as expected, and say so.
+ *
+ * @param name Name of the check
+ * @param result What the filter did
+ * @param status Exit status expected
+ */
+static void expect(const char *name, const struct run *result, int status) {
+	if (result->status < 0)
+		errx(EX_SOFTWARE, "%s: oh_brother was killed by a signal", name);
+	if (result->status != status)
+		errx(EX_SOFTWARE, "%s: oh_brother exited with %d rather than %d",
+			name, result->status, status);
+	printf("%s: ok\n", name);
+	fflush(stdout);
+}
@@ -0,0 +1,176 @@
+/**
+ * Print collated copies of a job by sending its pages again.
+ *
+ * The printer's own copies are uncollated: each page is printed as many
+ * times as asked before the next. For collated copies, each page is encoded
+ * once, and as it's written, the output is kept in a spill file (unlinked,
+ * so it goes away with the process, and usually held in memory by the
+ * system anyway). Once the last page is written, the spill file is mapped
+ * and written out again for each copy after the first, without encoding
+ * anything, so each copy costs no more than writing it.
+ *
+ * When printing on both sides of the paper, a document with an odd number
+ * of pages is followed by a blank page before each copy after it, so each
+ * copy begins on a sheet of its own.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "collate.h"
+#include "output.h"
+#include "parameters.h"
+#include "pcl.h"
+#include "pool.h"
+#include "trace.h"
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * A page encoded into one buffer.
+ */
+struct flat {
+	uint8_t *data;
+	size_t length;
+};
+
+static int flatten(void *context, const void *data, size_t length);
+static void write_all(int fd, const uint8_t *data, size_t length);
+static double now();
+
+static int spill = -1; // Spill file, or -1 if not collating
+static size_t spill_length;
+static unsigned long pages;
+
+/**
+ * Begin keeping the pages of a job, if collated copies are asked for.
+ */
+void collate_begin() {
+	if (!p_collate || p_copies < 2) return;
+	const char *directory = getenv("TMPDIR");
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/oh_brother.XXXXXX",
+		directory && *directory ? directory : "/tmp");
+	spill = mkstemp(path);
+	if (spill < 0) err(EX_CANTCREAT, "create spill file %s", path);
+	unlink(path);
+	spill_length = 0;
+	pages = 0;
+}
+
+/**
+ * Keep output about to be flushed, if collating.
+ *
+ * @param output Output (not yet flushed)
+ * @param page_end True if the output concludes a page
+ */
+void collate_keep(const struct output *output, bool page_end) {
+	if (spill < 0) return;
+	for (size_t i = 0; i < output->segment_count; i++) {
+		const struct segment *segment = &output->segments[i];
+		const uint8_t *base = segment->block ?
+			output->blocks[segment->block - 1] : output->text;
+		write_all(spill, base + segment->offset, segment->length);
+		spill_length += segment->length;
+	}
+	if (page_end) pages++;
+}
+
+/**
+ * Write the pages kept for each copy after the first, and stop collating.
+ *
+ * @param fd File descriptor to write to
+ * @param row_length Length of input data rows in bytes (for a blank page)
+ * @param row_count Number of input data rows (for a blank page)
+ */
+void collate_end(int fd, size_t row_length, size_t row_count) {
+	if (spill < 0) return;
+	uint64_t start = trace_now();
+
+	// A blank page to keep each copy to sheets of its own, if needed.
+	struct flat blank = {NULL, 0};
+	if (p_duplex != DPX_OFF && pages & 1) {
+		uint8_t *page = pool_get(row_count * row_length);
+		memset(page, 0, row_count * row_length);
+		struct output out = {0};
+		pcl_page(&out, page, row_length, row_count);
+		output_send(&out, flatten, &blank);
+		output_free(&out);
+		pool_put(page, row_count * row_length);
+	}
+
+	uint8_t *kept = NULL;
+	if (spill_length) {
+		kept = mmap(NULL, spill_length, PROT_READ, MAP_SHARED, spill, 0);
+		if (kept == MAP_FAILED) err(EX_OSERR, "map spill file");
+	}
+	for (unsigned int copy = 2; copy <= p_copies; copy++) {
+		double started = now();
+		write_all(fd, blank.data, blank.length);
+		write_all(fd, kept, spill_length);
+		if (p_verbose)
+			warnx("copy %u: %zu bytes in %.3f s", copy,
+				blank.length + spill_length, now() - started);
+	}
+	if (kept) munmap(kept, spill_length);
+	free(blank.data);
+	close(spill);
+	spill = -1;
+	trace_event("collate", start);
+}
+
+/**
+ * Append a piece of output to a page in one buffer.
+ *
+ * @param context Page
+ * @param data Output
+ * @param length Length of the output in bytes
+ * @return Zero
+ */
+static int flatten(void *context, const void *data, size_t length) {
+	struct flat *flat = context;
+	flat->data = realloc(flat->data, flat->length + length);
+	if (!flat->data) err(EX_OSERR, "allocate blank page");
+	memcpy(flat->data + flat->length, data, length);
+	flat->length += length;
+	return 0;
+}
+
+/**
+ * Write all of a buffer to a file, however many calls it takes.
+ *
+ * @param fd File descriptor
+ * @param data Data
+ * @param length Length of the data in bytes
+ */
+static void write_all(int fd, const uint8_t *data, size_t length) {
+	while (length) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			err(EX_IOERR, "write output");
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+/**
+ * Get the time.
+ *
+ * @return Time in seconds from an arbitrary point
+ */
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,8 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+struct output;
+
+void collate_begin();
+void collate_keep(const struct output *output, bool page_end);
+void collate_end(int fd, size_t row_length, size_t row_count);
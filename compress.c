@@ -6,11 +6,39 @@
 
 #include "compress.h"
 #include "parameters.h"
+#include "scan.h"
 #include <string.h>
 
-size_t count_repeat(const uint8_t *buffer, size_t length);
+// Longest row (including padding) compress_best() will handle. Longer rows
+// are compressed greedily. The widest printable row is 2496 bytes.
+#define BEST_MAX 2560
+
+// Largest difference in header cost between any two groups of the same kind
+// in a row no longer than BEST_MAX (see best_candidate()).
+#define BEST_MAX_STEP 14
+
+/**
+ * Candidate starting points for the groups considered by compress_best().
+ *
+ * Candidates are kept in order of position, and a candidate is dropped
+ * once a later candidate is at least as cheap, since a later start is never
+ * more expensive to reach from. The values kept are all within
+ * BEST_MAX_STEP of the cheapest, so there are never many candidates.
+ */
+struct candidates {
+	int count;
+	uint32_t position[BEST_MAX_STEP + 2];
+	int32_t value[BEST_MAX_STEP + 2];
+};
+
+static size_t compress_greedy(uint8_t *out, uint8_t *in, uint8_t *last,
+	size_t in_length, bool *fallback);
+static size_t compress_best(uint8_t *out, uint8_t *in, uint8_t *last,
+	size_t in_length, bool *fallback);
+static void best_candidate(struct candidates *candidates, uint32_t position,
+	int32_t value);
+static size_t extension(size_t count, size_t field);
 void encode_repeat(uint8_t **buffer, size_t skip, size_t count,	uint8_t byte);
-size_t count_no_repeat(const uint8_t *buffer, size_t length);
 void encode(uint8_t **buffer, size_t skip, size_t count, const uint8_t *bytes);
 void encode_count(uint8_t **buffer, size_t count);
 
@@ -47,22 +75,36 @@ void encode_count(uint8_t **buffer, size_t count);
  * @param in Uncompressed input row
  * @param last Last uncompressed input row (may be NULL)
  * @param in_length Length in bytes of the input row and last input row
+ * @param fallback Set to true if the row ran out of groups and the rest of
+ * it was encoded as one last group, false otherwise (may be NULL)
  * @return Number of bytes of compressed output
  */
-size_t compress(uint8_t *out, uint8_t *in, uint8_t *last, size_t in_length) {
+size_t compress(uint8_t *out, uint8_t *in, uint8_t *last, size_t in_length,
+		bool *fallback) {
+	bool unused;
+	if (!fallback) fallback = &unused;
+	*fallback = false;
+	if (p_compression == CM_BEST)
+		return compress_best(out, in, last, in_length, fallback);
+	return compress_greedy(out, in, last, in_length, fallback);
+}
+
+/**
+ * Compress a row of raster data, one group at a time.
+ *
+ * Bytes the same as the last row are always skipped and three or more
+ * repeated bytes are always encoded as a repeat. This is fast and usually
+ * close to the smallest encoding. See compress() for parameters.
+ */
+static size_t compress_greedy(uint8_t *out, uint8_t *in, uint8_t *last,
+		size_t in_length, bool *fallback) {
 	// Initialize number of groups encoded (first byte of output).
 	uint8_t *groups = out++;
 	*groups = 0;
 
 	// If the row is blank, set the number of groups to the special
 	// value 255 and return early.
-	bool blank = true;
-	for (size_t i = 0; i < in_length; i++)
-		if (in[i]) {
-			blank = false;
-			break;
-		}
-	if (blank) {
+	if (scan_blank(in, in_length)) {
 		*groups = 255;
 		return out - groups;
 	}
@@ -80,32 +122,30 @@ size_t compress(uint8_t *out, uint8_t *in, uint8_t *last, size_t in_length) {
 	while (in_length) {
 		// Skip bytes which are the same as the last line.
 		size_t skip = 0;
-		if (last)
-			while (in_length && *in == *last) {
-				 skip++;
-				 in++;
-				 last++;
-				 in_length--;
-			}
+		if (last) {
+			skip = scan_same(in, last, in_length);
+			in += skip;
+			last += skip;
+			in_length -= skip;
+		}
 
 		// If the rest of the line has been skipped, return early.
 		if(!in_length)
 			return out - groups;
 
 		// Encode up to the next byte to skip or the end of the line.
-		size_t different = last ? 0 : in_length;
-		while (different < in_length &&	in[different] != last[different])
-			different++;
+		size_t different = last ? scan_different(in, last, in_length)
+			: in_length;
 		while (different) {
 			// If the next group is a repeated byte, encode the repeat.
 			// Otherwise, encode bytes up to the next repeat (or the next
 			// byte which can be skipped or the end of the line).
 			size_t count;
 			if (different >= 3 && in[0] == in[1] &&	in[0] == in[2]) {
-				count = count_repeat(in, different);
+				count = scan_repeat(in, different);
 				encode_repeat(&out, skip, count, in[0]);
 			} else {
-				count = count_no_repeat(in, different);
+				count = scan_no_repeat(in, different);
 				encode(&out, skip, count, in);
 			}
 			++*groups;
@@ -125,30 +165,180 @@ size_t compress(uint8_t *out, uint8_t *in, uint8_t *last, size_t in_length) {
 			if (*groups >= 253) break;
 		}
 		// If there is only one more group available, encode the remainder of
-		// the line as a single group.
-		if(*groups >= 253) {
+		// the line (if any) as a single group.
+		if(*groups >= 253 && in_length) {
 			encode(&out, 0, in_length, in);
 			++*groups;
 			in_length = 0;
+			*fallback = true;
 		}
 	} // while there are bytes left in the input line
 	return out - groups;
 }
 
 /**
- * Count repeated byte.
+ * Compress a row of raster data into the fewest possible bytes.
+ *
+ * Each group costs a header byte plus extension bytes for skip counts and
+ * byte counts too big for the header, plus the literal bytes or repeated
+ * byte. Which bytes to skip, repeat, or encode literally is found by
+ * dynamic programming over the row: the cheapest way to reach each position
+ * at a group boundary (f), and the cheapest way to reach each position at
+ * the start of a literal or repeat group's data after skipping (h_literal
+ * and h_repeat). Padding is treated as part of the row, so it can be
+ * skipped along with other bytes the same as the last row.
+ *
+ * The result is never larger than compress_greedy() would give. If the
+ * smallest encoding needs more groups than a row can have (or the row is
+ * too long), the row is compressed greedily instead. See compress() for
+ * parameters.
+ */
+static size_t compress_best(uint8_t *out, uint8_t *in, uint8_t *last,
+		size_t in_length, bool *fallback) {
+	// Blank rows and rows the same as the last row are as small as they
+	// can get.
+	if (scan_blank(in, in_length)) {
+		*out = 255;
+		return 1;
+	}
+	if (last && scan_same(in, last, in_length) == in_length) {
+		*out = 0;
+		return 1;
+	}
+
+	// Build the whole row (padding and input) and the whole last row.
+	size_t padding = p_padding > 1 ? p_padding : 0;
+	size_t n = padding + in_length;
+	if (n > BEST_MAX)
+		return compress_greedy(out, in, last, in_length, fallback);
+	uint8_t row[BEST_MAX], last_row[BEST_MAX];
+	memset(row, 0, padding);
+	memcpy(row + padding, in, in_length);
+	if (last) {
+		memset(last_row, 0, padding);
+		memcpy(last_row + padding, last, in_length);
+	}
+
+	int32_t f[BEST_MAX + 1], h_literal[BEST_MAX + 1], h_repeat[BEST_MAX + 1];
+	uint32_t from[BEST_MAX + 1]; // Start of the data of the group ending here
+	bool repeat[BEST_MAX + 1]; // Whether the group ending here is a repeat
+	uint32_t skip_literal[BEST_MAX + 1], skip_repeat[BEST_MAX + 1];
+	struct candidates boundaries = {0}, literals = {0}, repeats = {0};
+
+	for (size_t e = 0; e <= n; e++) {
+		// Cheapest way to end a group here: a literal group starting at any
+		// earlier position, or a repeat group starting at least two bytes
+		// back within a run of the same byte.
+		if (e) {
+			f[e] = INT32_MAX;
+			for (int c = 0; c < literals.count; c++) {
+				size_t j = literals.position[c];
+				int32_t cost = literals.value[c] + e + 1 +
+					extension(e - j - 1, 7);
+				if (cost < f[e]) {
+					f[e] = cost;
+					from[e] = j;
+					repeat[e] = false;
+				}
+			}
+			if (e >= 2) {
+				if (row[e - 1] == row[e - 2])
+					best_candidate(&repeats, e - 2, h_repeat[e - 2]);
+				else
+					repeats.count = 0;
+			}
+			for (int c = 0; c < repeats.count; c++) {
+				size_t j = repeats.position[c];
+				int32_t cost = repeats.value[c] + 2 + extension(e - j - 2, 31);
+				if (cost < f[e]) {
+					f[e] = cost;
+					from[e] = j;
+					repeat[e] = true;
+				}
+			}
+		} else
+			f[e] = 0;
+
+		// Cheapest way to start a group's data here, having skipped bytes
+		// the same as the last row since some earlier group boundary.
+		if (!last || (e && row[e - 1] != last_row[e - 1]))
+			boundaries.count = 0;
+		best_candidate(&boundaries, e, f[e]);
+		h_literal[e] = h_repeat[e] = INT32_MAX;
+		for (int c = 0; c < boundaries.count; c++) {
+			size_t i = boundaries.position[c];
+			int32_t cost = boundaries.value[c] + extension(e - i, 15);
+			if (cost < h_literal[e]) {
+				h_literal[e] = cost;
+				skip_literal[e] = i;
+			}
+			cost = boundaries.value[c] + extension(e - i, 3);
+			if (cost < h_repeat[e]) {
+				h_repeat[e] = cost;
+				skip_repeat[e] = i;
+			}
+		}
+		if (e < n)
+			best_candidate(&literals, e, h_literal[e] - (int32_t)e);
+	}
+
+	// The row can end at any group boundary followed only by bytes the same
+	// as the last row.
+	size_t end = n;
+	if (last)
+		for (size_t e = n; e > 0 && row[e - 1] == last_row[e - 1]; e--)
+			if (f[e - 1] <= f[end]) end = e - 1;
+
+	// Trace the groups back from the end, then encode them from the start.
+	size_t group_count = 0;
+	uint32_t ends[254];
+	for (size_t e = end; e;) {
+		if (group_count == 254)
+			return compress_greedy(out, in, last, in_length, fallback);
+		ends[group_count++] = e;
+		e = repeat[e] ? skip_repeat[from[e]] : skip_literal[from[e]];
+	}
+	uint8_t *start = out;
+	*out++ = group_count;
+	for (size_t g = group_count, i = 0; g--;) {
+		size_t e = ends[g], j = from[e];
+		if (repeat[e])
+			encode_repeat(&out, j - i, e - j, row[j]);
+		else
+			encode(&out, j - i, e - j, row + j);
+		i = e;
+	}
+	return out - start;
+}
+
+/**
+ * Add a candidate starting point for compress_best().
  *
- * Counts the number of times the first byte in a buffer is repeated. At least
- * the first three bytes of the buffer must be the same.
+ * @param candidates Candidates
+ * @param position Position of the new candidate
+ * @param value Cost of reaching the new candidate (less any cost which
+ * depends only on the end position)
+ */
+static void best_candidate(struct candidates *candidates, uint32_t position,
+		int32_t value) {
+	while (candidates->count &&
+			candidates->value[candidates->count - 1] >= value)
+		candidates->count--;
+	if (candidates->count && value > candidates->value[0] + BEST_MAX_STEP)
+		return;
+	candidates->position[candidates->count] = position;
+	candidates->value[candidates->count++] = value;
+}
+
+/**
+ * Count the extension bytes needed for a count in a header field.
  *
- * @param buffer Buffer to examine
- * @param length Length of buffer
- * @return Repeat count
+ * @param count Count to encode
+ * @param field Largest count which fits in the header field itself
+ * @return Number of bytes appended by encode_count()
  */
-size_t count_repeat(const uint8_t *buffer, size_t length) {
-	int i;
-	for(i = 3; i < length && buffer[i] == buffer[i - 1]; i++);
-	return i;
+static size_t extension(size_t count, size_t field) {
+	return count < field ? 0 : (count - field) / 255 + 1;
 }
 
 /**
@@ -186,26 +376,6 @@ void encode_repeat(uint8_t **buffer, size_t skip, size_t count,	uint8_t byte) {
 	*(*buffer)++ = byte;
 }
 
-/**
- * Count bytes without repeat.
- *
- * Counts the number of bytes in a buffer before the first group of three
- * repeats of the same byte.
- *
- * @param buffer Buffer to examine
- * @param length Length of buffer
- * @return Number of bytes without repeat
- */
-size_t count_no_repeat(const uint8_t *buffer, size_t length) {
-	size_t i;
-	for (i = length <= 2 ? length : 2; i < length; i++)
-		if (buffer[i] == buffer[i - 1] && buffer[i] == buffer[i - 2]) {
-			i -= 2;
-			break;
-		}
-	return i;
-}
-
 /**
  * Encode bytes.
  *
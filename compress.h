@@ -1,4 +1,6 @@
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-size_t compress(uint8_t *out, uint8_t *in, uint8_t *last, size_t in_length);
+size_t compress(uint8_t *out, uint8_t *in, uint8_t *last, size_t in_length,
+	bool *fallback);
@@ -0,0 +1,249 @@
+/**
+ * Decode raster data compressed with method 1030, as a printer would.
+ *
+ * This is the reverse of compress() and the blocks built by pcl_page(), and
+ * is used to check that what's printed is what was given. Each page is a
+ * Set Compression Method command (\e*b1030m) with a Transfer Raster Data
+ * parameter for each block (the length of the block plus two, w, a zero
+ * byte, and the number of rows), concluded by 1030M. See compress() for how
+ * each row is encoded.
+ *
+ * The printer is taken to forget the last row at the beginning of each
+ * block, so the first row of a block which refers to the last row (or
+ * stops short of the width of the page) is an error.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "decode.h"
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+static const char *decode_row(struct decoded *page, const uint8_t **in,
+	const uint8_t *end, bool first);
+static const char *decode_field(size_t *value, const uint8_t **in,
+	const uint8_t *end, size_t field, size_t largest);
+static void append_row(struct decoded *page, size_t length);
+
+static const uint8_t method[] = "\e*b1030m";
+
+/**
+ * Find the next page.
+ *
+ * @param in Where to start looking (advanced past the beginning of the
+ * page, if found)
+ * @param end End of the data
+ * @return True if a page was found
+ */
+bool decode_next(const uint8_t **in, const uint8_t *end) {
+	size_t length = sizeof(method) - 1;
+	for (const uint8_t *p = *in; (size_t)(end - p) >= length; p++) {
+		p = memchr(p, method[0], end - p - length + 1);
+		if (!p) break;
+		if (!memcmp(p, method, length)) {
+			*in = p + length;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Decode the blocks of a page, up to the end of the command.
+ *
+ * @param page Page to decode into (zeroed, or kept from an earlier page)
+ * @param in First block of the page (see decode_next()), advanced past the
+ * end of the page
+ * @param end End of the data
+ * @return NULL, or what was wrong with the page
+ */
+const char *decode_page(struct decoded *page, const uint8_t **in,
+		const uint8_t *end) {
+	page->row_length = 0;
+	page->row_count = 0;
+	page->first_length = SIZE_MAX;
+	memset(page->row, 0, page->dirty);
+	page->dirty = 0;
+
+	for (const uint8_t *p = *in;;) {
+		// Length of the block (plus two), or the method again at the end.
+		size_t length = 0;
+		if (p == end || *p < '0' || *p > '9')
+			return "expected a block";
+		for (; p < end && *p >= '0' && *p <= '9'; p++) {
+			length = length * 10 + *p - '0';
+			if (length > DECODE_ROW_MAX * 256) return "block is too long";
+		}
+		if (p == end) return "page ends in a block header";
+		if (*p == 'M') {
+			if (length != 1030) return "page ends with another method";
+			if (page->first_length < page->row_length)
+				return "first row of a block stops short of the page";
+			*in = p + 1;
+			return NULL;
+		}
+		if (*p++ != 'w') return "expected w after a block length";
+
+		// The block: a zero byte, the number of rows, and the rows.
+		if (length < 3 || (size_t)(end - p) < length)
+			return "block is cut short";
+		if (p[0]) return "block doesn't begin with a zero byte";
+		const uint8_t *block_end = p + length;
+		unsigned int rows = p[1];
+		p += 2;
+		if (!rows) return "block has no rows";
+		for (unsigned int row = 0; row < rows; row++) {
+			const char *error = decode_row(page, &p, block_end, !row);
+			if (error) return error;
+		}
+		if (p != block_end) return "block is longer than its rows";
+	}
+}
+
+/**
+ * Free the rows of a decoded page.
+ *
+ * @param page Page
+ */
+void decode_free(struct decoded *page) {
+	free(page->rows);
+	page->rows = NULL;
+	page->capacity = 0;
+}
+
+/**
+ * Decode a row and add it to the page.
+ *
+ * @param page Page (the last row is replaced)
+ * @param in Compressed row (advanced past it)
+ * @param end End of the block
+ * @param first Whether the row begins a block
+ * @return NULL, or what was wrong with the row
+ */
+static const char *decode_row(struct decoded *page, const uint8_t **in,
+		const uint8_t *end, bool first) {
+	const uint8_t *p = *in;
+	if (p == end) return "block ends before its last row";
+	uint8_t groups = *p++;
+
+	if (groups == 255) {
+		memset(page->row, 0, page->dirty);
+		page->dirty = 0;
+		*in = p;
+		append_row(page, 0);
+		return NULL;
+	}
+	if (first && !groups)
+		return "block begins with a row the same as the last row";
+
+	size_t position = 0;
+	for (uint8_t group = 0; group < groups; group++) {
+		if (p == end) return "row ends before its last group";
+		uint8_t header = *p++;
+		size_t skip, count;
+		const char *error;
+		bool repeat = header & 0x80;
+		if (repeat) {
+			// Repeated byte: 2 bits of skip, 5 of count less 2.
+			if ((error = decode_field(&skip, &p, end, header >> 5 & 3, 3)) ||
+					(error = decode_field(&count, &p, end, header & 31, 31)))
+				return error;
+			count += 2;
+		} else {
+			// Bytes: 4 bits of skip, 3 of count less 1.
+			if ((error = decode_field(&skip, &p, end, header >> 3 & 15, 15)) ||
+					(error = decode_field(&count, &p, end, header & 7, 7)))
+				return error;
+			count += 1;
+		}
+		if (first && skip)
+			return "block begins with a row compressed against the last row";
+		if (skip > DECODE_ROW_MAX || count > DECODE_ROW_MAX - skip ||
+				position + skip + count > DECODE_ROW_MAX)
+			return "row is too long";
+		position += skip;
+		if ((size_t)(end - p) < (repeat ? 1 : count))
+			return "group is cut short";
+		if (repeat)
+			memset(page->row + position, *p++, count);
+		else {
+			memcpy(page->row + position, p, count);
+			p += count;
+		}
+		position += count;
+	}
+
+	// The rest of a row is the same as the last row, except at the beginning
+	// of a block, where there's no last row.
+	if (first) {
+		if (page->dirty > position)
+			memset(page->row + position, 0, page->dirty - position);
+		page->dirty = position;
+		if (position < page->first_length) page->first_length = position;
+	} else if (position > page->dirty)
+		page->dirty = position;
+	*in = p;
+	append_row(page, position);
+	return NULL;
+}
+
+/**
+ * Decode a count from a header field and any extension bytes after it.
+ *
+ * @param value Set to the count
+ * @param in Extension bytes (advanced past them)
+ * @param end End of the block
+ * @param field Value of the header field
+ * @param largest Largest value of the header field (which means extension
+ * bytes follow)
+ * @return NULL, or what was wrong with the count
+ */
+static const char *decode_field(size_t *value, const uint8_t **in,
+		const uint8_t *end, size_t field, size_t largest) {
+	*value = field;
+	if (field < largest) return NULL;
+	uint8_t byte;
+	do {
+		if (*in == end) return "count is cut short";
+		byte = *(*in)++;
+		*value += byte;
+		if (*value > DECODE_ROW_MAX * 2) return "count is too large";
+	} while (byte == 255);
+	return NULL;
+}
+
+/**
+ * Add the last row decoded to the page.
+ *
+ * Rows are kept at the length of the longest row so far. If the row is
+ * longer, the rows before it are spread out to its length (the bytes past
+ * the end of a shorter row are all zero).
+ *
+ * @param page Page
+ * @param length Length of the row as encoded
+ */
+static void append_row(struct decoded *page, size_t length) {
+	size_t old_length = page->row_length;
+	if (length > old_length) page->row_length = length;
+	size_t needed = (page->row_count + 1) * page->row_length;
+	if (needed > page->capacity) {
+		size_t capacity = page->capacity ? page->capacity : 1 << 20;
+		while (capacity < needed) capacity *= 2;
+		page->rows = realloc(page->rows, capacity);
+		if (!page->rows) err(EX_OSERR, "allocate decoded page");
+		page->capacity = capacity;
+	}
+	if (page->row_length != old_length)
+		for (size_t row = page->row_count; row--;) {
+			memmove(page->rows + row * page->row_length,
+				page->rows + row * old_length, old_length);
+			memset(page->rows + row * page->row_length + old_length, 0,
+				page->row_length - old_length);
+		}
+	memcpy(page->rows + page->row_count++ * page->row_length, page->row,
+		page->row_length);
+}
@@ -0,0 +1,25 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest row decoded, in bytes. The widest printable row (with padding) is
+// 2496 bytes.
+#define DECODE_ROW_MAX 4096
+
+/**
+ * A page decoded from compression method 1030.
+ */
+struct decoded {
+	uint8_t *rows; // Decoded rows, one after the other
+	size_t row_length; // Length of each row (the longest encoded)
+	size_t row_count;
+	size_t capacity; // Size of the row buffer in bytes
+	uint8_t row[DECODE_ROW_MAX]; // Last row decoded
+	size_t dirty; // Length of the last row which may not be zero
+	size_t first_length; // Shortest first row of a block (not blank)
+};
+
+bool decode_next(const uint8_t **in, const uint8_t *end);
+const char *decode_page(struct decoded *page, const uint8_t **in,
+	const uint8_t *end);
+void decode_free(struct decoded *page);
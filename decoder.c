@@ -0,0 +1,77 @@
+/**
+ * Decode the output of oh_brother back into PBM images.
+ *
+ * Reads a job (as sent to the printer) from the file given, or standard
+ * input, and writes each page's raster data to standard output as a PBM
+ * (P4) image, one after the other. The images are what the printer is
+ * given: only the printable part of each page, with any padding, and with
+ * rows encoded twice (in 600x300 and HQ1200A modes, or for input scaled up)
+ * appearing twice. A page which can't be decoded stops with an error.
+ *
+ * The width of a page isn't given by its encoding: rows are only as long as
+ * the bytes they encode, and white at the end of a row needn't be encoded
+ * after a blank row. Each image is as wide as the widest row of the job so
+ * far, which is the width of the page unless every block of the pages so
+ * far began with a blank row.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "decode.h"
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+static uint8_t *read_all(FILE *file, size_t *length);
+
+int main(int argc, char **argv) {
+	if (argc > 2) errx(EX_USAGE, "usage: oh_brother_decode [file]");
+	FILE *file = argc > 1 ? fopen(argv[1], "r") : stdin;
+	if (!file) err(EX_NOINPUT, "open %s", argv[1]);
+	size_t length;
+	uint8_t *job = read_all(file, &length);
+
+	static struct decoded page;
+	size_t width = 1;
+	const uint8_t *in = job, *end = job + length;
+	for (unsigned long count = 1; decode_next(&in, end); count++) {
+		const char *error = decode_page(&page, &in, end);
+		if (error) errx(EX_DATAERR, "page %lu: %s", count, error);
+		if (page.row_length > width) width = page.row_length;
+		printf("P4\n%zu %zu\n", width * 8, page.row_count);
+		for (size_t row = 0; row < page.row_count; row++) {
+			fwrite(page.rows + row * page.row_length, 1, page.row_length,
+				stdout);
+			for (size_t i = page.row_length; i < width; i++)
+				putchar(0);
+		}
+	}
+	if (fflush(stdout)) err(EX_IOERR, "write output");
+	decode_free(&page);
+	free(job);
+}
+
+/**
+ * Read the whole of a file into memory.
+ *
+ * @param file File
+ * @param length Set to the length read
+ * @return What was read
+ */
+static uint8_t *read_all(FILE *file, size_t *length) {
+	size_t capacity = 1 << 20;
+	uint8_t *data = malloc(capacity);
+	if (!data) err(EX_OSERR, "allocate input buffer");
+	*length = 0;
+	for (;;) {
+		*length += fread(data + *length, 1, capacity - *length, file);
+		if (*length < capacity) break;
+		capacity *= 2;
+		data = realloc(data, capacity);
+		if (!data) err(EX_OSERR, "allocate input buffer");
+	}
+	if (ferror(file)) err(EX_IOERR, "read input");
+	return data;
+}
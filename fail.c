@@ -0,0 +1,84 @@
+/**
+ * Report errors which end a job.
+ *
+ * For the program, an error ends the process with a message, as err() and
+ * errx() do. A job run by the library can't take the process with it, so
+ * the thread working on the job catches its errors instead: fail_catch()
+ * is called on the way in to the library, and an error on that thread
+ * keeps the message and returns false. The function failing returns an
+ * error in turn, as do its callers, back out of the library, each leaving
+ * what it was working on as it was (so the thread's buffers can be used by
+ * the next job).
+ *
+ * Errors are only caught on the thread which called fail_catch(), so code
+ * running on worker threads mustn't fail. It leaves that to the thread
+ * which gave it work.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "fail.h"
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static __thread struct failure *catcher; // Where errors go (NULL to exit)
+
+/**
+ * Catch errors on this thread until released.
+ *
+ * @param failure Where to keep the error
+ */
+void fail_catch(struct failure *failure) {
+	catcher = failure;
+}
+
+/**
+ * Stop catching errors on this thread (so they end the process again).
+ */
+void fail_release() {
+	catcher = NULL;
+}
+
+/**
+ * Fail with a message, as errx() would, unless errors are caught.
+ *
+ * @param status Exit status
+ * @param format Format of the message
+ * @return False (if errors are caught)
+ */
+bool fail(int status, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	if (!catcher) verrx(status, format, args);
+	vsnprintf(catcher->message, FAIL_MESSAGE, format, args);
+	va_end(args);
+	catcher->status = status;
+	return false;
+}
+
+/**
+ * Fail with a message followed by the error in errno, as err() would,
+ * unless errors are caught.
+ *
+ * @param status Exit status
+ * @param format Format of the message
+ * @return False (if errors are caught)
+ */
+bool fail_errno(int status, const char *format, ...) {
+	int error = errno;
+	va_list args;
+	va_start(args, format);
+	if (!catcher) verr(status, format, args);
+	int length = vsnprintf(catcher->message, FAIL_MESSAGE, format, args);
+	va_end(args);
+	if (length >= 0 && length < FAIL_MESSAGE)
+		snprintf(catcher->message + length, FAIL_MESSAGE - length, ": %s",
+			strerror(error));
+	catcher->status = status;
+	errno = error;
+	return false;
+}
@@ -0,0 +1,19 @@
+#include <stdbool.h>
+
+// Longest message kept for an error caught by a thread (with the null).
+#define FAIL_MESSAGE 256
+
+/**
+ * An error caught by a thread rather than ending the process.
+ */
+struct failure {
+	int status; // Exit status the program would have ended with
+	char message[FAIL_MESSAGE];
+};
+
+void fail_catch(struct failure *failure);
+void fail_release();
+bool fail(int status, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+bool fail_errno(int status, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
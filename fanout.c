@@ -0,0 +1,299 @@
+/**
+ * Split the pages of a job across several printers.
+ *
+ * Each printer (or file, or FIFO) is a target with a thread of its own,
+ * which sets the printer up for the job, encodes the pages it's given, and
+ * wraps the job up, just as for a job of its own. Pages are dealt out in
+ * ranges of consecutive pages, each range to the target with the most room
+ * for pages waiting to be encoded, so a faster printer takes more ranges.
+ * Each printer prints its ranges in order. Only the input is shared: the
+ * calling thread reads the pages in order and hands them to the targets.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "fanout.h"
+#include "input.h"
+#include "output.h"
+#include "parameters.h"
+#include "pcl.h"
+#include "pjl.h"
+#include "pool.h"
+#include "queue.h"
+#include "sender.h"
+#include "trace.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * A page read for a target.
+ */
+struct slot {
+	uint8_t *buffer; // Page buffer (unless the input is mapped)
+	uint8_t *page; // Page data (in the page buffer or the mapped input)
+	unsigned long number; // Page number in the job (starting from 1)
+};
+
+/**
+ * What the targets share.
+ */
+struct fanout {
+	size_t row_length;
+	size_t row_count;
+	struct params params; // Parameters of the job, taken by each target
+	double started; // Time the job began
+};
+
+/**
+ * A printer (or file) taking some of the pages, and its thread.
+ */
+struct target {
+	const struct fanout *fanout;
+	const char *name; // As given
+	int fd;
+	bool connected; // True if connected to a printer over the network
+	struct slot *slots;
+	struct queue empty; // Slots ready to be read into
+	struct queue read; // Slots read and ready to be encoded (null to end)
+	struct output out;
+	pthread_t thread;
+	unsigned long first; // First page of the range being dealt
+	unsigned long pages;
+	size_t bytes;
+	double seconds; // Time from the beginning of the job to the end
+};
+
+static void target_open(struct target *target, const char *name,
+	unsigned int depth);
+static struct target *target_choose(struct target *targets, size_t count,
+	const struct target *last);
+static void *target_run(void *arg);
+static void range_report(const struct target *target, unsigned long last);
+static double now();
+
+/**
+ * Read pages until the input data is consumed, and send them to the
+ * targets.
+ *
+ * Partial pages of data are not processed.
+ *
+ * @param list Targets, separated by commas: HOST:PORT for a printer on the
+ * network, or the path of a file (or FIFO)
+ * @param row_length Length of input data rows in bytes
+ * @param row_count Number of input data rows in each page
+ * @param depth Number of pages which may be waiting for each target
+ * @param range_pages Number of pages in each range
+ */
+void fanout_run(const char *list, size_t row_length, size_t row_count,
+		unsigned int depth, unsigned int range_pages) {
+	struct fanout fanout = {
+		.row_length = row_length,
+		.row_count = row_count,
+		.started = now()
+	};
+	param_get(&fanout.params);
+
+	size_t count = 1;
+	for (const char *c = list; *c; c++)
+		if (*c == ',') count++;
+	struct target *targets = calloc(count, sizeof(*targets));
+	char *names = strdup(list);
+	if (!targets || !names) err(EX_OSERR, "allocate targets");
+	char *next = names;
+	for (size_t i = 0; i < count; i++) {
+		char *name = strsep(&next, ",");
+		if (!*name)
+			errx(EX_USAGE, "fan_out must be targets separated by commas");
+		targets[i].fanout = &fanout;
+		target_open(&targets[i], name, depth);
+	}
+
+	// Deal out the pages as they're read. A range is given to a target all
+	// at once, so the reader waits on that target while it's full.
+	unsigned long number = 0;
+	unsigned int left = 0;
+	struct target *target = NULL;
+	for (;;) {
+		if (!left) {
+			if (target) range_report(target, number);
+			target = target_choose(targets, count, target);
+			target->first = number + 1;
+			left = range_pages;
+		}
+		struct slot *slot = queue_pop(&target->empty);
+		if (!(slot->page = input_page(slot->buffer))) {
+			queue_push(&target->empty, slot);
+			break;
+		}
+		slot->number = ++number;
+		queue_push(&target->read, slot);
+		left--;
+	}
+	if (number >= target->first) range_report(target, number);
+
+	for (size_t i = 0; i < count; i++)
+		queue_push(&targets[i].read, NULL);
+	for (size_t i = 0; i < count; i++) {
+		target = &targets[i];
+		pthread_join(target->thread, NULL);
+		if (p_verbose)
+			warnx("%s: %lu pages, %zu bytes in %.3f s (%.3f s writing, "
+				"%.3f s stalled)", target->name, target->pages,
+				target->bytes, target->seconds, target->out.seconds,
+				target->out.stalled);
+		for (unsigned int j = 0; j < depth; j++)
+			pool_put(target->slots[j].buffer, row_count * row_length);
+		free(target->slots);
+		queue_destroy(&target->read);
+		queue_destroy(&target->empty);
+		output_free(&target->out);
+	}
+	free(names);
+	free(targets);
+}
+
+/**
+ * Open a target, set aside its page buffers, and start its thread.
+ *
+ * A target with a colon but no slash is the host and port of a printer on
+ * the network. Anything else is a file, which is created if need be.
+ *
+ * @param target Target (zeroed, with what the targets share set)
+ * @param name Name of the target
+ * @param depth Number of pages which may be waiting for the target
+ */
+static void target_open(struct target *target, const char *name,
+		unsigned int depth) {
+	target->name = name;
+	if (strchr(name, ':') && !strchr(name, '/')) {
+		target->fd = sender_connect(name);
+		target->connected = true;
+	} else {
+		target->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (target->fd < 0) err(EX_CANTCREAT, "open %s", name);
+	}
+
+	// Each queue has room for every slot plus the end marker, so pushing
+	// never has to wait.
+	queue_init(&target->empty, depth + 1);
+	queue_init(&target->read, depth + 1);
+	target->slots = calloc(depth, sizeof(*target->slots));
+	if (!target->slots) err(EX_OSERR, "allocate page slots");
+	size_t row_length = target->fanout->row_length;
+	size_t row_count = target->fanout->row_count;
+	for (unsigned int i = 0; i < depth; i++) {
+		if (!input_mapped())
+			target->slots[i].buffer = pool_get(row_count * row_length);
+		queue_push(&target->empty, &target->slots[i]);
+	}
+
+	int error = pthread_create(&target->thread, NULL, target_run, target);
+	if (error) {
+		errno = error;
+		err(EX_OSERR, "start target thread");
+	}
+}
+
+/**
+ * Choose the target to deal the next range to: the one with the most room
+ * for pages, or if several have as much, the first of them after the last
+ * target chosen.
+ *
+ * @param targets Targets
+ * @param count Number of targets
+ * @param last Last target chosen (NULL if none)
+ * @return Target
+ */
+static struct target *target_choose(struct target *targets, size_t count,
+		const struct target *last) {
+	size_t start = last ? (last - targets + 1) % count : 0;
+	struct target *best = NULL;
+	size_t most = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct target *target = &targets[(start + i) % count];
+		size_t room = queue_count(&target->empty);
+		if (!best || room > most) {
+			best = target;
+			most = room;
+		}
+	}
+	return best;
+}
+
+/**
+ * Set up the printer of a target, encode and write the pages it's given,
+ * and wrap up the job. Runs on the thread of the target.
+ *
+ * @param arg Target
+ * @return Nothing
+ */
+static void *target_run(void *arg) {
+	struct target *target = arg;
+	const struct fanout *fanout = target->fanout;
+	param_set(&fanout->params);
+	trace_thread("target");
+
+	uint64_t start = trace_now();
+	pjl_begin(&target->out);
+	pcl_begin(&target->out);
+	target->bytes += output_flush(&target->out, target->fd);
+	trace_event("prologue", start);
+
+	struct slot *slot;
+	while ((slot = queue_pop(&target->read))) {
+		pcl_page(&target->out, slot->page, fanout->row_length,
+			fanout->row_count);
+		struct output before = target->out;
+		size_t bytes = output_flush(&target->out, target->fd);
+		target->bytes += bytes;
+		target->pages++;
+		if (p_verbose)
+			output_report(slot->number, bytes,
+				target->out.writes - before.writes,
+				target->out.seconds - before.seconds,
+				target->out.stalled - before.stalled);
+		queue_push(&target->empty, slot);
+	}
+
+	start = trace_now();
+	pjl_end(&target->out);
+	target->bytes += output_flush(&target->out, target->fd);
+	if (target->connected) sender_finish(target->fd);
+	else if (close(target->fd)) err(EX_IOERR, "write %s", target->name);
+	trace_event("epilogue", start);
+	target->seconds = now() - fanout->started;
+	return NULL;
+}
+
+/**
+ * Report which target a range of pages was dealt to (on standard error),
+ * if verbose.
+ *
+ * @param target Target
+ * @param last Last page of the range
+ */
+static void range_report(const struct target *target, unsigned long last) {
+	if (p_verbose)
+		warnx("pages %lu-%lu: %s", target->first, last, target->name);
+}
+
+/**
+ * Get the time.
+ *
+ * @return Time in seconds from an arbitrary point
+ */
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
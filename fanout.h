@@ -0,0 +1,4 @@
+#include <stddef.h>
+
+void fanout_run(const char *list, size_t row_length, size_t row_count,
+	unsigned int depth, unsigned int range_pages);
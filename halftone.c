@@ -0,0 +1,299 @@
+/**
+ * Halftone 8-bit gray raster data to one bit per dot.
+ *
+ * Each dot is compared with a threshold from a screen (a small matrix of
+ * thresholds tiled across the page) and set (black) if it's darker. The
+ * comparisons and the packing of eight dots into each byte are done in one
+ * pass, by vector kernels (SSE2 or AVX2) where the CPU supports them. The
+ * thresholds for each row of the screen are laid out once across the width
+ * of the page, so the kernels just compare two rows of bytes. Pages are
+ * split into bands of rows which are halftoned at the same time on worker
+ * threads.
+ *
+ * Gray input has one byte per dot, 0 for black through 255 for white (as
+ * from Ghostscript's gray device).
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "halftone.h"
+#include "parameters.h"
+#include "workers.h"
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HALFTONE_X86
+#include <immintrin.h>
+#endif
+
+// Number of rows in each band halftoned by a worker.
+#define BAND_ROWS 64
+
+// Rows (and columns) of the largest screen.
+#define SCREEN_MAX 16
+
+/**
+ * A page being halftoned.
+ */
+struct job {
+	uint8_t *out;
+	const uint8_t *in;
+	size_t width; // Width in dots (bytes of each input row)
+	size_t rows;
+	size_t y; // Row of the screen the first row falls on
+};
+
+static void build_screen(enum Screen screen, size_t width);
+static void halftone_band(void *arg, size_t index);
+static void row_scalar(uint8_t *out, const uint8_t *in,
+	const uint8_t *thresholds, size_t width);
+#ifdef HALFTONE_X86
+static void row_sse2(uint8_t *out, const uint8_t *in,
+	const uint8_t *thresholds, size_t width);
+static void row_avx2(uint8_t *out, const uint8_t *in,
+	const uint8_t *thresholds, size_t width);
+#endif
+
+static struct workers *workers;
+static unsigned int worker_threads; // Threads in the pool (with this one)
+
+// Thresholds for each row of the screen, laid out across the page.
+static uint8_t *thresholds;
+static size_t threshold_width; // Width of each row of thresholds
+static size_t screen_size; // Rows (and columns) of the screen
+static enum Screen built_screen;
+
+static void (*halftone_row)(uint8_t *out, const uint8_t *in,
+	const uint8_t *thresholds, size_t width) = row_scalar;
+static const char *kernel_name = "scalar";
+
+/**
+ * Halftone rows of 8-bit gray raster data.
+ *
+ * @param out Buffer for the halftoned rows (one bit per dot, each row
+ * padded to a full byte)
+ * @param in Gray rows (one byte per dot)
+ * @param width Width in dots
+ * @param rows Number of rows
+ * @param y Row of the page the first row falls on (so the screen lines up
+ * from one call to the next)
+ */
+void halftone_page(uint8_t *out, const uint8_t *in, size_t width,
+		size_t rows, size_t y) {
+	if (!thresholds || built_screen != p_screen || threshold_width < width)
+		build_screen(p_screen, width);
+
+	struct job job = {out, in, width, rows, y};
+	size_t count = (rows + BAND_ROWS - 1) / BAND_ROWS;
+	if (p_threads == 1 || count == 1) {
+		for (size_t i = 0; i < count; i++)
+			halftone_band(&job, i);
+		return;
+	}
+	if (workers && worker_threads != p_threads) {
+		workers_destroy(workers);
+		workers = NULL;
+	}
+	if (!workers) {
+		workers = workers_create(p_threads - 1);
+		worker_threads = p_threads;
+	}
+	workers_run(workers, halftone_band, &job, count);
+}
+
+/**
+ * Get the name of the halftoning kernels selected.
+ *
+ * @return Name of the kernels
+ */
+const char *halftone_kernels() {
+	return kernel_name;
+}
+
+/**
+ * Halftone one band of rows of a page. Runs on worker threads.
+ *
+ * @param arg Page being halftoned
+ * @param index Index of the band to halftone
+ */
+static void halftone_band(void *arg, size_t index) {
+	struct job *job = arg;
+	size_t out_length = (job->width + 7) >> 3;
+	size_t first = index * BAND_ROWS;
+	size_t last = first + BAND_ROWS < job->rows ? first + BAND_ROWS :
+		job->rows;
+	for (size_t row = first; row < last; row++)
+		halftone_row(job->out + row * out_length, job->in + row * job->width,
+			thresholds + (job->y + row) % screen_size * threshold_width,
+			job->width);
+}
+
+/**
+ * Lay out the thresholds of a screen across the width of a page, and
+ * select the kernels.
+ *
+ * Thresholds run from 1 through 255, so black (0) is always set and white
+ * (255) never is.
+ *
+ * @param screen Screen
+ * @param width Width of the page in dots
+ */
+static void build_screen(enum Screen screen, size_t width) {
+	uint8_t matrix[SCREEN_MAX][SCREEN_MAX];
+	size_t size, cells;
+	switch (screen) {
+		case SC_THRESHOLD:
+			// Half way.
+			size = 1;
+			matrix[0][0] = 128;
+			break;
+		case SC_BAYER:
+			// Dispersed dots: the 16x16 Bayer matrix, built up by doubling
+			// from 1x1.
+			matrix[0][0] = 0;
+			for (size = 1; size < 16; size *= 2)
+				for (size_t y = 0; y < size; y++)
+					for (size_t x = 0; x < size; x++) {
+						uint8_t m = matrix[y][x] * 4;
+						matrix[y][x] = m;
+						matrix[y][x + size] = m + 2;
+						matrix[y + size][x] = m + 3;
+						matrix[y + size][x + size] = m + 1;
+					}
+			cells = size * size;
+			for (size_t y = 0; y < size; y++)
+				for (size_t x = 0; x < size; x++)
+					matrix[y][x] = matrix[y][x] * 255 / cells + 1;
+			break;
+		case SC_CLUSTERED:
+		default:
+			// Clustered dots: an 8x8 cell which darkens from the middle out,
+			// so each dot grows as a round spot (which toner holds better
+			// than scattered dots).
+			size = 8;
+			cells = size * size;
+			for (size_t y = 0; y < size; y++)
+				for (size_t x = 0; x < size; x++) {
+					// Rank by distance from the middle (farthest first),
+					// breaking ties by position.
+					int dy = 2 * (int)y - 7, dx = 2 * (int)x - 7;
+					size_t rank = 0;
+					for (size_t v = 0; v < size; v++)
+						for (size_t u = 0; u < size; u++) {
+							int dv = 2 * (int)v - 7, du = 2 * (int)u - 7;
+							int d = dy * dy + dx * dx, e = dv * dv + du * du;
+							if (e > d || (e == d && v * size + u < y * size + x))
+								rank++;
+						}
+					matrix[y][x] = rank * 255 / cells + 1;
+				}
+	}
+
+	// Pad each row of thresholds so kernels may read a whole vector past
+	// the last full byte.
+	size_t padded = (width + 63) & ~(size_t)31;
+	free(thresholds);
+	thresholds = malloc(size * padded);
+	if (!thresholds) err(EX_OSERR, "allocate halftone screen");
+	for (size_t y = 0; y < size; y++)
+		for (size_t x = 0; x < padded; x++)
+			thresholds[y * padded + x] = matrix[y][x % size];
+	threshold_width = padded;
+	screen_size = size;
+	built_screen = screen;
+
+	halftone_row = row_scalar;
+	kernel_name = "scalar";
+#ifdef HALFTONE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		halftone_row = row_avx2;
+		kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		halftone_row = row_sse2;
+		kernel_name = "sse2";
+	}
+#endif
+}
+
+/**
+ * Halftone a row, a byte at a time.
+ *
+ * @param out Halftoned row
+ * @param in Gray row
+ * @param thresholds Thresholds for the row
+ * @param width Width in dots
+ */
+static void row_scalar(uint8_t *out, const uint8_t *in,
+		const uint8_t *thresholds, size_t width) {
+	for (size_t x = 0; x < width; x += 8) {
+		uint8_t byte = 0;
+		for (size_t bit = 0; bit < 8 && x + bit < width; bit++)
+			byte |= (in[x + bit] < thresholds[x + bit]) << (7 - bit);
+		*out++ = byte;
+	}
+}
+
+#ifdef HALFTONE_X86
+
+// The vector kernels compare 16 (SSE2) or 32 (AVX2) dots at once. Bytes are
+// compared as signed after flipping their top bits, which orders them the
+// same as unsigned. The comparisons are gathered into a bit mask with the
+// first dot in the lowest bit, but the first dot goes in the highest bit of
+// each output byte, so the bits of each byte are reversed: by table for
+// SSE2, and by reversing each eight bytes before gathering for AVX2.
+
+static const uint8_t reverse[256] = {
+#define R2(n) n, n + 128, n + 64, n + 192
+#define R4(n) R2(n), R2(n + 32), R2(n + 16), R2(n + 48)
+#define R6(n) R4(n), R4(n + 8), R4(n + 4), R4(n + 12)
+	R6(0), R6(2), R6(1), R6(3)
+#undef R6
+#undef R4
+#undef R2
+};
+
+__attribute__((target("sse2")))
+static void row_sse2(uint8_t *out, const uint8_t *in,
+		const uint8_t *thresholds, size_t width) {
+	const __m128i flip = _mm_set1_epi8((char)0x80);
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i gray = _mm_xor_si128(
+			_mm_loadu_si128((const __m128i *)(in + x)), flip);
+		__m128i threshold = _mm_xor_si128(
+			_mm_loadu_si128((const __m128i *)(thresholds + x)), flip);
+		unsigned int mask = _mm_movemask_epi8(
+			_mm_cmplt_epi8(gray, threshold));
+		*out++ = reverse[mask & 0xff];
+		*out++ = reverse[mask >> 8];
+	}
+	row_scalar(out, in + x, thresholds + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void row_avx2(uint8_t *out, const uint8_t *in,
+		const uint8_t *thresholds, size_t width) {
+	const __m256i flip = _mm256_set1_epi8((char)0x80);
+	const __m256i order = _mm256_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	size_t x = 0;
+	for (; x + 32 <= width; x += 32) {
+		__m256i gray = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i *)(in + x)), flip);
+		__m256i threshold = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i *)(thresholds + x)), flip);
+		uint32_t mask = _mm256_movemask_epi8(_mm256_shuffle_epi8(
+			_mm256_cmpgt_epi8(threshold, gray), order));
+		memcpy(out, &mask, sizeof(mask));
+		out += sizeof(mask);
+	}
+	row_sse2(out, in + x, thresholds + x, width - x);
+}
+
+#endif // HALFTONE_X86
@@ -0,0 +1,6 @@
+#include <stddef.h>
+#include <stdint.h>
+
+void halftone_page(uint8_t *out, const uint8_t *in, size_t width,
+	size_t rows, size_t y);
+const char *halftone_kernels();
@@ -0,0 +1,802 @@
+/**
+ * Read pages of raster data from the input.
+ *
+ * If the input is a regular file (a spooled job, for example), it's mapped
+ * into memory and pages are used right where they are in the mapping rather
+ * than being copied into a page buffer. Otherwise (a pipe, for example),
+ * pages are read into a page buffer given by the caller.
+ *
+ * The input may be raw raster data, PBM (P4, as from Ghostscript's pbmraw
+ * device), or CUPS raster, which are told apart by their first bytes. PBM
+ * and CUPS raster inputs are a series of pages, each with a header giving
+ * its size. Each header is read as its page is reached, and only the pixel
+ * data following it is returned (still without copying it, if mapped and
+ * uncompressed). A page of another size than the first is read a line at a
+ * time by its own size, then cropped or padded with white to the size of the
+ * first page, so one odd page doesn't stop a job which is already printing.
+ * A page at another resolution than the first is skipped. If a mapped input
+ * has any page of another size, no page is used where it is.
+ *
+ * Compressed (version 2) CUPS raster is decoded right into the caller's
+ * buffer. A line the CUPS rasterizer marked as repeated is copied from the
+ * line before it within a page. When rows are taken one at a time, it isn't
+ * copied at all: the last row is returned again, which compresses to
+ * "same as the last row".
+ *
+ * Raw input may instead be 8-bit gray (one byte per dot), which is
+ * halftoned to one bit per dot as each page is read. Gray pages are
+ * halftoned from where they are in the mapping, or from a buffer of their
+ * own when read from a stream.
+ *
+ * Input at another resolution than the printer's is scaled as it's read,
+ * from the mapping or from a buffer of its own, into the caller's buffer.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "input.h"
+#include "halftone.h"
+#include "parameters.h"
+#include "scale.h"
+#include "trace.h"
+#include <ctype.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+// Smallest range to read ahead in a mapped input.
+#define READ_AHEAD (1 << 20)
+
+// Largest width or height of a page given by the input, in dots.
+#define SIZE_MAX_DOTS 100000
+
+// Length of a CUPS raster page header (cups_page_header2_t), and offsets of
+// the fields used.
+#define CUPS_HEADER 1796
+#define CUPS_HW_RESOLUTION 276
+#define CUPS_PAGE_SIZE 352
+#define CUPS_WIDTH 372
+#define CUPS_HEIGHT 376
+#define CUPS_BITS_PER_COLOR 384
+#define CUPS_BITS_PER_PIXEL 388
+#define CUPS_BYTES_PER_LINE 392
+#define CUPS_COLOR_ORDER 396
+#define CUPS_COLOR_SPACE 400
+
+// CUPS raster color spaces which can be taken (one bit per pixel).
+#define CUPS_CSPACE_W 0
+#define CUPS_CSPACE_K 3
+#define CUPS_CSPACE_SW 18
+
+static FILE *stream;
+static size_t width; // Width of each page in dots (as read)
+static size_t height; // Height of each page in dots (as read)
+static size_t row_length; // Length in bytes of each row (before halftoning)
+static size_t rows_each; // Rows read for each page (or row) taken
+static size_t page_row; // Row of the page read next
+static size_t length; // Most bytes read for each page (or row) taken
+
+// Bytes read from a stream to tell its format, to be read again.
+static uint8_t pending[4];
+static size_t pending_length;
+static size_t pending_offset;
+
+static enum Format {
+	F_RAW,
+	F_PBM,
+	F_CUPS
+} format;
+
+// Pages with headers (PBM or CUPS raster).
+static struct input_size size; // Size of the first page
+static struct input_size image; // Size of the current page
+static size_t image_left; // Bytes of pixel data left in the current page
+static unsigned long image_count; // Number of pages started
+
+// Pages of another size than the first.
+static bool conformed; // True if the current page is cropped or padded
+static size_t image_row; // Lines of the current page read
+static uint8_t *image_line; // Line of the current page
+static size_t image_line_capacity;
+
+// CUPS raster.
+static bool cups_compressed; // True if lines are compressed (version 2)
+static bool cups_little; // True if header fields are little-endian
+static bool cups_invert; // True if a 1 bit is white rather than black
+static size_t line_length; // Length in bytes of each line
+static size_t line_repeat; // Number of times the last line is left to repeat
+static uint8_t *last_line; // Last line decoded
+
+// Raw 8-bit gray input.
+static bool gray; // True if the input is halftoned as it's read
+static uint8_t *gray_buffer; // Gray page read from a stream
+static size_t gray_capacity;
+
+// Input scaled to the printer's resolution.
+static bool scaled; // True if pages are scaled as they're read
+static uint8_t *scale_buffer; // Page read before it's scaled
+static size_t scale_capacity;
+
+// Mapping of the input file, if it's a regular file.
+static uint8_t *map;
+static size_t map_length;
+static size_t map_offset; // Offset of the next page in the mapping
+static size_t map_advised; // Offset of the end of the range read ahead
+static bool in_place; // True if pages are used right from the mapping
+
+static void read_ahead(size_t offset);
+static bool next_image();
+static bool pages_in_place();
+static bool read_pbm_header(struct input_size *page_size);
+static bool read_number(size_t *number);
+static bool read_cups_header(struct input_size *page_size);
+static uint32_t cups_field(const uint8_t *header, size_t offset);
+static uint8_t *read_rows(uint8_t *buffer, size_t rows);
+static uint8_t *read_conformed(uint8_t *buffer, size_t rows);
+static uint8_t *read_image_line();
+static uint8_t *read_gray(uint8_t *buffer, size_t rows);
+static uint8_t *read_lines(uint8_t *buffer, size_t lines);
+static bool read_line(uint8_t *line);
+static bool at_end();
+static int next_byte();
+static size_t read_bytes(uint8_t *to, size_t count);
+static void discard(size_t count);
+
+/**
+ * Open the input and tell its format.
+ *
+ * If the input has page headers, the header of the first page is read.
+ *
+ * @param path Path of the input file, or NULL for standard input
+ */
+void input_open(const char *path) {
+	stream = stdin;
+	if (path) {
+		stream = fopen(path, "r");
+		if (!stream) err(EX_NOINPUT, "open %s", path);
+	}
+	format = F_RAW;
+	pending_length = 0;
+	pending_offset = 0;
+	image_left = 0;
+	image_count = 0;
+	line_repeat = 0;
+	last_line = NULL;
+
+	// Only regular files can be mapped. Start from the current position in
+	// case some of the input has already been consumed. A mapped file stays
+	// resident as it's read, however large, so it isn't mapped when memory
+	// is limited.
+	struct stat st;
+	int fd = fileno(stream);
+	off_t position;
+	void *mapped;
+	const uint8_t *start;
+	size_t start_length;
+	if (!p_memory_limit && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+			(position = lseek(fd, 0, SEEK_CUR)) >= 0 &&
+			position < st.st_size &&
+			(mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+				0)) != MAP_FAILED) {
+		map = mapped;
+		map_length = st.st_size;
+		map_offset = position;
+		map_advised = position;
+		start = map + map_offset;
+		start_length = map_length - map_offset;
+	} else {
+		// The first bytes of a stream can't be put back, so they're kept
+		// to be read again.
+		int c;
+		while (pending_length < sizeof(pending) &&
+				(c = getc(stream)) != EOF)
+			pending[pending_length++] = c;
+		start = pending;
+		start_length = pending_length;
+	}
+
+	// Tell the format from the PBM magic number or CUPS raster sync word,
+	// which also gives the version of CUPS raster and the byte order of
+	// its headers.
+	if (start_length >= 2 && start[0] == 'P' && start[1] == '4') {
+		format = F_PBM;
+		next_byte();
+		next_byte();
+		image_count = 1;
+		if (!read_pbm_header(&size))
+			errx(EX_DATAERR, "input has a bad PBM header");
+	} else if (start_length >= 4 &&
+			(!memcmp(start, "RaS", 3) || !memcmp(start + 1, "SaR", 3))) {
+		format = F_CUPS;
+		cups_little = start[0] != 'R';
+		char version = cups_little ? start[0] : start[3];
+		if (version != 't' && version != '2' && version != '3')
+			errx(EX_DATAERR, "input is an unknown version of CUPS raster");
+		cups_compressed = version == '2';
+		for (int i = 0; i < 4; i++)
+			next_byte();
+		image_count = 1;
+		if (!read_cups_header(&size))
+			errx(EX_DATAERR, "input has a bad CUPS raster header");
+	}
+	if (format != F_RAW) image_left = ((size.width + 7) >> 3) * size.height;
+	image = size;
+	image_row = 0;
+	conformed = false;
+
+	// Compressed pages, pages which must be inverted, and pages which must
+	// be cropped or padded can't be used where they are.
+	in_place = map && !(format == F_CUPS && cups_compressed) &&
+		(format == F_RAW || pages_in_place());
+}
+
+/**
+ * Get the size of each page, if the input gives it.
+ *
+ * @param page_size Set to the size of the first page
+ * @return True if the input gives its size (PBM or CUPS raster)
+ */
+bool input_size(struct input_size *page_size) {
+	if (format == F_RAW) return false;
+	*page_size = size;
+	return true;
+}
+
+/**
+ * Start taking pages from the input.
+ *
+ * Raw input is taken as 8-bit gray if the depth parameter is 8. Pages are
+ * scaled if the input resolution parameter calls for it (except for rows
+ * to be encoded twice, which are left to the encoder).
+ *
+ * @param page_width Width of each page of input in dots
+ * @param page_height Height of each page of input in dots
+ * @param by_row True to take pages a row at a time (once scaled)
+ */
+void input_start(size_t page_width, size_t page_height, bool by_row) {
+	width = page_width;
+	height = page_height;
+	row_length = (width + 7) >> 3;
+	rows_each = !by_row ? height : p_scale_y == SCALE_DOWN ? 2 : 1;
+	page_row = 0;
+	gray = format == F_RAW && p_depth == 8;
+	length = rows_each * (gray ? width : row_length);
+	if (gray) in_place = false;
+
+	scaled = p_scale_x != SCALE_NONE || p_scale_y == SCALE_DOWN;
+	if (scaled && scale_capacity < rows_each * row_length) {
+		free(scale_buffer);
+		scale_buffer = malloc(rows_each * row_length);
+		if (!scale_buffer) err(EX_OSERR, "allocate scaling buffer");
+		scale_capacity = rows_each * row_length;
+	}
+
+	// Pages are used in order, once each. Ask for the first page now and
+	// for each following page as the one before it is used.
+	if (map) {
+		madvise(map, map_length, MADV_SEQUENTIAL);
+		read_ahead(map_offset);
+	}
+}
+
+/**
+ * Check whether pages of the input are used right from memory.
+ *
+ * If so, input_page() doesn't need a buffer.
+ *
+ * @return True if the input is mapped (and pages can be used in place)
+ */
+bool input_mapped() {
+	return in_place && !scaled;
+}
+
+/**
+ * Get the next full page of input.
+ *
+ * Partial pages of data at the end of the input are discarded (with a
+ * warning). For PBM and CUPS raster, the header of each page is read as
+ * it's reached.
+ *
+ * When rows are taken one at a time from compressed CUPS raster, the row
+ * returned may be the last row returned (if the row repeats). The buffer
+ * given should be one other than the one holding the last row.
+ *
+ * When scaling down a row at a time, each row taken is read from two rows
+ * of the input (or one, for the last row of a page of odd height).
+ *
+ * @param buffer Buffer to read the page into (may be NULL if the input is
+ * mapped)
+ * @return Next page, or NULL if no full page is left
+ */
+uint8_t *input_page(uint8_t *buffer) {
+	uint64_t start = trace_now();
+	size_t rows = rows_each < height - page_row ? rows_each :
+		height - page_row;
+	uint8_t *page = read_rows(scaled ? scale_buffer : buffer, rows);
+	if (!page) return NULL;
+	page_row = (page_row + rows) % height;
+	if (scaled) {
+		scale_page(buffer, page, width, rows);
+		page = buffer;
+	}
+	trace_event("read", start);
+	return page;
+}
+
+/**
+ * Close the input.
+ */
+void input_close() {
+	if (map) munmap(map, map_length);
+	map = NULL;
+	in_place = false;
+	if (stream != stdin) fclose(stream);
+	stream = NULL;
+}
+
+/**
+ * Read rows of the input as they are (halftoned, if gray).
+ *
+ * @param buffer Buffer to read the rows into (may be NULL if the input is
+ * mapped)
+ * @param rows Number of rows
+ * @return Rows read, or NULL if not all of them are left
+ */
+static uint8_t *read_rows(uint8_t *buffer, size_t rows) {
+	if (format != F_RAW && !image_left && !next_image()) return NULL;
+
+	size_t length = rows * row_length;
+	uint8_t *page;
+	if (conformed) {
+		if (!(page = read_conformed(buffer, rows))) {
+			discard(0);
+			return NULL;
+		}
+	} else if (format == F_CUPS && cups_compressed) {
+		if (!(page = read_lines(buffer, rows))) {
+			discard(0);
+			return NULL;
+		}
+	} else if (gray) {
+		if (!(page = read_gray(buffer, rows))) return NULL;
+	} else if (in_place) {
+		if (map_length - map_offset < length) {
+			discard(map_length - map_offset);
+			return NULL;
+		}
+		page = map + map_offset;
+		map_offset += length;
+		read_ahead(map_offset);
+	} else {
+		size_t count = read_bytes(buffer, length);
+		if (count != length) {
+			discard(count);
+			return NULL;
+		}
+		page = buffer;
+		if (format == F_CUPS && cups_invert)
+			for (size_t i = 0; i < length; i++)
+				page[i] = ~page[i];
+	}
+	if (format != F_RAW) image_left -= length;
+	return page;
+}
+
+/**
+ * Read rows of a page of another size than the first page, cropped or
+ * padded with white on the right and at the bottom to the size of the first
+ * page. With the last rows of the page, the rest of a taller page is
+ * skipped.
+ *
+ * @param buffer Buffer to read the rows into (pages of another size are
+ * never used where they are, so there is always a buffer)
+ * @param rows Number of rows
+ * @return Rows read, or NULL if the input ended
+ */
+static uint8_t *read_conformed(uint8_t *buffer, size_t rows) {
+	size_t copy = line_length < row_length ? line_length : row_length;
+	for (size_t i = 0; i < rows; i++) {
+		uint8_t *row = buffer + i * row_length;
+		memset(row, 0, row_length);
+		if (image_row == image.height) continue;
+		uint8_t *line = read_image_line();
+		if (!line) return NULL;
+		memcpy(row, line, copy);
+
+		// Dots past the width of a narrower page are white.
+		if (copy == line_length && image.width & 7)
+			row[copy - 1] &= 0xff << (8 - (image.width & 7));
+	}
+	if (image_left == rows * row_length)
+		while (image_row < image.height)
+			if (!read_image_line()) return NULL;
+	return buffer;
+}
+
+/**
+ * Read the next line of a page taken a line at a time.
+ *
+ * @return The line, or NULL if the input ended
+ */
+static uint8_t *read_image_line() {
+	image_row++;
+	if (format == F_CUPS && cups_compressed)
+		return read_lines(image_line, 1);
+	if (read_bytes(image_line, line_length) != line_length) return NULL;
+	if (format == F_CUPS && cups_invert)
+		for (size_t i = 0; i < line_length; i++)
+			image_line[i] = ~image_line[i];
+	return image_line;
+}
+
+/**
+ * Read rows of 8-bit gray input and halftone them.
+ *
+ * @param buffer Buffer for the halftoned rows
+ * @param rows Number of rows
+ * @return Halftoned rows, or NULL if not all of them are left
+ */
+static uint8_t *read_gray(uint8_t *buffer, size_t rows) {
+	size_t length = rows * width;
+	const uint8_t *in;
+	if (map) {
+		if (map_length - map_offset < length) {
+			discard(map_length - map_offset);
+			return NULL;
+		}
+		in = map + map_offset;
+		map_offset += length;
+		read_ahead(map_offset);
+	} else {
+		if (gray_capacity < length) {
+			free(gray_buffer);
+			gray_buffer = malloc(length);
+			if (!gray_buffer) err(EX_OSERR, "allocate gray page buffer");
+			gray_capacity = length;
+		}
+		size_t count = read_bytes(gray_buffer, length);
+		if (count != length) {
+			discard(count);
+			return NULL;
+		}
+		in = gray_buffer;
+	}
+
+	// Rows taken one at a time keep their place in the screen.
+	halftone_page(buffer, in, width, rows, page_row);
+	return buffer;
+}
+
+/**
+ * Ask the system to start reading a page of a mapped input.
+ *
+ * When pages are small (single rows, when streaming), the system is asked
+ * to read ahead a larger range less often.
+ *
+ * @param offset Offset of the page in the mapping
+ */
+static void read_ahead(size_t offset) {
+	if (offset + length <= map_advised || map_advised >= map_length) return;
+	size_t size = length < READ_AHEAD ? READ_AHEAD : length;
+	if (size > map_length - map_advised) size = map_length - map_advised;
+
+	// The address given to madvise() must be aligned to a memory page.
+	size_t align = map_advised % sysconf(_SC_PAGESIZE);
+	madvise(map + map_advised - align, size + align, MADV_WILLNEED);
+	map_advised += size;
+}
+
+/**
+ * Read the header of the next page (PBM or CUPS raster).
+ *
+ * Each page must be the same size as the first, since the size of the
+ * pages of a job (and where they sit on the paper) is set from it.
+ *
+ * @return True if there is another page, false at the end of the input
+ */
+static bool next_image() {
+	for (;;) {
+		if (at_end()) return false;
+		image_count++;
+		if (format == F_PBM) {
+			if (next_byte() != 'P' || next_byte() != '4' ||
+					!read_pbm_header(&image))
+				errx(EX_DATAERR, "page %lu of the input has a bad PBM header",
+					image_count);
+		} else {
+			if (!read_cups_header(&image))
+				errx(EX_DATAERR, "page %lu of the input has a bad CUPS "
+					"raster header", image_count);
+		}
+		image_left = ((size.width + 7) >> 3) * size.height;
+		image_row = 0;
+		line_repeat = 0;
+		conformed = image.width != size.width || image.height != size.height;
+		bool skipped = image.x_resolution != size.x_resolution ||
+			image.y_resolution != size.y_resolution;
+		if (!conformed && !skipped) return true;
+
+		// Lines of the page are read one at a time.
+		line_length = (image.width + 7) >> 3;
+		if (image_line_capacity < line_length) {
+			free(image_line);
+			image_line = malloc(line_length);
+			if (!image_line) err(EX_OSERR, "allocate line buffer");
+			image_line_capacity = line_length;
+		}
+		if (!skipped) {
+			warnx("page %lu of the input is %zux%zu, but page 1 is %zux%zu "
+				"(cropped or padded with white)", image_count, image.width,
+				image.height, size.width, size.height);
+			return true;
+		}
+		warnx("page %lu of the input is at %ux%u DPI, but page 1 is at "
+			"%ux%u DPI (skipped)", image_count, image.x_resolution,
+			image.y_resolution, size.x_resolution, size.y_resolution);
+		while (image_row < image.height)
+			if (!read_image_line()) {
+				discard(0);
+				return false;
+			}
+	}
+}
+
+/**
+ * Check whether every page of a mapped input can be used where it is: the
+ * same size as the first page, and not inverted. Each page header is read,
+ * then the input is left where it was. A bad header is left to be reported
+ * when it's reached.
+ *
+ * @return True if every page can be used where it is
+ */
+static bool pages_in_place() {
+	size_t offset = map_offset, first_line_length = line_length;
+	bool first_invert = cups_invert;
+	struct input_size page_size = size;
+	bool same = !(format == F_CUPS && cups_invert);
+	while (same) {
+		size_t page_length = ((page_size.width + 7) >> 3) *
+			page_size.height;
+		if (map_length - map_offset <= page_length) break;
+		map_offset += page_length;
+		if (format == F_PBM ? next_byte() != 'P' || next_byte() != '4' ||
+				!read_pbm_header(&page_size) : !read_cups_header(&page_size))
+			break;
+		same = page_size.width == size.width &&
+			page_size.height == size.height &&
+			!(format == F_CUPS && cups_invert);
+	}
+	map_offset = offset;
+	line_length = first_line_length;
+	cups_invert = first_invert;
+	return same;
+}
+
+/**
+ * Read the width and height from a PBM header (after the magic number),
+ * and the whitespace before the pixel data. PBM doesn't give a resolution
+ * or paper size.
+ *
+ * @param page_size Set to the size of the page
+ * @return True if the header is good
+ */
+static bool read_pbm_header(struct input_size *page_size) {
+	*page_size = (struct input_size){0};
+	return read_number(&page_size->width) &&
+		read_number(&page_size->height) && page_size->width &&
+		page_size->height;
+}
+
+/**
+ * Read a number from a PBM header, skipping whitespace and comments before
+ * it and the whitespace character after it.
+ *
+ * @param number Set to the number
+ * @return True if a number was read (no greater than SIZE_MAX_DOTS)
+ */
+static bool read_number(size_t *number) {
+	int c = next_byte();
+	while (isspace(c) || c == '#') {
+		if (c == '#')
+			while (c != '\n' && c != EOF) c = next_byte();
+		c = next_byte();
+	}
+	if (!isdigit(c)) return false;
+	*number = 0;
+	do {
+		*number = *number * 10 + c - '0';
+		if (*number > SIZE_MAX_DOTS) return false;
+	} while (isdigit(c = next_byte()));
+	return isspace(c);
+}
+
+/**
+ * Read a CUPS raster page header.
+ *
+ * Only one bit per pixel, black or white, is taken. If a 1 bit is white,
+ * pages are inverted as they're read.
+ *
+ * @param page_size Set to the size of the page
+ * @return True if the header is good and can be taken
+ */
+static bool read_cups_header(struct input_size *page_size) {
+	uint8_t header[CUPS_HEADER];
+	if (read_bytes(header, sizeof(header)) != sizeof(header)) return false;
+
+	*page_size = (struct input_size){
+		.width = cups_field(header, CUPS_WIDTH),
+		.height = cups_field(header, CUPS_HEIGHT),
+		.x_resolution = cups_field(header, CUPS_HW_RESOLUTION),
+		.y_resolution = cups_field(header, CUPS_HW_RESOLUTION + 4),
+		.paper_width = cups_field(header, CUPS_PAGE_SIZE),
+		.paper_height = cups_field(header, CUPS_PAGE_SIZE + 4)
+	};
+	if (!page_size->width || page_size->width > SIZE_MAX_DOTS ||
+			!page_size->height || page_size->height > SIZE_MAX_DOTS)
+		return false;
+
+	uint32_t color_space = cups_field(header, CUPS_COLOR_SPACE);
+	if (cups_field(header, CUPS_BITS_PER_COLOR) != 1 ||
+			cups_field(header, CUPS_BITS_PER_PIXEL) != 1 ||
+			cups_field(header, CUPS_COLOR_ORDER) != 0 ||
+			(color_space != CUPS_CSPACE_W && color_space != CUPS_CSPACE_K &&
+				color_space != CUPS_CSPACE_SW))
+		errx(EX_DATAERR, "CUPS raster input must be black and white, one "
+			"bit per pixel");
+	line_length = (page_size->width + 7) >> 3;
+	if (cups_field(header, CUPS_BYTES_PER_LINE) != line_length)
+		return false;
+	cups_invert = color_space != CUPS_CSPACE_K;
+	return true;
+}
+
+/**
+ * Get a field of a CUPS raster page header.
+ *
+ * @param header Page header
+ * @param offset Offset of the field
+ * @return Value of the field
+ */
+static uint32_t cups_field(const uint8_t *header, size_t offset) {
+	const uint8_t *bytes = header + offset;
+	if (cups_little)
+		return bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+			(uint32_t)bytes[3] << 24;
+	return (uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 |
+		bytes[3];
+}
+
+/**
+ * Decode a page (or a row) of compressed CUPS raster lines.
+ *
+ * Each line starts with a count of how many more times it repeats. Repeats
+ * are copied from the line before. Repeats don't carry from one page to the
+ * next, so a repeat at the start of the buffer only happens when taking
+ * rows a few at a time. Then the line is copied from the last line decoded,
+ * or when taking one row at a time, the last line is returned instead.
+ *
+ * @param buffer Buffer to decode into
+ * @param lines Number of lines
+ * @return Decoded lines, or NULL if the input ended
+ */
+static uint8_t *read_lines(uint8_t *buffer, size_t lines) {
+	for (size_t i = 0; i < lines; i++) {
+		uint8_t *line = buffer + i * line_length;
+		if (line_repeat) {
+			line_repeat--;
+			if (lines == 1) return last_line;
+			memcpy(line, i ? line - line_length : last_line, line_length);
+			continue;
+		}
+		int repeat = next_byte();
+		if (repeat == EOF || !read_line(line)) return NULL;
+		line_repeat = repeat;
+	}
+	last_line = buffer + (lines - 1) * line_length;
+	return buffer;
+}
+
+/**
+ * Decode one compressed CUPS raster line (after its repeat count).
+ *
+ * Each run starts with a count: 0 through 127 repeats the next byte 1
+ * through 128 times, 129 through 255 copies the next 128 through 2 bytes,
+ * and 128 clears the rest of the line to white. Runs past the end of the
+ * line are cut short.
+ *
+ * @param line Buffer for the line
+ * @return True if the whole line was read
+ */
+static bool read_line(uint8_t *line) {
+	uint8_t *at = line, *end = line + line_length;
+	while (at < end) {
+		int count = next_byte();
+		if (count == EOF) return false;
+		if (count == 128) {
+			memset(at, cups_invert ? 0xff : 0x00, end - at);
+			break;
+		}
+		size_t run = count > 128 ? 257 - count : count + 1;
+		if (run > (size_t)(end - at)) run = end - at;
+		if (count > 128) {
+			if (read_bytes(at, run) != run) return false;
+		} else {
+			int byte = next_byte();
+			if (byte == EOF) return false;
+			memset(at, byte, run);
+		}
+		at += run;
+	}
+	if (cups_invert)
+		for (size_t i = 0; i < line_length; i++)
+			line[i] = ~line[i];
+	return true;
+}
+
+/**
+ * Check whether the input has ended, without consuming any of it.
+ *
+ * @return True at the end of the input
+ */
+static bool at_end() {
+	if (map) return map_offset >= map_length;
+	if (pending_offset < pending_length) return false;
+	int c = getc_unlocked(stream);
+	if (c == EOF) return true;
+	ungetc(c, stream);
+	return false;
+}
+
+/**
+ * Read a byte of the input (for headers and compressed data).
+ *
+ * @return The byte, or EOF at the end of the input
+ */
+static int next_byte() {
+	if (map) return map_offset < map_length ? map[map_offset++] : EOF;
+	if (pending_offset < pending_length) return pending[pending_offset++];
+	return getc_unlocked(stream);
+}
+
+/**
+ * Read bytes of the input into a buffer.
+ *
+ * @param to Buffer
+ * @param count Number of bytes to read
+ * @return Number of bytes read (less than asked for at the end of the
+ * input)
+ */
+static size_t read_bytes(uint8_t *to, size_t count) {
+	if (map) {
+		if (count > map_length - map_offset) count = map_length - map_offset;
+		memcpy(to, map + map_offset, count);
+		map_offset += count;
+		return count;
+	}
+	size_t done = 0;
+	while (done < count && pending_offset < pending_length)
+		to[done++] = pending[pending_offset++];
+	return done + fread(to + done, 1, count - done, stream);
+}
+
+/**
+ * Warn that a page at the end of the input is cut short.
+ *
+ * @param count Number of bytes of the page which were read
+ */
+static void discard(size_t count) {
+	// Rows of the page already taken one at a time are discarded too.
+	count += page_row * (gray ? width : row_length);
+	if (format != F_RAW)
+		warnx("page %lu of the input is cut short", image_count);
+	else if (count)
+		warnx("discarded %zu bytes at the end of the input (not a full "
+			"page)", count);
+}
@@ -0,0 +1,22 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Size of the pages of the input, as given in page headers.
+ */
+struct input_size {
+	size_t width; // Width in dots
+	size_t height; // Height in dots
+	unsigned int x_resolution; // Dots per inch across (0 if not given)
+	unsigned int y_resolution; // Dots per inch down (0 if not given)
+	unsigned int paper_width; // Paper width in points (0 if not given)
+	unsigned int paper_height; // Paper height in points (0 if not given)
+};
+
+void input_open(const char *path);
+bool input_size(struct input_size *page_size);
+void input_start(size_t page_width, size_t page_height, bool by_row);
+bool input_mapped();
+uint8_t *input_page(uint8_t *buffer);
+void input_close();
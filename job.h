@@ -0,0 +1,9 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ohb_job;
+struct output;
+
+struct ohb_job *job_begin(int fd);
+bool job_encode(struct ohb_job *job, struct output *out, const uint8_t *data);
+void job_write(struct ohb_job *job, struct output *out);
@@ -4,65 +4,274 @@
  * @copyright 2022 Parks Digital LLC
  */
 
+#include "cache.h"
+#include "collate.h"
+#include "fanout.h"
+#include "input.h"
+#include "job.h"
+#include "ohbrother.h"
+#include "output.h"
 #include "parameters.h"
 #include "pcl.h"
-#include "pjl.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "scan.h"
+#include "sender.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
 #include <err.h>
-#include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <sysexits.h>
+#include <unistd.h>
+
+// Memory taken by the program itself, not counting buffers for pages.
+#define PROGRAM_MEMORY ((size_t)2 << 20)
+
+static void run_job();
+static void serve_job(int argc, char **argv);
+static void fit_memory();
+static void run_serial(struct ohb_job *job, size_t row_length);
+static void run_streaming(struct ohb_job *job, size_t row_length);
 
 int main(int argc, char **argv) {
 	// Get parameters from program arguments.
-	for(size_t i = 2; i < argc; i += 2) {
-		if (!strcmp(argv[i - 1], "-resolution"))
-			param_resolution(argv[i]);
-		else if (!strcmp(argv[i - 1], "-econo_mode"))
-			param_econo_mode(argv[i]);
-		else if (!strcmp(argv[i - 1], "-source_tray"))
-			param_source_tray(argv[i]);
-		else if (!strcmp(argv[i - 1], "-media_type"))
-			param_media_type(argv[i]);
-		else if (!strcmp(argv[i - 1], "-time_out_sleep"))
-			param_time_out_sleep(argv[i]);
-		else if (!strcmp(argv[i - 1], "-paper"))
-			param_paper(argv[i]);
-		else if (!strcmp(argv[i - 1], "-suppress_job"))
-			param_suppress_job(argv[i]);
-		else if (!strcmp(argv[i - 1], "-emit_hqmmode"))
-			param_emit_hqmmode(argv[i]);
-		else if (!strcmp(argv[i - 1], "-suppress_ras1200mode_off"))
-			param_suppress_ras1200mode_off(argv[i]);
-		else if (!strcmp(argv[i - 1], "-copies"))
-			param_copies(argv[i]);
-		else if (!strcmp(argv[i - 1], "-duplex"))
-			param_duplex(argv[i]);
-		else if (!strcmp(argv[i - 1], "-width"))
-			param_width(argv[i]);
-		else if (!strcmp(argv[i - 1], "-height"))
-			param_height(argv[i]);
-		else
-			errx(EX_USAGE, "unrecognized argument %s", argv[i - 1]);
-	}
+	param_reset();
+	param_parse(argc - 1, (const char *const *)argv + 1);
+
+	// Either run the one job on standard input, or take jobs from a socket
+	// until stopped. Each job taken from the socket starts from the
+	// parameters given here.
+	if (p_listen) {
+		if (p_input) errx(EX_USAGE, "input can't be used with listen");
+		if (p_send) errx(EX_USAGE, "send can't be used with listen");
+		if (p_trace) errx(EX_USAGE, "trace can't be used with listen");
+		param_save();
+		server_run(p_listen, p_jobs, serve_job);
+	} else
+		run_job();
+}
 
+/**
+ * Run a job: filter raster data from the input to standard output.
+ */
+static void run_job() {
 	// Update defaults, validate parameters, and calculate padding.
 	param_validate();
 
-	// Allocate a buffer for one page of input.
-	size_t row_length = (p_width + 7) >> 3;
-	uint8_t *page = calloc(p_height, row_length);
-	if (!page) err(EX_OSERR, "allocate page buffer");
+	// Select the fastest scan kernels the CPU supports for compression, and
+	// set aside memory for compressed bands seen before, if any.
+	scan_init();
+	cache_init((size_t)p_cache << 20);
+
+	// Open the input. If it's a regular file, it's mapped into memory. If
+	// it's PBM or CUPS raster, it gives the size of its pages (and maybe
+	// the resolution and paper), which take the place of those parameters.
+	// When streaming, the input is taken a row at a time rather than a page
+	// at a time. Raw 8-bit gray input is halftoned, and input at another
+	// resolution is scaled, as it's read.
+	input_open(p_input);
+	struct input_size size;
+	if (input_size(&size)) {
+		if (p_depth == 8)
+			errx(EX_USAGE, "depth 8 can only be used with raw input");
+		param_input_size(&size);
+		param_validate();
+	}
+
+	// Hold fewer pages at once, or rows rather than pages, if that's what it
+	// takes to keep to the memory limit.
+	if (p_memory_limit) fit_memory();
+	input_start(p_width, p_height, p_streaming);
+	size_t row_length = (p_scaled_width + 7) >> 3;
+
+	// Connect to the printer, if output goes straight there.
+	if (p_send) sender_open(p_send);
+
+	// Start collecting statistics and tracing, if enabled.
+	stats_begin();
+	trace_begin(p_trace);
+
+	// Keep the pages for collated copies, if asked for.
+	collate_begin();
+
+	// When pages are split across several printers, each printer is set up,
+	// sent its pages, and wrapped up on a thread of its own.
+	if (p_fan_out) {
+		fanout_run(p_fan_out, row_length, p_scaled_height, p_queue_depth,
+			p_range_pages);
+		input_close();
+		if (p_verbose && cache_enabled()) cache_report();
+		trace_end();
+		return;
+	}
 
 	// Set up the printer for this job.
-	pjl_begin();
-	pcl_begin();
+	uint64_t start = trace_now();
+	struct ohb_job *job = job_begin(STDOUT_FILENO);
+	trace_event("prologue", start);
 
 	// Read, compress, and emit one page at a time until the input data
-	// is consumed. Don't process partial pages of data.
-	while (fread(page, row_length, p_height, stdin) == p_height)
-		pcl_page(page, row_length, p_height);
+	// is consumed. Don't process partial pages of data. Unless the queue
+	// depth is 1, the next page is read and the last page is written while
+	// each page is compressed. When streaming, emit each block as soon as
+	// its rows are read instead.
+	if (p_streaming)
+		run_streaming(job, row_length);
+	else if (p_queue_depth > 1)
+		pipeline_run(job, p_queue_depth);
+	else
+		run_serial(job, row_length);
+	input_close();
+	if (p_verbose && cache_enabled()) cache_report();
+	stats_end();
+
+	// For collated copies, send the pages kept for each copy after the
+	// first.
+	collate_end(STDOUT_FILENO, row_length, p_scaled_height);
 
 	// Wrap up the job and put the printer back in a known state.
-	pjl_end();
+	start = trace_now();
+	ohb_job_end(job);
+	if (p_send) sender_close();
+	trace_event("epilogue", start);
+	trace_end();
+}
+
+/**
+ * Run a job taken from the socket.
+ *
+ * @param argc Number of arguments in the job header (including a
+ * placeholder for the program name)
+ * @param argv Arguments in the job header
+ */
+static void serve_job(int argc, char **argv) {
+	param_restore();
+	int stats = p_stats;
+	unsigned int threads = p_threads, queue_depth = p_queue_depth;
+	unsigned int cache = p_cache, memory_limit = p_memory_limit;
+	param_parse(argc - 1, (const char *const *)argv + 1);
+	if (p_stats != stats) errx(EX_USAGE, "stats can't be set by a job");
+	if (p_trace) errx(EX_USAGE, "trace can't be set by a job");
+
+	// A job may use less than the server was given, but not more.
+	if (p_threads > threads)
+		errx(EX_USAGE, "threads must be no more than %u for a job", threads);
+	if (p_queue_depth > queue_depth)
+		errx(EX_USAGE, "queue_depth must be no more than %u for a job",
+			queue_depth);
+	if (p_cache > cache && !cache)
+		errx(EX_USAGE, "cache can't be set by a job unless the server "
+			"sets it");
+	if (p_cache > cache)
+		errx(EX_USAGE, "cache must be no more than %u for a job", cache);
+	if (memory_limit && (!p_memory_limit || p_memory_limit > memory_limit))
+		errx(EX_USAGE, "memory_limit must be 1 through %u for a job",
+			memory_limit);
+	run_job();
+}
+
+/**
+ * Choose how many pages may be held at once to keep to the memory limit:
+ * fewer than the queue depth if need be, or none (streaming rows instead)
+ * if even one page won't fit. Page buffers kept in the pool beyond what the
+ * job needs are let go.
+ *
+ * Besides what the program itself takes, each page held takes a page buffer
+ * (rounded up to whole huge pages), and the output for a page may take as
+ * much again as the page if it doesn't compress. Compressing in bands (with worker
+ * threads, the cache, or planned blocks) takes as much again, as does
+ * scaling or halftoning a page as it's read. The cache may take all of its
+ * size. With fan_out, each target holds pages, output, and bands of its
+ * own.
+ */
+static void fit_memory() {
+	size_t page = ((p_scaled_width + 7) >> 3) * p_scaled_height;
+	size_t buffer = pool_size(page);
+	size_t limit = (size_t)p_memory_limit << 20;
+	size_t least = PROGRAM_MEMORY + ((size_t)p_cache << 20);
+	size_t fixed = least;
+	if (p_depth == 8) fixed += p_width * p_height;
+	if (p_scale_x != SCALE_NONE || p_scale_y == SCALE_DOWN)
+		fixed += ((p_width + 7) >> 3) * p_height;
+	size_t bands = p_threads > 1 || p_cache || p_blocks == BL_PLANNED ?
+		page : 0;
+	size_t room = limit > fixed ? limit - fixed : 0;
+
+	size_t targets = 1, depth;
+	if (p_fan_out) {
+		for (const char *c = p_fan_out; *c; c++)
+			if (*c == ',') targets++;
+		room /= targets;
+		depth = room > page + bands ? (room - page - bands) / buffer : 0;
+	} else
+		depth = room > bands ? (room - bands) / (buffer + page) : 0;
+
+	if (p_streaming)
+		depth = 0;
+	else if (depth >= p_queue_depth)
+		depth = p_queue_depth;
+	else if (depth) {
+		p_queue_depth = depth;
+		if (p_verbose)
+			warnx("memory_limit: queue depth lowered to %zu", depth);
+	} else if (!p_fan_out && limit > least) {
+		p_streaming = true;
+		if (p_verbose) warnx("memory_limit: streaming rows");
+	} else
+		errx(EX_USAGE, "memory_limit is too small for a page (%zu MB each)",
+			(page >> 20) + 1);
+	pool_trim(depth * targets * buffer);
+}
+
+/**
+ * Read one page at a time and hand it to the job, which compresses and
+ * emits it.
+ *
+ * The page buffer is taken from the pool, and given back for later jobs.
+ *
+ * @param job Job
+ * @param row_length Length of input data rows in bytes
+ */
+static void run_serial(struct ohb_job *job, size_t row_length) {
+	size_t length = p_scaled_height * row_length;
+	uint8_t *buffer = input_mapped() ? NULL : pool_get(length);
+	uint8_t *page;
+	while ((page = input_page(buffer)))
+		ohb_page_data(job, page);
+	pool_put(buffer, length);
+}
+
+/**
+ * Read, compress, and emit one row at a time.
+ *
+ * Only the current and last input rows are kept (in two row buffers which
+ * take turns, unless the input is mapped). A repeated row may come back in
+ * the same buffer as the last row, so the other buffer is always given for
+ * the next row. Output is held until its page is complete, so a partial page
+ * at the end of the input is discarded as it is when taking whole pages.
+ * Each page is written through the job. The output buffers are kept for
+ * later jobs.
+ *
+ * @param job Job
+ * @param row_length Length of input data rows in bytes
+ */
+static void run_streaming(struct ohb_job *job, size_t row_length) {
+	uint8_t *buffers[2] = {NULL, NULL};
+	if (!input_mapped()) {
+		buffers[0] = calloc(2, row_length);
+		if (!buffers[0]) err(EX_OSERR, "allocate row buffers");
+		buffers[1] = buffers[0] + row_length;
+	}
+
+	pcl_stream_begin(row_length, p_scaled_height);
+	static struct output out;
+	uint8_t *row, *last = buffers[1];
+	while ((row = input_page(last == buffers[0] ? buffers[1] :
+			buffers[0]))) {
+		if (pcl_stream_row(&out, row, last)) job_write(job, &out);
+		last = row;
+	}
+	pcl_stream_end(&out);
+	free(buffers[0]);
 }
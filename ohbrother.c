@@ -0,0 +1,357 @@
+/**
+ * Filter raster data for certain Brother printers, as a library.
+ *
+ * A job is begun with options named as the arguments of the program are
+ * (such as "-resolution" and "600"), given its pages one at a time as
+ * pointers to their rows (or as one buffer of rows one after the other),
+ * and ended. Rather than going to standard output, the output of the job is
+ * handed to a function given when the job is begun, a piece at a time, as
+ * soon as each page is encoded.
+ *
+ * Each job keeps its own parameters and buffers, and they're taken up by
+ * whichever thread is working on the job, so jobs may be run at once on as
+ * many threads of a process as there are jobs. A job may move from thread
+ * to thread between calls, but only one thread may work on a job at a
+ * time. The cache of compressed bands is shared by all the jobs of the
+ * process, but only jobs which give it a size use it (it holds as much as
+ * the largest size given).
+ *
+ * Pages are raw raster data at the resolution selected, one bit per dot,
+ * so options for reading, halftoning, or scaling input, or for where output
+ * goes, can't be given. Errors (such as bad options, or memory that can't
+ * be allocated) don't end the process as they do for the program. They end
+ * the job instead, and ohb_error() gives the message.
+ *
+ * The program runs its jobs through here too (see job_begin()), writing to
+ * a file descriptor rather than handing output to a function. Pages it
+ * reads ahead or writes behind on other threads are encoded and written
+ * through the job with job_encode() and job_write().
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "cache.h"
+#include "collate.h"
+#include "fail.h"
+#include "job.h"
+#include "ohbrother.h"
+#include "output.h"
+#include "parameters.h"
+#include "pcl.h"
+#include "pjl.h"
+#include "pool.h"
+#include "scan.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/**
+ * A job: its parameters, where its output goes, and its buffers.
+ */
+struct ohb_job {
+	struct params params;
+	int (*sink)(void *context, const void *data, size_t length);
+	void *context;
+	int fd; // File descriptor written to for the program, or -1
+	struct output out;
+	size_t row_length;
+	size_t row_count;
+	uint8_t *page; // Page buffer (pooled), for rows not one after the other
+	unsigned long pages; // Pages written
+	int status; // Once stopped, what the sink returned (or -1 on an error)
+};
+
+static struct ohb_job *create();
+static bool configure(const char *const *options);
+static bool start(struct ohb_job *job);
+static int page(struct ohb_job *job, const uint8_t *in,
+	const uint8_t *const *rows);
+static void init();
+static const uint8_t *gather(struct ohb_job *job, const uint8_t *const *rows);
+static int send(struct ohb_job *job, bool page_end);
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread struct failure failure; // Last error on this thread
+
+/**
+ * Begin a job, and set up the printer for it.
+ *
+ * @param options Names and values of options, one after the other, ended
+ * by NULL (NULL for none)
+ * @param sink Function given each piece of output, in order, along with
+ * the context (returns nonzero to stop the job)
+ * @param context Context for the function
+ * @return Job, or NULL if the options are bad or the job can't be begun
+ * (see ohb_error())
+ */
+struct ohb_job *ohb_job_begin(const char *const *options,
+		int (*sink)(void *context, const void *data, size_t length),
+		void *context) {
+	fail_catch(&failure);
+	struct ohb_job *job = create();
+	bool begun = job && configure(options) && start(job);
+	fail_release();
+	if (!begun) {
+		if (job) output_free(&job->out);
+		free(job);
+		return NULL;
+	}
+	job->sink = sink;
+	job->context = context;
+	send(job, false);
+	return job;
+}
+
+/**
+ * Begin a job for the program, with the parameters of this thread (already
+ * validated, and set up for the input), and set up the printer for it.
+ *
+ * Output is written to a file descriptor: the setup now, and each page as
+ * soon as it's encoded (see job_write()). Errors end the process.
+ *
+ * @param fd File descriptor to write to
+ * @return Job
+ */
+struct ohb_job *job_begin(int fd) {
+	struct ohb_job *job = create();
+	job->fd = fd;
+	start(job);
+	send(job, false);
+	return job;
+}
+
+/**
+ * Encode a page of a job for the program into an output of its own, to be
+ * written with job_write() (perhaps on another thread).
+ *
+ * @param job Job
+ * @param out Output for the page
+ * @param data Rows of the page, one after the other
+ * @return Whether the page was encoded (false if errors are caught)
+ */
+bool job_encode(struct ohb_job *job, struct output *out, const uint8_t *data) {
+	// The rows are only read.
+	return pcl_page(out, (uint8_t *)data, job->row_length, job->row_count);
+}
+
+/**
+ * Write the output for a page of a job for the program: keep it for
+ * collated copies, write it, and report on it if verbose and in the
+ * statistics if enabled. Pages must be written in order, on one thread at a
+ * time.
+ *
+ * @param job Job
+ * @param out Output for the page
+ */
+void job_write(struct ohb_job *job, struct output *out) {
+	collate_keep(out, true);
+	struct output before = *out;
+	size_t bytes = output_flush(out, job->fd);
+	job->pages++;
+	if (p_verbose)
+		output_report(job->pages, bytes, out->writes - before.writes,
+			out->seconds - before.seconds, out->stalled - before.stalled);
+	if (p_stats >= 0)
+		stats_page(job->pages, &out->stats, bytes,
+			out->seconds - before.seconds, out->stalled - before.stalled);
+}
+
+/**
+ * Get the size of the pages of a job (the width and height options, or the
+ * size of the paper if not given).
+ *
+ * @param job Job
+ * @param row_length Set to the length of each row in bytes
+ * @param row_count Set to the number of rows of each page
+ */
+void ohb_job_size(const struct ohb_job *job, size_t *row_length,
+		size_t *row_count) {
+	*row_length = job->row_length;
+	*row_count = job->row_count;
+}
+
+/**
+ * Encode a page of a job.
+ *
+ * @param job Job
+ * @param rows Each row of the page (see ohb_job_size())
+ * @return Zero, what the sink returned when it stopped, or -1 if the job
+ * failed (see ohb_error()); if not zero, the job does nothing more but end
+ */
+int ohb_page(struct ohb_job *job, const uint8_t *const *rows) {
+	return page(job, rows[0], rows);
+}
+
+/**
+ * Encode a page of a job, given as one buffer of rows one after the other.
+ *
+ * @param job Job
+ * @param data Rows of the page (see ohb_job_size())
+ * @return Zero, what the sink returned when it stopped, or -1 if the job
+ * failed (see ohb_error()); if not zero, the job does nothing more but end
+ */
+int ohb_page_data(struct ohb_job *job, const uint8_t *data) {
+	return page(job, data, NULL);
+}
+
+/**
+ * End a job, put the printer back in a known state, and free the job.
+ *
+ * @param job Job
+ * @return Zero, what the sink returned when it stopped, or -1 if the job
+ * failed (see ohb_error())
+ */
+int ohb_job_end(struct ohb_job *job) {
+	if (!job->status) {
+		if (job->fd < 0) fail_catch(&failure);
+		param_set(&job->params);
+		bool ended = pjl_end(&job->out);
+		fail_release();
+		if (ended) send(job, false);
+		else job->status = -1;
+	}
+	int status = job->status;
+	output_free(&job->out);
+	pool_put(job->page, job->row_count * job->row_length);
+	free(job);
+	return status;
+}
+
+/**
+ * Get the message of the last error which ended a job on this thread (one
+ * begun, or given a page, or ended, on this thread).
+ *
+ * @return Message, or an empty string if no job has failed on this thread
+ */
+const char *ohb_error() {
+	return failure.message;
+}
+
+/**
+ * Allocate a job, setting up what all jobs share the first time.
+ *
+ * @return Job, or NULL if it can't be allocated (when errors are caught)
+ */
+static struct ohb_job *create() {
+	pthread_once(&once, init);
+	struct ohb_job *job = calloc(1, sizeof(*job));
+	if (!job) {
+		fail_errno(EX_OSERR, "allocate job");
+		return NULL;
+	}
+	job->fd = -1;
+	return job;
+}
+
+/**
+ * Set the parameters of this thread from the options of a library job.
+ *
+ * @param options Names and values of options, ended by NULL (NULL for none)
+ * @return Whether the options are good
+ */
+static bool configure(const char *const *options) {
+	size_t count = 0;
+	while (options && options[count]) count++;
+	param_reset();
+	if (!param_parse(count, options)) return false;
+	if (p_input || p_streaming || p_listen || p_send || p_depth != 1 ||
+			p_input_resolution != IR_SAME || p_stats >= 0 || p_trace ||
+			p_fan_out || p_collate || p_memory_limit)
+		return fail(EX_USAGE, "input, streaming, listen, send, depth, "
+			"input_resolution, stats, trace, fan_out, collate, and "
+			"memory_limit can't be used with a library job");
+	if (!param_validate()) return false;
+	if (p_cache) cache_init((size_t)p_cache << 20);
+	return true;
+}
+
+/**
+ * Take up the parameters of this thread for a job, and set up the printer.
+ *
+ * @param job Job
+ * @return Whether the output is whole
+ */
+static bool start(struct ohb_job *job) {
+	param_get(&job->params);
+	job->row_length = (p_scaled_width + 7) >> 3;
+	job->row_count = p_scaled_height;
+	return pjl_begin(&job->out) && pcl_begin(&job->out);
+}
+
+/**
+ * Encode a page of a job, and hand its output on.
+ *
+ * @param job Job
+ * @param in First row of the page
+ * @param rows Each row of the page, or NULL if they're one after the other
+ * @return Status of the job (see ohb_page())
+ */
+static int page(struct ohb_job *job, const uint8_t *in,
+		const uint8_t *const *rows) {
+	if (job->status) return job->status;
+	if (job->fd < 0) fail_catch(&failure);
+	param_set(&job->params);
+
+	// Rows one after the other are encoded where they are. Otherwise,
+	// they're gathered into the page buffer first.
+	for (size_t row = 1; rows && row < job->row_count; row++)
+		if (rows[row] != in + row * job->row_length) {
+			in = gather(job, rows);
+			break;
+		}
+
+	// A page which can't be encoded ends the job. Its output so far is
+	// dropped, leaving the buffers of the output and of this thread ready
+	// for the next job.
+	bool encoded = in && job_encode(job, &job->out, in);
+	fail_release();
+	if (!encoded) {
+		output_discard(&job->out);
+		return job->status = -1;
+	}
+	return send(job, true);
+}
+
+/**
+ * Set up what all jobs share, the first time a job is begun.
+ */
+static void init() {
+	scan_init();
+}
+
+/**
+ * Copy the rows of a page into the page buffer of a job.
+ *
+ * @param job Job
+ * @param rows Each row of the page
+ * @return Page buffer, or NULL if it can't be allocated (when errors are
+ * caught)
+ */
+static const uint8_t *gather(struct ohb_job *job, const uint8_t *const *rows) {
+	if (!job->page) job->page = pool_get(job->row_count * job->row_length);
+	if (!job->page) return NULL;
+	for (size_t row = 0; row < job->row_count; row++)
+		memcpy(job->page + row * job->row_length, rows[row], job->row_length);
+	return job->page;
+}
+
+/**
+ * Hand the output of a job so far to its sink, or write it out.
+ *
+ * @param job Job
+ * @param page_end True if the output concludes a page
+ * @return Zero, or what the sink returned when it stopped
+ */
+static int send(struct ohb_job *job, bool page_end) {
+	if (job->status) return job->status;
+	if (job->fd < 0)
+		job->status = output_send(&job->out, job->sink, job->context);
+	else if (page_end)
+		job_write(job, &job->out);
+	else
+		output_flush(&job->out, job->fd);
+	return job->status;
+}
@@ -0,0 +1,14 @@
+#include <stddef.h>
+#include <stdint.h>
+
+struct ohb_job;
+
+struct ohb_job *ohb_job_begin(const char *const *options,
+	int (*sink)(void *context, const void *data, size_t length),
+	void *context);
+void ohb_job_size(const struct ohb_job *job, size_t *row_length,
+	size_t *row_count);
+int ohb_page(struct ohb_job *job, const uint8_t *const *rows);
+int ohb_page_data(struct ohb_job *job, const uint8_t *data);
+int ohb_job_end(struct ohb_job *job);
+const char *ohb_error();
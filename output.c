@@ -0,0 +1,411 @@
+/**
+ * Collect output in memory and write it out in as few calls as possible.
+ *
+ * Output for a page is collected so that it can be produced on one thread
+ * and written out on another. Rows are compressed directly into block
+ * buffers owned by the output, and blocks are written right from those
+ * buffers. Commands and block headers are collected in a text buffer. When
+ * the output is flushed, the pieces are gathered with writev(), so a page
+ * usually takes just one write call. Buffers are kept for reuse from page
+ * to page. Output may be handed to a function instead (as it is for jobs
+ * run by the library).
+ *
+ * Sockets are written without blocking, so a write takes whatever fits in
+ * the send buffer and returns. When the buffer is full (the printer is
+ * taking data slower than it's made), the time spent waiting for room is
+ * counted as a stall.
+ *
+ * If a buffer can't be allocated, the output is marked as failed and
+ * anything appended after is dropped, so the caller can check once at the
+ * end of a page (or where it needs a block buffer). The output is whole
+ * again once it's emptied.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "output.h"
+#include "fail.h"
+#include "trace.h"
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static void append_segment(struct output *output, size_t block,
+	size_t offset, size_t length);
+static bool grow(struct output *output, void **array, size_t *capacity,
+	size_t needed, size_t size);
+static bool wait_writable(int fd);
+static void reset(struct output *output);
+static double now();
+
+/**
+ * Append bytes to the output.
+ *
+ * @param output Output
+ * @param data Bytes to append
+ * @param length Number of bytes to append
+ * @return Whether the output is whole
+ */
+bool output_write(struct output *output, const void *data, size_t length) {
+	if (!grow(output, (void **)&output->text, &output->text_capacity,
+			output->text_length + length, 1))
+		return false;
+	memcpy(output->text + output->text_length, data, length);
+	append_segment(output, 0, output->text_length, length);
+	output->text_length += length;
+	return !output->failed;
+}
+
+/**
+ * Append a string (without its terminating null) to the output.
+ *
+ * @param output Output
+ * @param string String to append
+ * @return Whether the output is whole
+ */
+bool output_puts(struct output *output, const char *string) {
+	return output_write(output, string, strlen(string));
+}
+
+/**
+ * Append formatted text to the output, as printf() would.
+ *
+ * @param output Output
+ * @param format Format
+ * @return Whether the output is whole
+ */
+bool output_printf(struct output *output, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (length < 0) {
+		output->failed = true;
+		return fail_errno(EX_SOFTWARE, "format output");
+	}
+
+	// Room for the terminating null, which isn't part of the output.
+	if (!grow(output, (void **)&output->text, &output->text_capacity,
+			output->text_length + length + 1, 1))
+		return false;
+	va_start(args, format);
+	vsnprintf((char *)output->text + output->text_length, length + 1,
+		format, args);
+	va_end(args);
+	append_segment(output, 0, output->text_length, length);
+	output->text_length += length;
+	return !output->failed;
+}
+
+/**
+ * Get the block buffer for the next block.
+ *
+ * The buffer holds OUTPUT_BLOCK_CAPACITY bytes. It becomes part of the
+ * output when output_block_end() is called. Until then, the same buffer is
+ * returned by each call.
+ *
+ * @param output Output
+ * @return Block buffer, or NULL if the output isn't whole
+ */
+uint8_t *output_block(struct output *output) {
+	if (output->failed) return NULL;
+	if (output->block_count == output->block_capacity) {
+		size_t capacity = output->block_capacity;
+		if (!grow(output, (void **)&output->blocks, &capacity,
+				output->block_count + 1, sizeof(*output->blocks)))
+			return NULL;
+		memset(output->blocks + output->block_capacity, 0,
+			(capacity - output->block_capacity) * sizeof(*output->blocks));
+		output->block_capacity = capacity;
+	}
+	uint8_t **block = &output->blocks[output->block_count];
+	if (!*block) {
+		*block = malloc(OUTPUT_BLOCK_CAPACITY);
+		if (!*block) {
+			output->failed = true;
+			fail_errno(EX_OSERR, "allocate output block buffer");
+		}
+	}
+	return *block;
+}
+
+/**
+ * Add the block buffer for the current block to the output.
+ *
+ * The block is emitted as a continuing Transfer Raster Data parameter: the
+ * length of the block (plus two for the row count) in decimal, the
+ * parameter character (w), a zero byte, and the number of rows, followed by
+ * the block itself.
+ *
+ * @param output Output
+ * @param length Length of the block in bytes
+ * @param rows Number of rows in the block
+ * @return Whether the output is whole
+ */
+bool output_block_end(struct output *output, size_t length, uint8_t rows) {
+	uint64_t trace_start = trace_now();
+
+	// Format the header back to front, without printf.
+	uint8_t header[24];
+	uint8_t *start = header + sizeof(header);
+	*--start = rows;
+	*--start = 0;
+	*--start = 'w';
+	size_t count = length + 2;
+	do *--start = '0' + count % 10; while (count /= 10);
+	if (!output_write(output, start, header + sizeof(header) - start) ||
+			!output_block(output))
+		return false;
+	append_segment(output, ++output->block_count, 0, length);
+	output->stats.blocks++;
+	trace_event("block", trace_start);
+	return !output->failed;
+}
+
+/**
+ * Write the output to a file descriptor and empty the output.
+ *
+ * If the file descriptor can't take more without blocking, waits until it
+ * can. The time spent flushing and waiting is added to the output. If it
+ * can't be written, the rest of the output is dropped.
+ *
+ * @param output Output
+ * @param fd File descriptor to write to
+ * @return Number of bytes written
+ */
+size_t output_flush(struct output *output, int fd) {
+	uint64_t trace_start = trace_now();
+	double start = now();
+	struct stat st;
+	bool socket = !fstat(fd, &st) && S_ISSOCK(st.st_mode);
+	size_t total = 0;
+	struct iovec iov[IOV_MAX < 1024 ? IOV_MAX : 1024];
+	size_t next = 0; // Next segment to gather
+	size_t skip = 0; // Bytes of the next segment already written
+
+	while (next < output->segment_count) {
+		// Gather as many segments as fit.
+		size_t count = 0;
+		for (size_t i = next; i < output->segment_count &&
+				count < sizeof(iov) / sizeof(*iov); i++, count++) {
+			struct segment *segment = &output->segments[i];
+			uint8_t *base = segment->block ?
+				output->blocks[segment->block - 1] : output->text;
+			size_t offset = i == next ? skip : 0;
+			iov[count].iov_base = base + segment->offset + offset;
+			iov[count].iov_len = segment->length - offset;
+		}
+
+		ssize_t written = socket ?
+			sendmsg(fd, &(struct msghdr){.msg_iov = iov, .msg_iovlen = count},
+				MSG_DONTWAIT) :
+			writev(fd, iov, count);
+		output->writes++;
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				fail_errno(EX_IOERR, "write output");
+				break;
+			}
+			double stall = now();
+			bool writable = wait_writable(fd);
+			output->stalled += now() - stall;
+			if (!writable) break;
+			continue;
+		}
+		total += written;
+
+		// Advance past whatever was written (possibly part of a segment).
+		while (next < output->segment_count && written) {
+			size_t left = output->segments[next].length - skip;
+			if ((size_t)written < left) {
+				skip += written;
+				break;
+			}
+			written -= left;
+			skip = 0;
+			next++;
+		}
+	}
+
+	reset(output);
+	output->seconds += now() - start;
+	trace_event("write", trace_start);
+	return total;
+}
+
+/**
+ * Hand the output collected so far to a function, a piece at a time, rather
+ * than writing it to a file. Buffers are kept for reuse as by
+ * output_flush().
+ *
+ * @param output Output
+ * @param sink Function given each piece of output, in order, along with
+ * the context (returns nonzero to stop)
+ * @param context Context for the function
+ * @return Zero, or what the function returned if it stopped
+ */
+int output_send(struct output *output,
+		int (*sink)(void *context, const void *data, size_t length),
+		void *context) {
+	uint64_t trace_start = trace_now();
+	double start = now();
+	int status = 0;
+	for (size_t i = 0; i < output->segment_count && !status; i++) {
+		struct segment *segment = &output->segments[i];
+		uint8_t *base = segment->block ?
+			output->blocks[segment->block - 1] : output->text;
+		status = sink(context, base + segment->offset, segment->length);
+	}
+	output->writes += output->segment_count;
+	reset(output);
+	output->seconds += now() - start;
+	trace_event("write", trace_start);
+	return status;
+}
+
+/**
+ * Report how a page of output was written (on standard error).
+ *
+ * @param page Page number (starting from 1)
+ * @param bytes Number of bytes written for the page
+ * @param writes Number of write calls made for the page
+ * @param seconds Time spent writing the page
+ * @param stalled Time spent waiting for room to write the page
+ */
+void output_report(unsigned long page, size_t bytes, unsigned long writes,
+		double seconds, double stalled) {
+	warnx("page %lu: %zu bytes in %lu write calls, %.3f s writing "
+		"(%.3f s stalled)", page, bytes, writes, seconds, stalled);
+}
+
+/**
+ * Drop the output collected so far without writing it. Buffers are kept for
+ * reuse as by output_flush().
+ *
+ * @param output Output
+ */
+void output_discard(struct output *output) {
+	reset(output);
+}
+
+/**
+ * Free the memory held by the output.
+ *
+ * @param output Output
+ */
+void output_free(struct output *output) {
+	for (size_t i = 0; i < output->block_capacity; i++)
+		free(output->blocks[i]);
+	free(output->blocks);
+	free(output->segments);
+	free(output->text);
+	memset(output, 0, sizeof(*output));
+}
+
+/**
+ * Empty the output once written, keeping its buffers.
+ *
+ * @param output Output
+ */
+static void reset(struct output *output) {
+	// Keep the buffer for the block in progress (if any) as the next one.
+	if (output->block_count < output->block_capacity) {
+		uint8_t *open = output->blocks[output->block_count];
+		output->blocks[output->block_count] = output->blocks[0];
+		output->blocks[0] = open;
+	}
+	output->text_length = 0;
+	output->block_count = 0;
+	output->segment_count = 0;
+	output->failed = false;
+}
+
+/**
+ * Append a segment to the output, merging it with the last segment if they
+ * are contiguous.
+ *
+ * @param output Output
+ * @param block Index of the block buffer plus 1, or 0 for text
+ * @param offset Offset of the segment in the buffer
+ * @param length Length of the segment
+ */
+static void append_segment(struct output *output, size_t block,
+		size_t offset, size_t length) {
+	if (output->segment_count) {
+		struct segment *last = &output->segments[output->segment_count - 1];
+		if (last->block == block && last->offset + last->length == offset) {
+			last->length += length;
+			return;
+		}
+	}
+	if (!grow(output, (void **)&output->segments, &output->segment_capacity,
+			output->segment_count + 1, sizeof(*output->segments)))
+		return;
+	output->segments[output->segment_count++] =
+		(struct segment){block, offset, length};
+}
+
+/**
+ * Grow an array (doubling its capacity) until it holds a number of items.
+ * If it can't be grown, it's left as it was and the output is marked as
+ * failed.
+ *
+ * @param output Output the array belongs to
+ * @param array Array to grow (may be NULL, possibly moved)
+ * @param capacity Capacity of the array in items (updated)
+ * @param needed Number of items needed
+ * @param size Size of each item
+ * @return Whether the array holds the items (and the output is whole)
+ */
+static bool grow(struct output *output, void **array, size_t *capacity,
+		size_t needed, size_t size) {
+	if (output->failed) return false;
+	if (needed <= *capacity) return true;
+	size_t more = *capacity ? *capacity : 64;
+	while (more < needed) more *= 2;
+	void *grown = realloc(*array, more * size);
+	if (!grown) {
+		output->failed = true;
+		return fail_errno(EX_OSERR, "allocate output buffer");
+	}
+	*array = grown;
+	*capacity = more;
+	return true;
+}
+
+/**
+ * Wait until a file descriptor can be written.
+ *
+ * @param fd File descriptor
+ * @return Whether it can be written
+ */
+static bool wait_writable(int fd) {
+	struct pollfd poll_fd = {.fd = fd, .events = POLLOUT};
+	while (poll(&poll_fd, 1, -1) < 0)
+		if (errno != EINTR) return fail_errno(EX_IOERR, "wait for output");
+	return true;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,69 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of each block buffer. Blocks are limited to 16kB, but a compressed
+// row may be written past the limit before it's known not to fit.
+#define OUTPUT_BLOCK_CAPACITY (16384 + 8192)
+
+/**
+ * A piece of output: either text or (part of) a block buffer.
+ */
+struct segment {
+	size_t block; // Index of the block buffer plus 1, or 0 for text
+	size_t offset;
+	size_t length;
+};
+
+// Buckets of the histogram of groups per row: 0, 1, 2-3, 4-7, 8-15, 16-31,
+// 32-63, 64-127, and 128-254.
+#define STATS_BUCKETS 9
+
+/**
+ * What a page of raster data was encoded as. Only collected if statistics
+ * are enabled.
+ */
+struct stats {
+	size_t raster_bytes; // Raster data of the page once scaled (1 bit per dot)
+	size_t rows; // Rows encoded (including duplicates)
+	size_t blank_rows;
+	size_t same_rows; // Rows encoded as the same as the last row
+	size_t fallback_rows; // Rows ending in one group for lack of groups
+	size_t groups[STATS_BUCKETS]; // Rows by number of groups (not blank)
+	size_t blocks;
+	double seconds; // Time spent encoding
+	double cpu_seconds; // Process CPU time used while encoding
+	double started; // Time encoding last started
+	double cpu_started;
+};
+
+struct output {
+	uint8_t *text; // Commands and block headers
+	size_t text_length;
+	size_t text_capacity;
+	uint8_t **blocks; // Block buffers, kept for reuse after flushing
+	size_t block_count; // Number of block buffers holding output
+	size_t block_capacity; // Number of block buffers allocated
+	struct segment *segments;
+	size_t segment_count;
+	size_t segment_capacity;
+	unsigned long writes; // Number of write calls made when flushing
+	double seconds; // Time spent flushing
+	double stalled; // Time spent flushing waiting for room to write
+	struct stats stats; // What the current page was encoded as
+	bool failed; // Whether a buffer couldn't be allocated since last emptied
+};
+
+bool output_write(struct output *output, const void *data, size_t length);
+bool output_puts(struct output *output, const char *string);
+bool output_printf(struct output *output, const char *format, ...);
+uint8_t *output_block(struct output *output);
+bool output_block_end(struct output *output, size_t length, uint8_t rows);
+size_t output_flush(struct output *output, int fd);
+int output_send(struct output *output,
+	int (*sink)(void *context, const void *data, size_t length),
+	void *context);
+void output_discard(struct output *output);
+void output_report(unsigned long page, size_t bytes, unsigned long writes,
+	double seconds, double stalled);
+void output_free(struct output *output);
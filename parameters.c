@@ -8,45 +8,126 @@
  */
 
 #include "parameters.h"
-#include <err.h>
+#include "fail.h"
+#include "input.h"
+#include "pcl.h"
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <sysexits.h>
 
-enum Resolution p_resolution = RES_600;
-bool p_econo_mode = false;
-enum SourceTray p_source_tray = ST_AUTO;
-enum MediaType p_media_type = MT_REGULAR;
-unsigned int p_time_out_sleep = 0;
-enum Paper p_paper = P_LETTER;
-bool p_suppress_job = false;
-bool p_emit_hqmmode = false;
-bool p_suppress_ras1200mode_off = false;
-unsigned int p_copies = 1;
-enum Duplex p_duplex = DPX_OFF;
-size_t p_width = 0;
-size_t p_height = 0;
-size_t p_padding = 0;
-
-void param_resolution(const char *arg) {
+// Each thread has parameters of its own, so jobs on different threads don't
+// share them. They're set by param_reset() or param_set().
+__thread enum Resolution p_resolution;
+__thread bool p_econo_mode;
+__thread enum SourceTray p_source_tray;
+__thread enum MediaType p_media_type;
+__thread unsigned int p_time_out_sleep;
+__thread enum Paper p_paper;
+__thread bool p_suppress_job;
+__thread bool p_emit_hqmmode;
+__thread bool p_suppress_ras1200mode_off;
+__thread unsigned int p_copies;
+__thread enum Duplex p_duplex;
+__thread size_t p_width;
+__thread size_t p_height;
+__thread size_t p_padding;
+__thread unsigned int p_threads;
+__thread unsigned int p_queue_depth;
+__thread const char *p_input;
+__thread bool p_streaming;
+__thread bool p_verbose;
+__thread enum Compression p_compression;
+__thread enum Blocks p_blocks;
+__thread unsigned int p_cache;
+__thread const char *p_listen;
+__thread unsigned int p_jobs;
+__thread const char *p_send;
+__thread unsigned int p_depth;
+__thread enum Screen p_screen;
+__thread enum InputResolution p_input_resolution;
+__thread enum Scale p_scale_x;
+__thread enum Scale p_scale_y;
+__thread size_t p_scaled_width;
+__thread size_t p_scaled_height;
+__thread int p_stats;
+__thread const char *p_trace;
+__thread const char *p_fan_out;
+__thread unsigned int p_range_pages;
+__thread bool p_collate;
+__thread unsigned int p_memory_limit;
+
+// Parameters set by param_reset().
+static const struct params defaults = {
+	.resolution = RES_600,
+	.econo_mode = false,
+	.source_tray = ST_AUTO,
+	.media_type = MT_REGULAR,
+	.time_out_sleep = 0,
+	.paper = P_LETTER,
+	.suppress_job = false,
+	.emit_hqmmode = false,
+	.suppress_ras1200mode_off = false,
+	.copies = 1,
+	.duplex = DPX_OFF,
+	.width = 0,
+	.height = 0,
+	.padding = 0,
+	.threads = 1,
+	.queue_depth = 3,
+	.input = NULL,
+	.streaming = false,
+	.verbose = false,
+	.compression = CM_GREEDY,
+	.blocks = BL_FIXED,
+	.cache = 0,
+	.listen = NULL,
+	.jobs = 4,
+	.send = NULL,
+	.depth = 1,
+	.screen = SC_CLUSTERED,
+	.input_resolution = IR_SAME,
+	.scale_x = SCALE_NONE,
+	.scale_y = SCALE_NONE,
+	.scaled_width = 0,
+	.scaled_height = 0,
+	.stats = -1,
+	.trace = NULL,
+	.fan_out = NULL,
+	.range_pages = 10,
+	.collate = false,
+	.memory_limit = 0,
+};
+
+// Parameters kept by param_save().
+static __thread struct params saved;
+
+static void paper_size(enum Paper paper, size_t *width, size_t *height);
+
+// Each of these sets a parameter from an argument, returning false if the
+// argument isn't valid (when errors are caught).
+
+bool param_resolution(const char *arg) {
 	if (!strcmp(arg, "300")) p_resolution = RES_300;
 	else if (!strcmp(arg, "600")) p_resolution = RES_600;
 	else if (!strcmp(arg, "1200")) p_resolution = RES_1200;
 	else if (!strcmp(arg, "HQ1200A")) p_resolution = RES_HQ1200A;
 	else if (!strcmp(arg, "HQ1200B")) p_resolution = RES_HQ1200B;
 	else if (!strcmp(arg, "600x300")) p_resolution = RES_600x300;
-	else errx(EX_USAGE, "resolution must be one of "
+	else return fail(EX_USAGE, "resolution must be one of "
 		"300, 600, 1200, HQ1200A, HQ1200B, or 600x300");
+	return true;
 }
 
-void param_econo_mode(const char *arg) {
+bool param_econo_mode(const char *arg) {
 	if (!strcmp(arg, "OFF")) p_econo_mode = false;
 	else if (!strcmp(arg, "ON")) p_econo_mode = true;
-	else errx(EX_USAGE, "econo_mode must be one of "
+	else return fail(EX_USAGE, "econo_mode must be one of "
 		"OFF or ON");
+	return true;
 }
 
-void param_source_tray(const char *arg) {
+bool param_source_tray(const char *arg) {
 	if (!strcmp(arg, "AUTO")) p_source_tray = ST_AUTO;
 	else if (!strcmp(arg, "TRAY1")) p_source_tray = ST_TRAY1;
 	else if (!strcmp(arg, "TRAY2")) p_source_tray = ST_TRAY2;
@@ -55,11 +136,12 @@ void param_source_tray(const char *arg) {
 	else if (!strcmp(arg, "TRAY5")) p_source_tray = ST_TRAY5;
 	else if (!strcmp(arg, "MANUAL")) p_source_tray = ST_MANUAL;
 	else if (!strcmp(arg, "MPTRAY")) p_source_tray = ST_MPTRAY;
-	else errx(EX_USAGE, "source_tray must be one of "
+	else return fail(EX_USAGE, "source_tray must be one of "
 		"AUTO, TRAY1, TRAY2, TRAY3, TRAY4, TRAY5, MANUAL, or MPTRAY");
+	return true;
 }
 
-void param_media_type(const char *arg) {
+bool param_media_type(const char *arg) {
 	if (!strcmp(arg, "REGULAR")) p_media_type = MT_REGULAR;
 	else if (!strcmp(arg, "THIN")) p_media_type = MT_THIN;
 	else if (!strcmp(arg, "THICK")) p_media_type = MT_THICK;
@@ -68,19 +150,21 @@ void param_media_type(const char *arg) {
 	else if (!strcmp(arg, "ENVELOPES")) p_media_type = MT_ENVELOPES;
 	else if (!strcmp(arg, "ENVTHICK")) p_media_type = MT_ENVTHICK;
 	else if (!strcmp(arg, "RECYCLED")) p_media_type = MT_RECYCLED;
-	else errx(EX_USAGE, "media_type must be one of "
+	else return fail(EX_USAGE, "media_type must be one of "
 		"REGULAR, THIN, THICK, THICK2, TRANSPARENCY, ENVELOPES, "
 		"ENVTHICK, or RECYCLED");
+	return true;
 }
 
-void param_time_out_sleep(const char *arg) {
+bool param_time_out_sleep(const char *arg) {
 	if (!sscanf(arg, "%u", &p_time_out_sleep))
-		errx(EX_USAGE, "time_out_sleep must be an unsigned integer");
+		return fail(EX_USAGE, "time_out_sleep must be an unsigned integer");
 	if (p_time_out_sleep > 99)
-		errx(EX_USAGE, "time_out_sleep must be no more than 99");
+		return fail(EX_USAGE, "time_out_sleep must be no more than 99");
+	return true;
 }
 
-void param_paper(const char *arg) {
+bool param_paper(const char *arg) {
 	if (!strcmp(arg, "LEGAL")) p_paper = P_LEGAL;
 	else if (!strcmp(arg, "LETTER")) p_paper = P_LETTER;
 	else if (!strcmp(arg, "A4")) p_paper = P_A4;
@@ -94,123 +178,319 @@ void param_paper(const char *arg) {
 	else if (!strcmp(arg, "DL")) p_paper = P_DL;
 	else if (!strcmp(arg, "COM10")) p_paper = P_COM10;
 	else if (!strcmp(arg, "MONARCH")) p_paper = P_MONARCH;
-	else errx(EX_USAGE, "paper must be one of "
+	else return fail(EX_USAGE, "paper must be one of "
 		"LEGAL, LETTER, A4, EXECUTIVE, JISB5, B5, A5, B6, A6, "
 		"C5, DL, COM10, or MONARCH");
+	return true;
 }
 
-void param_suppress_job(const char *arg) {
+bool param_suppress_job(const char *arg) {
 	if (!strcmp(arg, "NO")) p_suppress_job = false;
 	else if (!strcmp(arg, "YES")) p_suppress_job = true;
-	else errx(EX_USAGE, "suppress_job must be one of "
+	else return fail(EX_USAGE, "suppress_job must be one of "
 		"NO or YES");
+	return true;
 }
 
-void param_emit_hqmmode(const char *arg) {
+bool param_emit_hqmmode(const char *arg) {
 	if (!strcmp(arg, "NO")) p_emit_hqmmode = false;
 	else if (!strcmp(arg, "YES")) p_emit_hqmmode = true;
-	else errx(EX_USAGE, "emit_hqmmode must be one of "
+	else return fail(EX_USAGE, "emit_hqmmode must be one of "
 		"NO or YES");
+	return true;
 }
 
-void param_suppress_ras1200mode_off(const char *arg) {
+bool param_suppress_ras1200mode_off(const char *arg) {
 	if (!strcmp(arg, "NO")) p_suppress_ras1200mode_off = false;
 	else if (!strcmp(arg, "YES")) p_suppress_ras1200mode_off = true;
-	else errx(EX_USAGE, "suppress_ras1200mode_off must be one of "
+	else return fail(EX_USAGE, "suppress_ras1200mode_off must be one of "
 		"NO or YES");
+	return true;
 }
 
-void param_copies(const char *arg) {
+bool param_copies(const char *arg) {
 	if (!sscanf(arg, "%u", &p_copies))
-		errx(EX_USAGE, "copies must be an unsigned integer");
+		return fail(EX_USAGE, "copies must be an unsigned integer");
 	if (p_copies < 1)
-		errx(EX_USAGE, "copies must be at least 1");
+		return fail(EX_USAGE, "copies must be at least 1");
 	if (p_copies > 999)
-		errx(EX_USAGE, "copies must be no more than 999");
+		return fail(EX_USAGE, "copies must be no more than 999");
+	return true;
 }
 
-void param_duplex(const char *arg) {
+bool param_duplex(const char *arg) {
 	if (!strcmp(arg, "OFF")) p_duplex = DPX_OFF;
 	else if (!strcmp(arg, "LONG")) p_duplex = DPX_LONG;
 	else if (!strcmp(arg, "SHORT")) p_duplex = DPX_SHORT;
-	else errx(EX_USAGE, "duplex must be one of "
+	else return fail(EX_USAGE, "duplex must be one of "
 		"OFF, LONG, or SHORT");
+	return true;
 }
 
-void param_width(const char *arg) {
+bool param_width(const char *arg) {
 	if (!sscanf(arg, "%lu", &p_width))
-		errx(EX_USAGE, "width must be an unsigned long");
+		return fail(EX_USAGE, "width must be an unsigned long");
+	return true;
 }
 
-void param_height(const char *arg) {
+bool param_height(const char *arg) {
 	if (!sscanf(arg, "%lu", &p_height))
-		errx(EX_USAGE, "height must be an unsigned long");
+		return fail(EX_USAGE, "height must be an unsigned long");
+	return true;
+}
+
+bool param_threads(const char *arg) {
+	if (!sscanf(arg, "%u", &p_threads))
+		return fail(EX_USAGE, "threads must be an unsigned integer");
+	if (p_threads < 1)
+		return fail(EX_USAGE, "threads must be at least 1");
+	if (p_threads > 64)
+		return fail(EX_USAGE, "threads must be no more than 64");
+	return true;
+}
+
+bool param_queue_depth(const char *arg) {
+	if (!sscanf(arg, "%u", &p_queue_depth))
+		return fail(EX_USAGE, "queue_depth must be an unsigned integer");
+	if (p_queue_depth < 1)
+		return fail(EX_USAGE, "queue_depth must be at least 1");
+	if (p_queue_depth > 16)
+		return fail(EX_USAGE, "queue_depth must be no more than 16");
+	return true;
+}
+
+bool param_input(const char *arg) {
+	p_input = arg;
+	return true;
+}
+
+bool param_streaming(const char *arg) {
+	if (!strcmp(arg, "NO")) p_streaming = false;
+	else if (!strcmp(arg, "YES")) p_streaming = true;
+	else return fail(EX_USAGE, "streaming must be one of "
+		"NO or YES");
+	return true;
+}
+
+bool param_verbose(const char *arg) {
+	if (!strcmp(arg, "NO")) p_verbose = false;
+	else if (!strcmp(arg, "YES")) p_verbose = true;
+	else return fail(EX_USAGE, "verbose must be one of "
+		"NO or YES");
+	return true;
+}
+
+bool param_compression(const char *arg) {
+	if (!strcmp(arg, "GREEDY")) p_compression = CM_GREEDY;
+	else if (!strcmp(arg, "BEST")) p_compression = CM_BEST;
+	else return fail(EX_USAGE, "compression must be one of "
+		"GREEDY or BEST");
+	return true;
+}
+
+bool param_blocks(const char *arg) {
+	if (!strcmp(arg, "FIXED")) p_blocks = BL_FIXED;
+	else if (!strcmp(arg, "PLANNED")) p_blocks = BL_PLANNED;
+	else return fail(EX_USAGE, "blocks must be one of "
+		"FIXED or PLANNED");
+	return true;
+}
+
+bool param_cache(const char *arg) {
+	if (!sscanf(arg, "%u", &p_cache))
+		return fail(EX_USAGE, "cache must be an unsigned integer");
+	if (p_cache > 4096)
+		return fail(EX_USAGE, "cache must be no more than 4096");
+	return true;
+}
+
+bool param_listen(const char *arg) {
+	p_listen = arg;
+	return true;
+}
+
+bool param_jobs(const char *arg) {
+	if (!sscanf(arg, "%u", &p_jobs))
+		return fail(EX_USAGE, "jobs must be an unsigned integer");
+	if (p_jobs < 1)
+		return fail(EX_USAGE, "jobs must be at least 1");
+	if (p_jobs > 64)
+		return fail(EX_USAGE, "jobs must be no more than 64");
+	return true;
+}
+
+bool param_send(const char *arg) {
+	p_send = arg;
+	return true;
+}
+
+bool param_depth(const char *arg) {
+	if (!strcmp(arg, "1")) p_depth = 1;
+	else if (!strcmp(arg, "8")) p_depth = 8;
+	else return fail(EX_USAGE, "depth must be one of "
+		"1 or 8");
+	return true;
+}
+
+bool param_screen(const char *arg) {
+	if (!strcmp(arg, "THRESHOLD")) p_screen = SC_THRESHOLD;
+	else if (!strcmp(arg, "BAYER")) p_screen = SC_BAYER;
+	else if (!strcmp(arg, "CLUSTERED")) p_screen = SC_CLUSTERED;
+	else return fail(EX_USAGE, "screen must be one of "
+		"THRESHOLD, BAYER, or CLUSTERED");
+	return true;
+}
+
+bool param_input_resolution(const char *arg) {
+	if (!strcmp(arg, "SAME")) p_input_resolution = IR_SAME;
+	else if (!strcmp(arg, "600")) p_input_resolution = IR_600;
+	else if (!strcmp(arg, "1200x600")) p_input_resolution = IR_1200x600;
+	else return fail(EX_USAGE, "input_resolution must be one of "
+		"SAME, 600, or 1200x600");
+	return true;
+}
+
+bool param_stats(const char *arg) {
+	unsigned int fd;
+	if (!sscanf(arg, "%u", &fd))
+		return fail(EX_USAGE, "stats must be an unsigned integer");
+	if (fd > INT_MAX)
+		return fail(EX_USAGE, "stats must be no more than %d", INT_MAX);
+	p_stats = fd;
+	return true;
+}
+
+bool param_trace(const char *arg) {
+	p_trace = arg;
+	return true;
+}
+
+bool param_fan_out(const char *arg) {
+	p_fan_out = arg;
+	return true;
+}
+
+bool param_range_pages(const char *arg) {
+	if (!sscanf(arg, "%u", &p_range_pages))
+		return fail(EX_USAGE, "range_pages must be an unsigned integer");
+	if (p_range_pages < 1)
+		return fail(EX_USAGE, "range_pages must be at least 1");
+	return true;
+}
+
+bool param_collate(const char *arg) {
+	if (!strcmp(arg, "NO")) p_collate = false;
+	else if (!strcmp(arg, "YES")) p_collate = true;
+	else return fail(EX_USAGE, "collate must be one of "
+		"NO or YES");
+	return true;
+}
+
+bool param_memory_limit(const char *arg) {
+	if (!sscanf(arg, "%u", &p_memory_limit))
+		return fail(EX_USAGE, "memory_limit must be an unsigned integer");
+	if (p_memory_limit > 65536)
+		return fail(EX_USAGE, "memory_limit must be no more than 65536");
+	return true;
 }
 
 /**
- * Set defaults, validate parameters, calculate padding.
+ * Set parameters from pairs of arguments, such as "-resolution" and "600".
+ *
+ * @param count Number of arguments
+ * @param args Arguments (names and values, one after the other)
+ * @return Whether all were set (false if errors are caught)
+ */
+bool param_parse(size_t count, const char *const *args) {
+	for (size_t i = 1; i < count; i += 2) {
+		bool set;
+		if (!strcmp(args[i - 1], "-resolution"))
+			set = param_resolution(args[i]);
+		else if (!strcmp(args[i - 1], "-econo_mode"))
+			set = param_econo_mode(args[i]);
+		else if (!strcmp(args[i - 1], "-source_tray"))
+			set = param_source_tray(args[i]);
+		else if (!strcmp(args[i - 1], "-media_type"))
+			set = param_media_type(args[i]);
+		else if (!strcmp(args[i - 1], "-time_out_sleep"))
+			set = param_time_out_sleep(args[i]);
+		else if (!strcmp(args[i - 1], "-paper"))
+			set = param_paper(args[i]);
+		else if (!strcmp(args[i - 1], "-suppress_job"))
+			set = param_suppress_job(args[i]);
+		else if (!strcmp(args[i - 1], "-emit_hqmmode"))
+			set = param_emit_hqmmode(args[i]);
+		else if (!strcmp(args[i - 1], "-suppress_ras1200mode_off"))
+			set = param_suppress_ras1200mode_off(args[i]);
+		else if (!strcmp(args[i - 1], "-copies"))
+			set = param_copies(args[i]);
+		else if (!strcmp(args[i - 1], "-duplex"))
+			set = param_duplex(args[i]);
+		else if (!strcmp(args[i - 1], "-width"))
+			set = param_width(args[i]);
+		else if (!strcmp(args[i - 1], "-height"))
+			set = param_height(args[i]);
+		else if (!strcmp(args[i - 1], "-threads"))
+			set = param_threads(args[i]);
+		else if (!strcmp(args[i - 1], "-queue_depth"))
+			set = param_queue_depth(args[i]);
+		else if (!strcmp(args[i - 1], "-input"))
+			set = param_input(args[i]);
+		else if (!strcmp(args[i - 1], "-streaming"))
+			set = param_streaming(args[i]);
+		else if (!strcmp(args[i - 1], "-verbose"))
+			set = param_verbose(args[i]);
+		else if (!strcmp(args[i - 1], "-compression"))
+			set = param_compression(args[i]);
+		else if (!strcmp(args[i - 1], "-blocks"))
+			set = param_blocks(args[i]);
+		else if (!strcmp(args[i - 1], "-cache"))
+			set = param_cache(args[i]);
+		else if (!strcmp(args[i - 1], "-listen"))
+			set = param_listen(args[i]);
+		else if (!strcmp(args[i - 1], "-jobs"))
+			set = param_jobs(args[i]);
+		else if (!strcmp(args[i - 1], "-send"))
+			set = param_send(args[i]);
+		else if (!strcmp(args[i - 1], "-depth"))
+			set = param_depth(args[i]);
+		else if (!strcmp(args[i - 1], "-screen"))
+			set = param_screen(args[i]);
+		else if (!strcmp(args[i - 1], "-input_resolution"))
+			set = param_input_resolution(args[i]);
+		else if (!strcmp(args[i - 1], "-stats"))
+			set = param_stats(args[i]);
+		else if (!strcmp(args[i - 1], "-trace"))
+			set = param_trace(args[i]);
+		else if (!strcmp(args[i - 1], "-fan_out"))
+			set = param_fan_out(args[i]);
+		else if (!strcmp(args[i - 1], "-range_pages"))
+			set = param_range_pages(args[i]);
+		else if (!strcmp(args[i - 1], "-collate"))
+			set = param_collate(args[i]);
+		else if (!strcmp(args[i - 1], "-memory_limit"))
+			set = param_memory_limit(args[i]);
+		else
+			set = fail(EX_USAGE, "unrecognized argument %s", args[i - 1]);
+		if (!set) return false;
+	}
+	return true;
+}
+
+/**
+ * Set defaults, validate parameters, calculate scaling and padding.
  *
  * If width and height are not set, set them to the selected page height
- * and width. Check that the height and width fit the selected page.
- * Calculate padding to center input data width on the page.
+ * and width (at the input resolution). Check that the height and width fit
+ * the selected page. Calculate the size of the page once scaled to the
+ * selected resolution, and padding to center it on the page.
+ *
+ * @return Whether the parameters are valid (false if errors are caught)
  */
-void param_validate() {
+bool param_validate() {
 	// Get width and height in dots at 120 DPI from selected paper.
 	size_t paper_width, paper_height;
-	switch (p_paper) {
-		case P_LEGAL:
-			paper_width = 1020;
-			paper_height = 1680;
-  			break;
-		case P_A4:
-			paper_width = 992;
-			paper_height = 1403;
-  			break;
-		case P_EXECUTIVE:
-			paper_width = 870;
-			paper_height = 1260;
-  			break;
-		case P_JISB5:
-			paper_width = 860;
-			paper_height = 1214;
-  			break;
-		case P_B5:
-			paper_width = 832;
-			paper_height = 1180;
-  			break;
-		case P_A5:
-			paper_width = 701;
-			paper_height = 992;
-  			break;
-		case P_B6:
-			paper_width = 590;
-			paper_height = 832;
-  			break;
-		case P_A6:
-			paper_width = 496;
-			paper_height = 701;
-  			break;
-		case P_C5:
-			paper_width = 767;
-			paper_height = 1082;
-  			break;
-		case P_DL:
-			paper_width = 520;
-			paper_height = 1039;
-  			break;
-		case P_COM10:
-			paper_width = 495;
-			paper_height = 1140;
-  			break;
-		case P_MONARCH:
-			paper_width = 465;
-			paper_height = 900;
-  			break;
-		case P_LETTER:
-		default:
-			paper_width = 1020;
-			paper_height = 1320;
-	}
+	paper_size(p_paper, &paper_width, &paper_height);
 
 	// Bring paper width and height to dots at the selected resolution.
 	switch(p_resolution) {
@@ -234,17 +514,329 @@ void param_validate() {
 			paper_height *= 5;
 	}
 
+	// Input at another resolution is scaled as it's read: 600 DPI to 300
+	// DPI by combining each 2x2 dots, or 600 DPI to 1200 DPI (or 1200x600
+	// DPI to 1200 DPI) by doubling dots across and encoding each row twice.
+	bool res_1200 = p_resolution == RES_1200 || p_resolution == RES_HQ1200A ||
+		p_resolution == RES_HQ1200B;
+	p_scale_x = SCALE_NONE;
+	p_scale_y = SCALE_NONE;
+	if (p_input_resolution == IR_600 && p_resolution == RES_300) {
+		p_scale_x = SCALE_DOWN;
+		p_scale_y = SCALE_DOWN;
+	} else if (p_input_resolution == IR_600 && res_1200) {
+		p_scale_x = SCALE_UP;
+		p_scale_y = SCALE_UP;
+	} else if (p_input_resolution == IR_1200x600 && res_1200)
+		p_scale_y = SCALE_UP;
+	else if (p_input_resolution == IR_600 && p_resolution != RES_600)
+		return fail(EX_USAGE, "input_resolution 600 can't be used with "
+			"resolution 600x300");
+	else if (p_input_resolution == IR_1200x600)
+		return fail(EX_USAGE, "input_resolution 1200x600 can only be used with "
+			"resolution 1200, HQ1200A, or HQ1200B");
+
+	// Bring paper width and height to dots at the input resolution.
+	size_t input_width = paper_width, input_height = paper_height;
+	if (p_scale_x == SCALE_UP) input_width /= 2;
+	if (p_scale_x == SCALE_DOWN) input_width *= 2;
+	if (p_scale_y == SCALE_UP) input_height /= 2;
+	if (p_scale_y == SCALE_DOWN) input_height *= 2;
+
+	// Jobs taken from a socket read their input from the socket and write
+	// their output back to it, and must not be able to name files for the
+	// server to open or hosts for it to connect to.
+	if (p_listen && p_input)
+		return fail(EX_USAGE, "input can't be used with listen");
+	if (p_listen && p_send)
+		return fail(EX_USAGE, "send can't be used with listen");
+	if (p_listen && p_fan_out)
+		return fail(EX_USAGE, "fan_out can't be used with listen");
+
+	// Pages sent to several printers are each encoded as a whole page, and
+	// go to the printers rather than standard output.
+	if (p_fan_out && p_send)
+		return fail(EX_USAGE, "fan_out can't be used with send");
+	if (p_fan_out && p_streaming)
+		return fail(EX_USAGE, "fan_out can't be used with streaming");
+	if (p_fan_out && p_stats >= 0)
+		return fail(EX_USAGE, "stats can't be used with fan_out");
+	if (p_fan_out && p_collate)
+		return fail(EX_USAGE, "collate can't be used with fan_out");
+
+	// Each printer prints its ranges one after the other, so with duplex,
+	// a range of an odd number of pages would put the first page of the
+	// next range on the back of its last page.
+	if (p_fan_out && p_duplex != DPX_OFF && p_range_pages & 1)
+		return fail(EX_USAGE,
+			"range_pages must be even with fan_out and duplex");
+
 	// Set input data with and height if not set.
-	if (!p_width) p_width = paper_width;
-	if (!p_height) p_height = paper_height;
+	if (!p_width) p_width = input_width;
+	if (!p_height) p_height = input_height;
 
 	// Validate width and height of input data fit on the selected paper.
-	if (p_width > paper_width)
-		errx(EX_USAGE, "width must not be greater than paper width");
-	if (p_height > paper_height)
-		errx(EX_USAGE, "height must not be greater than paper height");
+	if (p_width > input_width)
+		return fail(EX_USAGE, "width must not be greater than paper width");
+	if (p_height > input_height)
+		return fail(EX_USAGE, "height must not be greater than paper height");
+
+	// Size of the page once scaled. A dot left over when scaling down
+	// is combined with white.
+	p_scaled_width = p_scale_x == SCALE_UP ? p_width * 2 :
+		p_scale_x == SCALE_DOWN ? (p_width + 1) / 2 : p_width;
+	p_scaled_height = p_scale_y == SCALE_DOWN ? (p_height + 1) / 2 : p_height;
 
 	// Calculate padding in bytes to place the input data in the middle
 	// of the page. Rounds down to the nearest byte.
-	p_padding = ((paper_width - p_width) / 2) >> 3;
+	p_padding = ((paper_width - p_scaled_width) / 2) >> 3;
+
+	// Validate width and height of input data leave something inside the
+	// margins, once scaled.
+	size_t min_length, min_rows;
+	pcl_min_size(&min_length, &min_rows);
+	size_t min_width = 8 * (min_length - 1) + 1;
+	if (p_scale_x == SCALE_UP) min_width = (min_width + 1) / 2;
+	if (p_scale_x == SCALE_DOWN) min_width = 2 * min_width - 1;
+	size_t min_height = p_scale_y == SCALE_DOWN ? 2 * min_rows - 1 : min_rows;
+	if (p_width < min_width)
+		return fail(EX_DATAERR,
+			"width must be at least %zu to leave room inside the margins",
+			min_width);
+	if (p_height < min_height)
+		return fail(EX_DATAERR,
+			"height must be at least %zu to leave room inside the margins",
+			min_height);
+	return true;
+}
+
+/**
+ * Take the size of the pages from the input, in place of the width and
+ * height parameters. The resolution and paper are taken too, if the input
+ * gives them.
+ *
+ * @param size Size of the pages of the input
+ * @return Whether the size is supported (false if errors are caught)
+ */
+bool param_input_size(const struct input_size *size) {
+	p_width = size->width;
+	p_height = size->height;
+
+	// Any of the 1200 DPI modes takes 1200 DPI input, so keep the one
+	// selected (if any). The 300 DPI and 1200 DPI modes can take 600 DPI
+	// input too (scaled), so keep them for that.
+	unsigned int x = size->x_resolution, y = size->y_resolution;
+	bool res_1200 = p_resolution == RES_1200 || p_resolution == RES_HQ1200A ||
+		p_resolution == RES_HQ1200B;
+	p_input_resolution = IR_SAME;
+	if (x == 600 && y == 600 && (p_resolution == RES_300 || res_1200))
+		p_input_resolution = IR_600;
+	else if (x == 1200 && y == 600) {
+		p_input_resolution = IR_1200x600;
+		if (!res_1200) p_resolution = RES_HQ1200A;
+	} else if (x == 300 && y == 300) p_resolution = RES_300;
+	else if (x == 600 && y == 600) p_resolution = RES_600;
+	else if (x == 600 && y == 300) p_resolution = RES_600x300;
+	else if (x == 1200 && y == 1200) {
+		if (p_resolution != RES_HQ1200A && p_resolution != RES_HQ1200B)
+			p_resolution = RES_1200;
+	} else if (x || y)
+		return fail(EX_DATAERR, "input resolution of %ux%u DPI isn't supported",
+			x, y);
+
+	// Paper is given in points. Take the supported paper within 1/20" of
+	// it, if there is one.
+	if (!size->paper_width || !size->paper_height) return true;
+	size_t width = size->paper_width * 5 / 3;
+	size_t height = size->paper_height * 5 / 3;
+	for (enum Paper paper = P_LEGAL; paper <= P_MONARCH; paper++) {
+		size_t paper_width, paper_height;
+		paper_size(paper, &paper_width, &paper_height);
+		if ((width > paper_width ? width - paper_width :
+					paper_width - width) <= 6 &&
+				(height > paper_height ? height - paper_height :
+					paper_height - height) <= 6) {
+			p_paper = paper;
+			return true;
+		}
+	}
+	return true;
+}
+
+/**
+ * Set every parameter to its default.
+ */
+void param_reset() {
+	param_set(&defaults);
+}
+
+/**
+ * Keep the current parameters so they can be restored by param_restore().
+ */
+void param_save() {
+	param_get(&saved);
+}
+
+/**
+ * Restore the parameters kept by param_save(), undoing any set since.
+ */
+void param_restore() {
+	param_set(&saved);
+}
+
+/**
+ * Get the parameters of the calling thread.
+ *
+ * @param params Set to the parameters
+ */
+void param_get(struct params *params) {
+	params->resolution = p_resolution;
+	params->econo_mode = p_econo_mode;
+	params->source_tray = p_source_tray;
+	params->media_type = p_media_type;
+	params->time_out_sleep = p_time_out_sleep;
+	params->paper = p_paper;
+	params->suppress_job = p_suppress_job;
+	params->emit_hqmmode = p_emit_hqmmode;
+	params->suppress_ras1200mode_off = p_suppress_ras1200mode_off;
+	params->copies = p_copies;
+	params->duplex = p_duplex;
+	params->width = p_width;
+	params->height = p_height;
+	params->padding = p_padding;
+	params->threads = p_threads;
+	params->queue_depth = p_queue_depth;
+	params->input = p_input;
+	params->streaming = p_streaming;
+	params->verbose = p_verbose;
+	params->compression = p_compression;
+	params->blocks = p_blocks;
+	params->cache = p_cache;
+	params->listen = p_listen;
+	params->jobs = p_jobs;
+	params->send = p_send;
+	params->depth = p_depth;
+	params->screen = p_screen;
+	params->input_resolution = p_input_resolution;
+	params->scale_x = p_scale_x;
+	params->scale_y = p_scale_y;
+	params->scaled_width = p_scaled_width;
+	params->scaled_height = p_scaled_height;
+	params->stats = p_stats;
+	params->trace = p_trace;
+	params->fan_out = p_fan_out;
+	params->range_pages = p_range_pages;
+	params->collate = p_collate;
+	params->memory_limit = p_memory_limit;
+}
+
+/**
+ * Set the parameters of the calling thread, such as a thread doing part of
+ * the work of a job on another thread.
+ *
+ * @param params Parameters
+ */
+void param_set(const struct params *params) {
+	p_resolution = params->resolution;
+	p_econo_mode = params->econo_mode;
+	p_source_tray = params->source_tray;
+	p_media_type = params->media_type;
+	p_time_out_sleep = params->time_out_sleep;
+	p_paper = params->paper;
+	p_suppress_job = params->suppress_job;
+	p_emit_hqmmode = params->emit_hqmmode;
+	p_suppress_ras1200mode_off = params->suppress_ras1200mode_off;
+	p_copies = params->copies;
+	p_duplex = params->duplex;
+	p_width = params->width;
+	p_height = params->height;
+	p_padding = params->padding;
+	p_threads = params->threads;
+	p_queue_depth = params->queue_depth;
+	p_input = params->input;
+	p_streaming = params->streaming;
+	p_verbose = params->verbose;
+	p_compression = params->compression;
+	p_blocks = params->blocks;
+	p_cache = params->cache;
+	p_listen = params->listen;
+	p_jobs = params->jobs;
+	p_send = params->send;
+	p_depth = params->depth;
+	p_screen = params->screen;
+	p_input_resolution = params->input_resolution;
+	p_scale_x = params->scale_x;
+	p_scale_y = params->scale_y;
+	p_scaled_width = params->scaled_width;
+	p_scaled_height = params->scaled_height;
+	p_stats = params->stats;
+	p_trace = params->trace;
+	p_fan_out = params->fan_out;
+	p_range_pages = params->range_pages;
+	p_collate = params->collate;
+	p_memory_limit = params->memory_limit;
+}
+
+/**
+ * Get the size of a paper.
+ *
+ * @param paper Paper
+ * @param width Set to the width in dots at 120 DPI
+ * @param height Set to the height in dots at 120 DPI
+ */
+static void paper_size(enum Paper paper, size_t *width, size_t *height) {
+	switch (paper) {
+		case P_LEGAL:
+			*width = 1020;
+			*height = 1680;
+  			break;
+		case P_A4:
+			*width = 992;
+			*height = 1403;
+  			break;
+		case P_EXECUTIVE:
+			*width = 870;
+			*height = 1260;
+  			break;
+		case P_JISB5:
+			*width = 860;
+			*height = 1214;
+  			break;
+		case P_B5:
+			*width = 832;
+			*height = 1180;
+  			break;
+		case P_A5:
+			*width = 701;
+			*height = 992;
+  			break;
+		case P_B6:
+			*width = 590;
+			*height = 832;
+  			break;
+		case P_A6:
+			*width = 496;
+			*height = 701;
+  			break;
+		case P_C5:
+			*width = 767;
+			*height = 1082;
+  			break;
+		case P_DL:
+			*width = 520;
+			*height = 1039;
+  			break;
+		case P_COM10:
+			*width = 495;
+			*height = 1140;
+  			break;
+		case P_MONARCH:
+			*width = 465;
+			*height = 900;
+  			break;
+		case P_LETTER:
+		default:
+			*width = 1020;
+			*height = 1320;
+	}
 }
@@ -1,7 +1,9 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-extern enum Resolution {
+struct input_size;
+
+extern __thread enum Resolution {
 	RES_300,
 	RES_600,
 	RES_1200,
@@ -10,9 +12,9 @@ extern enum Resolution {
 	RES_600x300
 } p_resolution;
 
-extern bool p_econo_mode;
+extern __thread bool p_econo_mode;
 
-extern enum SourceTray {
+extern __thread enum SourceTray {
 	ST_AUTO,
 	ST_TRAY1,
 	ST_TRAY2,
@@ -23,7 +25,7 @@ extern enum SourceTray {
 	ST_MPTRAY
 } p_source_tray;
 
-extern enum MediaType {
+extern __thread enum MediaType {
 	MT_REGULAR,
 	MT_THIN,
 	MT_THICK,
@@ -34,9 +36,9 @@ extern enum MediaType {
 	MT_RECYCLED
 } p_media_type;
 
-extern unsigned int p_time_out_sleep;
+extern __thread unsigned int p_time_out_sleep;
 
-extern enum Paper {
+extern __thread enum Paper {
 	P_LEGAL,
 	P_LETTER,
 	P_A4,
@@ -52,32 +54,162 @@ extern enum Paper {
 	P_MONARCH
 } p_paper;
 
-extern bool p_suppress_job;
-extern bool p_emit_hqmmode;
-extern bool p_suppress_ras1200mode_off;
-extern unsigned int p_copies;
+extern __thread bool p_suppress_job;
+extern __thread bool p_emit_hqmmode;
+extern __thread bool p_suppress_ras1200mode_off;
+extern __thread unsigned int p_copies;
 
-extern enum Duplex {
+extern __thread enum Duplex {
 	DPX_OFF,
 	DPX_LONG,
 	DPX_SHORT
 } p_duplex;
 
-extern size_t p_width;
-extern size_t p_height;
-extern size_t p_padding;
-
-void param_resolution(const char *arg);
-void param_econo_mode(const char *arg);
-void param_source_tray(const char *arg);
-void param_media_type(const char *arg);
-void param_time_out_sleep(const char *arg);
-void param_paper(const char *arg);
-void param_suppress_job(const char *arg);
-void param_emit_hqmmode(const char *arg);
-void param_suppress_ras1200mode_off(const char *arg);
-void param_copies(const char *arg);
-void param_duplex(const char *arg);
-void param_width(const char *arg);
-void param_height(const char *arg);
-void param_validate();
+extern __thread size_t p_width;
+extern __thread size_t p_height;
+extern __thread size_t p_padding;
+extern __thread unsigned int p_threads;
+extern __thread unsigned int p_queue_depth;
+extern __thread const char *p_input;
+extern __thread bool p_streaming;
+extern __thread bool p_verbose;
+
+extern __thread enum Compression {
+	CM_GREEDY,
+	CM_BEST
+} p_compression;
+
+extern __thread enum Blocks {
+	BL_FIXED,
+	BL_PLANNED
+} p_blocks;
+
+extern __thread unsigned int p_cache;
+extern __thread const char *p_listen;
+extern __thread unsigned int p_jobs;
+extern __thread const char *p_send;
+extern __thread unsigned int p_depth;
+
+extern __thread enum Screen {
+	SC_THRESHOLD,
+	SC_BAYER,
+	SC_CLUSTERED
+} p_screen;
+
+extern __thread enum InputResolution {
+	IR_SAME,
+	IR_600,
+	IR_1200x600
+} p_input_resolution;
+
+// Scaling of the input to the selected resolution, across and down. Rows
+// scaled up are encoded twice rather than copied.
+extern __thread enum Scale {
+	SCALE_NONE,
+	SCALE_UP,
+	SCALE_DOWN
+} p_scale_x, p_scale_y;
+
+// File descriptor for statistics, or -1 if none.
+extern __thread int p_stats;
+extern __thread const char *p_trace;
+
+// Printers (or files) to send ranges of pages to, separated by commas.
+extern __thread const char *p_fan_out;
+extern __thread unsigned int p_range_pages;
+
+// Copies are collated by sending the pages again rather than by the printer.
+extern __thread bool p_collate;
+
+// Megabytes of memory a job should stay within, or 0 for no limit.
+extern __thread unsigned int p_memory_limit;
+
+// Width and height of pages once scaled (rows encoded twice counted once).
+extern __thread size_t p_scaled_width;
+extern __thread size_t p_scaled_height;
+
+/**
+ * All the parameters, as kept for a job or given to a thread.
+ */
+struct params {
+	enum Resolution resolution;
+	bool econo_mode;
+	enum SourceTray source_tray;
+	enum MediaType media_type;
+	unsigned int time_out_sleep;
+	enum Paper paper;
+	bool suppress_job;
+	bool emit_hqmmode;
+	bool suppress_ras1200mode_off;
+	unsigned int copies;
+	enum Duplex duplex;
+	size_t width;
+	size_t height;
+	size_t padding;
+	unsigned int threads;
+	unsigned int queue_depth;
+	const char *input;
+	bool streaming;
+	bool verbose;
+	enum Compression compression;
+	enum Blocks blocks;
+	unsigned int cache;
+	const char *listen;
+	unsigned int jobs;
+	const char *send;
+	unsigned int depth;
+	enum Screen screen;
+	enum InputResolution input_resolution;
+	enum Scale scale_x;
+	enum Scale scale_y;
+	size_t scaled_width;
+	size_t scaled_height;
+	int stats;
+	const char *trace;
+	const char *fan_out;
+	unsigned int range_pages;
+	bool collate;
+	unsigned int memory_limit;
+};
+
+bool param_resolution(const char *arg);
+bool param_econo_mode(const char *arg);
+bool param_source_tray(const char *arg);
+bool param_media_type(const char *arg);
+bool param_time_out_sleep(const char *arg);
+bool param_paper(const char *arg);
+bool param_suppress_job(const char *arg);
+bool param_emit_hqmmode(const char *arg);
+bool param_suppress_ras1200mode_off(const char *arg);
+bool param_copies(const char *arg);
+bool param_duplex(const char *arg);
+bool param_width(const char *arg);
+bool param_height(const char *arg);
+bool param_threads(const char *arg);
+bool param_queue_depth(const char *arg);
+bool param_input(const char *arg);
+bool param_streaming(const char *arg);
+bool param_verbose(const char *arg);
+bool param_compression(const char *arg);
+bool param_blocks(const char *arg);
+bool param_cache(const char *arg);
+bool param_listen(const char *arg);
+bool param_jobs(const char *arg);
+bool param_send(const char *arg);
+bool param_depth(const char *arg);
+bool param_screen(const char *arg);
+bool param_input_resolution(const char *arg);
+bool param_stats(const char *arg);
+bool param_trace(const char *arg);
+bool param_fan_out(const char *arg);
+bool param_range_pages(const char *arg);
+bool param_collate(const char *arg);
+bool param_memory_limit(const char *arg);
+bool param_validate();
+bool param_input_size(const struct input_size *size);
+bool param_parse(size_t count, const char *const *args);
+void param_reset();
+void param_save();
+void param_restore();
+void param_get(struct params *params);
+void param_set(const struct params *params);
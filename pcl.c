@@ -4,25 +4,148 @@
  * @copyright 2022 Parks Digital LLC
  */
 
+#include "cache.h"
 #include "compress.h"
+#include "fail.h"
+#include "output.h"
 #include "parameters.h"
 #include "pcl.h"
-#include <err.h>
-#include <stdio.h>
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
+#include "workers.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 
-void raster_data(uint8_t *buffer, size_t *buffer_length, uint8_t *buffer_rows,
-	const uint8_t *row, size_t row_length);
+// Number of rows in each band of a page compressed by a worker thread.
+#define BAND_ROWS 128
+
+// Limits on the size of a block of rows.
+#define BLOCK_ROWS 128
+#define BLOCK_BYTES 16384
+
+/**
+ * A band of rows compressed ahead of time by a worker thread.
+ */
+struct band {
+	uint8_t *data; // Compressed rows, one after the other
+	size_t capacity; // Size of the compressed data buffer
+	size_t offsets[BAND_ROWS + 1]; // Offset of each row in the buffer
+	uint8_t *first_data; // Rows compressed as the first row of a block
+	size_t first_capacity;
+	size_t first_offsets[BAND_ROWS + 1];
+	bool failed; // Set if a buffer couldn't be grown
+};
+
+/**
+ * A page being compressed in bands by worker threads.
+ */
+struct page {
+	uint8_t *in; // First printable byte of the first printable row
+	size_t row_length;
+	size_t printable_length;
+	size_t printable_rows;
+	struct band *bands;
+	bool *starts; // Rows which start a block, if blocks are planned
+	const struct params *params; // Parameters, for the worker threads
+};
+
+/**
+ * Least-bytes placement of blocks for a page, kept from page to page. The
+ * arrays are allocated together, starting with alone.
+ */
+struct plan {
+	size_t *alone; // Size of each row as the first row of a block
+	size_t *with; // Size of each row compressed against the row before
+	size_t *cost; // Fewest bytes for the rows before each row
+	size_t *from; // First row of the last block for that cost
+	bool *starts;
+	size_t capacity;
+};
+
+/**
+ * State of the block being built for a page.
+ */
+struct encoder {
+	size_t printable_length;
+	uint8_t *block; // Block buffer (from the output) rows are compressed into
+	size_t block_len;
+	uint8_t block_rows;
+};
+
+/**
+ * State of a page being streamed a row at a time.
+ */
+struct stream {
+	struct page page;
+	struct encoder encoder;
+	size_t row_count;
+	size_t margin_rows;
+	size_t margin_bytes;
+	size_t row; // Index of the next input row of the page
+	uint8_t *kept; // Printable part of the last even row, if rows are skipped
+	size_t kept_capacity;
+};
+
+static void page_layout(struct page *page, size_t row_count,
+	size_t *margin_rows, size_t *margin_bytes);
+static bool page_begin(struct output *out, struct encoder *encoder);
+static bool page_row(struct output *out, struct encoder *encoder,
+	const struct page *page, size_t row, uint8_t *in, uint8_t *last,
+	bool *blank);
+static size_t blank_rows(const struct page *page, size_t row);
+static bool rows_doubled();
+static bool rows_skipped();
+static size_t last_distance(size_t row);
+static bool page_blank(struct output *out, struct encoder *encoder,
+	size_t row, size_t count);
+static bool page_duplicate(struct output *out, struct encoder *encoder,
+	uint8_t *in);
+static bool page_end(struct output *out, struct encoder *encoder);
+bool compress_bands(struct page *page);
+void compress_band(void *arg, size_t index);
+static bool band_room(uint8_t **data, size_t *capacity, size_t used,
+	size_t worst);
+static bool caching();
+static void keep_state();
+static void make_key();
+static void free_state(void *unused);
+static void plan_blocks(struct page *page);
+static size_t plan_row(const struct page *page, size_t row, bool first);
+static bool block_next(struct output *out, struct encoder *encoder);
+static uint8_t *row_space(struct output *out, struct encoder *encoder);
+bool raster_data(struct output *out, struct encoder *encoder,
+	size_t row_length, bool fallback);
+
+// Worker threads and band buffers are kept from page to page. Each thread
+// encoding pages has its own, so jobs may be encoded on several threads at
+// once. They're freed when the thread exits (see keep_state()).
+static __thread struct workers *workers;
+static __thread unsigned int worker_threads; // Pool threads (with this one)
+static __thread struct band *bands;
+static __thread size_t band_count;
+static __thread struct plan plan;
+
+static __thread struct stream stream;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key; // Set on threads with state to free on exit
+static bool key_made;
 
 /**
  * Emit PCL that is required at the beginning of a job.
+ *
+ * @param out Output buffer
+ * @return Whether the output is whole
  */
-void pcl_begin() {
+bool pcl_begin(struct output *out) {
 	// Printer Reset command. I think this just resets the PCL environment,
 	// not the whole printer.
-	fputs("\eE", stdout);
+	output_puts(out, "\eE");
 
 	// Some page sizes are set up with PJL and some are set up with a
 	// hard-coded PCL command. All commands appear to set page size to
@@ -31,19 +154,19 @@ void pcl_begin() {
 	// and the top margin to one line (1/6").
 	switch (p_paper) {
 		case P_LEGAL:
-			fputs("\e&l4096a3a6d1E", stdout);
+			output_puts(out, "\e&l4096a3a6d1E");
 			break;
 		case P_LETTER:
-			fputs("\e&l4096a2a6d1E", stdout);
+			output_puts(out, "\e&l4096a2a6d1E");
 			break;
 		case P_A4:
-			fputs("\e&l4096a26a6d1E", stdout);
+			output_puts(out, "\e&l4096a26a6d1E");
 			break;
 		case P_A5:
-			fputs("\e&l4096a25a6d1E", stdout);
+			output_puts(out, "\e&l4096a25a6d1E");
 			break;
 		case P_A6:
-			fputs("\e&l4096a24a6d1E", stdout);
+			output_puts(out, "\e&l4096a24a6d1E");
 			break;
 		case P_EXECUTIVE:
 		case P_JISB5:
@@ -61,172 +184,910 @@ void pcl_begin() {
 	// selected printer resolution.
 	switch (p_resolution) {
 		case RES_300:
-			fputs("\e&u300D", stdout);
-			fputs("\e*t300R", stdout);
+			output_puts(out, "\e&u300D");
+			output_puts(out, "\e*t300R");
 			break;
 		case RES_1200:
 		case RES_HQ1200B:
-			fputs("\e&u1200D", stdout);
-			fputs("\e*t1200R", stdout);
+			output_puts(out, "\e&u1200D");
+			output_puts(out, "\e*t1200R");
 			break;
 		case RES_HQ1200A:
-			fputs("\e&u1200D", stdout);
-			fputs("\e*t600R" , stdout);
+			output_puts(out, "\e&u1200D");
+			output_puts(out, "\e*t600R");
 			break;
 		case RES_600:
 		case RES_600x300:
 		default:
-			fputs("\e&u600D", stdout);
-			fputs("\e*t600R", stdout);
+			output_puts(out, "\e&u600D");
+			output_puts(out, "\e*t600R");
 			break;
 	}
 
 	// If the source tray is manual, set the paper source to manual feed.
 	if (p_source_tray == ST_MANUAL)
-		fputs("\e&l2H", stdout);
+		output_puts(out, "\e&l2H");
 
-	// Set number of copies if more than one.
-	if (p_copies > 1)
-		printf("\e&l%dX", p_copies);
+	// Set number of copies if more than one, unless the copies are collated
+	// (by sending the pages again).
+	if (p_copies > 1 && !p_collate)
+		output_printf(out, "\e&l%dX", p_copies);
 
 	// Duplex type (no need to emit a command for simplex).
 	switch (p_duplex) {
 		case DPX_LONG:
-			fputs("\e&l1S", stdout);
+			output_puts(out, "\e&l1S");
 			break;
 		case DPX_SHORT:
-			fputs("\e&l2S", stdout);
+			output_puts(out, "\e&l2S");
 			break;
 		case DPX_OFF:
 		default:
 			break;
 	}
+	return !out->failed;
 }
 
 /**
  * Emit PCL for one page of raw data.
+ *
+ * If errors are caught and the page can't be encoded, the output of the
+ * page is left part way through (to be discarded). The buffers kept from
+ * page to page are left as they were, for the next page.
+ *
+ * @param out Output buffer for the page
  * @param in Input data buffer
  * @param row_length Length of input data rows in bytes
  * @param row_count Number of input data rows
+ * @return Whether the page was encoded
  */
-void pcl_page(uint8_t *in, size_t row_length, size_t row_count) {
-	// Begin a continuing Set Compression Method command. The method parameter
-	// is set to 1030, which appears to be proprietary and undocumented. The
-	// parameter character is given in lower-case, so more parameters can be
-	// given. Transfer Raster Data parameters will be added for each block
-	// of 128 rows or 16kB, whichever is less. After all the data parameters
-	// for the page have been emitted, a final Set Compression Method
-	// parameter will be added with an upper-case parameter character to
-	// conclude the command.
-	fputs("\e*b1030m", stdout);
+bool pcl_page(struct output *out, uint8_t *in, size_t row_length,
+		size_t row_count) {
+	uint64_t start = trace_now();
+	keep_state();
+
+	// Start collecting statistics for the page, if enabled.
+	if (p_stats >= 0) {
+		out->stats = (struct stats){.raster_bytes = row_length * row_count};
+		stats_start(&out->stats);
+	}
 
-	// Horizontal and vertical margins are 1/6". The size in bytes or rows
-	// depends on the resolution mode. Calculate the printable length in
-	// bytes of each row and the number of printable rows within these margins.
-	// The printable length is limited to 16.64". Advance the input buffer to
+	// Find the printable part of the page and advance the input buffer to
 	// the first printable byte.
-	size_t printable_length, printable_rows;
+	size_t margin_rows, margin_bytes;
+	struct page page = {.row_length = row_length};
+	page_layout(&page, row_count, &margin_rows, &margin_bytes);
+	in += margin_rows * row_length + margin_bytes;
+	page.in = in;
+
+	struct encoder encoder = {.printable_length = page.printable_length};
+
+	// Look for blank rows at the top of the page. If the whole page is
+	// blank, there's nothing to compress.
+	size_t blank = blank_rows(&page, 0);
+
+	// If worker threads or the cache are enabled, compress all the rows of
+	// the page ahead of time in bands. Each row is compressed against the
+	// row before it, since that's what will be needed for most rows. Bands
+	// seen before are taken from the cache. If blocks are planned, each row
+	// is also compressed on its own, and the sizes are used to decide where
+	// blocks start.
+	if (blank == page.printable_rows)
+		;
+	else if (p_blocks == BL_PLANNED) {
+		if (page.printable_rows + 1 > plan.capacity) {
+			// The arrays of the plan are allocated all together.
+			size_t capacity = page.printable_rows + 1;
+			size_t *arrays = realloc(plan.alone,
+				capacity * (4 * sizeof(size_t) + sizeof(bool)));
+			if (!arrays) return fail_errno(EX_OSERR, "allocate block plan");
+			plan.alone = arrays;
+			plan.with = arrays + capacity;
+			plan.cost = arrays + 2 * capacity;
+			plan.from = arrays + 3 * capacity;
+			plan.starts = (bool *)(arrays + 4 * capacity);
+			plan.capacity = capacity;
+		}
+		page.starts = plan.starts;
+		if (!compress_bands(&page)) return false;
+		plan_blocks(&page);
+		blank = 0;
+	} else if ((p_threads > 1 || caching()) && !compress_bands(&page))
+		return false;
+
+	// Compress each input row and put it into the output block buffer. When
+	// the block buffer is full, emit it as a continuing raster data parameter
+	// for the ongoing command. Runs of blank rows are put into the block
+	// buffer all at once. After each blank row, look for more (unless
+	// blocks are planned, in which case blank rows are compressed like any
+	// others).
+	if (!page_begin(out, &encoder)) return false;
+	for (size_t row = 0; row < page.printable_rows;) {
+		if (blank) {
+			if (!page_blank(out, &encoder, row, blank)) return false;
+			row += blank;
+			in += blank * row_length;
+			blank = 0;
+			continue;
+		}
+		bool row_blank;
+		if (!page_row(out, &encoder, &page, row, in,
+				in - last_distance(row) * row_length, &row_blank))
+			return false;
+		if (row_blank && !page.starts)
+			blank = blank_rows(&page, row + 1);
+		row++;
+		in += row_length;
+	}
+	bool encoded = page_end(out, &encoder);
+	if (p_stats >= 0) stats_stop(&out->stats);
+	trace_event("encode", start);
+	return encoded;
+}
+
+/**
+ * Begin streaming pages of raw data a row at a time.
+ *
+ * Rather than waiting for a whole page of input, each block is emitted as
+ * soon as it's full. Only the current and last input rows are needed (and
+ * a copy of the last even row, when odd rows are skipped).
+ *
+ * @param row_length Length of input data rows in bytes
+ * @param row_count Number of input data rows in each page
+ */
+void pcl_stream_begin(size_t row_length, size_t row_count) {
+	keep_state();
+	stream.page.row_length = row_length;
+	stream.row_count = row_count;
+	page_layout(&stream.page, row_count, &stream.margin_rows,
+		&stream.margin_bytes);
+	stream.row = 0;
+
+	stream.encoder.printable_length = stream.page.printable_length;
+	if (rows_skipped() && stream.kept_capacity < stream.page.printable_length) {
+		free(stream.kept);
+		stream.kept_capacity = 0;
+		stream.kept = malloc(stream.page.printable_length);
+		if (!stream.kept) fail_errno(EX_OSERR, "allocate kept row");
+		stream.kept_capacity = stream.page.printable_length;
+	}
+}
+
+/**
+ * Emit PCL for one row of raw data streamed from the input.
+ *
+ * Rows in the top and bottom margins are skipped. The page is begun with
+ * its first row and concluded with its last row.
+ *
+ * @param out Output buffer
+ * @param in Input row
+ * @param last Last input row (ignored for the first row of a page)
+ * @return True if the row concluded a page
+ */
+bool pcl_stream_row(struct output *out, uint8_t *in, uint8_t *last) {
+	if (p_stats >= 0) {
+		if (!stream.row)
+			out->stats = (struct stats){
+				.raster_bytes = stream.page.row_length *
+					stream.row_count};
+		stats_start(&out->stats);
+	}
+	if (!stream.row)
+		page_begin(out, &stream.encoder);
+
+	// When odd rows are skipped, even rows are compressed against the last
+	// even row, which is kept since its buffer has been reused.
+	size_t row = stream.row - stream.margin_rows;
+	if (stream.row >= stream.margin_rows &&
+			row < stream.page.printable_rows) {
+		bool kept = last_distance(row) == 2;
+		bool blank;
+		page_row(out, &stream.encoder, &stream.page, row,
+			in + stream.margin_bytes,
+			kept ? stream.kept : row ? last + stream.margin_bytes : NULL,
+			&blank);
+		if (kept)
+			memcpy(stream.kept, in + stream.margin_bytes,
+				stream.page.printable_length);
+	}
+
+	bool page_done = ++stream.row == stream.row_count;
+	if (page_done) {
+		page_end(out, &stream.encoder);
+		stream.row = 0;
+	}
+	if (p_stats >= 0) stats_stop(&out->stats);
+	return page_done;
+}
+
+/**
+ * Finish streaming pages.
+ *
+ * If the input ended part way through a page, the output of the page
+ * (which must not have been flushed) is discarded, as the input was when
+ * taking whole pages.
+ *
+ * @param out Output buffer
+ */
+void pcl_stream_end(struct output *out) {
+	if (stream.row) output_discard(out);
+	stream.row = 0;
+}
+
+/**
+ * Find the printable part of a page of raw data, as pcl_page() does.
+ *
+ * @param row_length Length of input data rows in bytes
+ * @param row_count Number of input data rows
+ * @param margin_rows Set to the number of rows in the top margin
+ * @param margin_bytes Set to the number of bytes in the left margin
+ * @param printable_length Set to the length of the printable part of each
+ * row
+ * @param printable_rows Set to the number of printable rows
+ */
+void pcl_layout(size_t row_length, size_t row_count, size_t *margin_rows,
+		size_t *margin_bytes, size_t *printable_length,
+		size_t *printable_rows) {
+	struct page page = {.row_length = row_length};
+	page_layout(&page, row_count, margin_rows, margin_bytes);
+	*printable_length = page.printable_length;
+	*printable_rows = page.printable_rows;
+}
+
+/**
+ * Find the smallest page of raw data with anything printable inside the
+ * margins (one byte of one row).
+ *
+ * @param row_length Set to the least length of input data rows in bytes
+ * @param row_count Set to the least number of input data rows
+ */
+void pcl_min_size(size_t *row_length, size_t *row_count) {
+	struct page page = {0};
+	size_t margin_rows, margin_bytes;
+	page_layout(&page, 0, &margin_rows, &margin_bytes);
+	*row_length = 2 * margin_bytes + 1;
+	*row_count = 2 * margin_rows + 1;
+}
+
+/**
+ * Emit rows which are already compressed as the raster data of a page, as
+ * pcl_page() does with each row once it's compressed. This lets the packing
+ * of rows into blocks be timed on its own.
+ *
+ * @param out Output buffer
+ * @param rows Compressed rows, one after another
+ * @param lengths Length of each compressed row
+ * @param count Number of rows
+ */
+void pcl_raster(struct output *out, const uint8_t *rows,
+		const size_t *lengths, size_t count) {
+	struct encoder encoder = {0};
+	page_begin(out, &encoder);
+	for (size_t i = 0; i < count; i++) {
+		memcpy(row_space(out, &encoder), rows, lengths[i]);
+		raster_data(out, &encoder, lengths[i], false);
+		rows += lengths[i];
+	}
+	page_end(out, &encoder);
+}
+
+/**
+ * Find the printable part of a page.
+ *
+ * Horizontal and vertical margins are 1/6". The size in bytes or rows
+ * depends on the resolution mode. Calculate the printable length in
+ * bytes of each row and the number of printable rows within these margins.
+ * The printable length is limited to 16.64".
+ *
+ * @param page Page (row length must be set; printable length and rows are
+ * set on return)
+ * @param row_count Number of input data rows
+ * @param margin_rows Set to the number of rows in the top margin
+ * @param margin_bytes Set to the number of bytes in the left margin
+ */
+static void page_layout(struct page *page, size_t row_count,
+		size_t *margin_rows, size_t *margin_bytes) {
+	size_t row_length = page->row_length;
 	switch (p_resolution) {
 		case RES_300:
-			printable_length = row_length - 12;
-			if (printable_length > 624) printable_length = 624;
-			printable_rows = row_count - 100;
-			in += 50 * row_length + 6;
+			page->printable_length = row_length - 12;
+			if (page->printable_length > 624) page->printable_length = 624;
+			page->printable_rows = row_count - 100;
+			*margin_rows = 50;
+			*margin_bytes = 6;
 			break;
 		case RES_1200:
 		case RES_HQ1200A:
 		case RES_HQ1200B:
-			printable_length = row_length - 50;
-			if (printable_length + p_padding > 2496)
-				printable_length = 2496 - p_padding;
-			printable_rows = row_count - 400;
-			in += 200 * row_length + 25;
+			page->printable_length = row_length - 50;
+			if (page->printable_length + p_padding > 2496)
+				page->printable_length = 2496 - p_padding;
+			*margin_rows = rows_doubled() ? 100 : 200;
+			page->printable_rows = row_count - 2 * *margin_rows;
+			*margin_bytes = 25;
 			break;
 		case RES_600x300:
-			printable_length = row_length - 24;
-			if (printable_length + p_padding > 1248)
-				printable_length = 1248 - p_padding;
-			printable_rows = row_count - 100;
-			in += 50 * row_length + 12;
+			page->printable_length = row_length - 24;
+			if (page->printable_length + p_padding > 1248)
+				page->printable_length = 1248 - p_padding;
+			page->printable_rows = row_count - 100;
+			*margin_rows = 50;
+			*margin_bytes = 12;
 			break;
 		case RES_600:
 		default:
-			printable_length = row_length - 24;
-			if (printable_length + p_padding > 1248)
-				printable_length = 1248 - p_padding;
-			printable_rows = row_count - 200;
-			in += 100 * row_length + 12;
+			page->printable_length = row_length - 24;
+			if (page->printable_length + p_padding > 1248)
+				page->printable_length = 1248 - p_padding;
+			page->printable_rows = row_count - 200;
+			*margin_rows = 100;
+			*margin_bytes = 12;
 	}
+}
 
-	// Initialize the output block buffer. Output block size is limited
-	// to the lesser of 128 rows or 16kB.
-	uint8_t *out_block = calloc(16384, sizeof(uint8_t));
-	if (!out_block) err(EX_OSERR, "allocate output block buffer");
-	size_t block_len = 0;
-	uint8_t block_rows = 0;
+/**
+ * Begin the raster data for a page.
+ *
+ * @param out Output buffer
+ * @param encoder Encoder for the page
+ * @return Whether the output is whole
+ */
+static bool page_begin(struct output *out, struct encoder *encoder) {
+	// Begin a continuing Set Compression Method command. The method parameter
+	// is set to 1030, which appears to be proprietary and undocumented. The
+	// parameter character is given in lower-case, so more parameters can be
+	// given. Transfer Raster Data parameters will be added for each block
+	// of 128 rows or 16kB, whichever is less. After all the data parameters
+	// for the page have been emitted, a final Set Compression Method
+	// parameter will be added with an upper-case parameter character to
+	// conclude the command.
+	output_puts(out, "\e*b1030m");
 
-	// Initialize the output row buffer. I think twice the input row length is
-	// more than enough.
-	uint8_t *out_row = calloc(2, printable_length);
-	if (!out_row) err(EX_OSERR, "allocate output row buffer");
+	// Output block size is limited to the lesser of 128 rows or 16kB.
+	encoder->block = output_block(out);
+	encoder->block_len = 0;
+	encoder->block_rows = 0;
+	return encoder->block;
+}
 
-	// Compress each input row and put it into the output block buffer. When
-	// the block buffer is full, emit it as a continuing raster data parameter
-	// for the ongoing command.
-	for (size_t row = 0; row < printable_rows; row++) {
-		// In HQ1200A resolution mode, encode odd lines as duplicates of even
-		// lines and skip over the input. I'm guessing it's a sort-of 1200x600
-		// mode that takes 1200x1200 input?
-		if (p_resolution == RES_HQ1200A && row & 1) {
-			out_row[0] = 0;
-			raster_data(out_block, &block_len, &block_rows, out_row, 1);
-			in += row_length;
-			continue;
-		}
+/**
+ * Compress one printable row of a page into the output block buffer.
+ *
+ * @param out Output buffer
+ * @param encoder Encoder for the page
+ * @param page Page (bands are used if set)
+ * @param row Index of the row among the printable rows
+ * @param in First printable byte of the input row
+ * @param last First printable byte of the last input row encoded, other
+ * than as a duplicate (see last_distance(); not used for the first row)
+ * @param blank Set to whether the row was blank
+ * @return Whether the output is whole
+ */
+static bool page_row(struct output *out, struct encoder *encoder,
+		const struct page *page, size_t row, uint8_t *in, uint8_t *last,
+		bool *blank) {
+	// In HQ1200A resolution mode, encode odd lines as duplicates of even
+	// lines and skip over the input. I'm guessing it's a sort-of 1200x600
+	// mode that takes 1200x1200 input? (Given half-height input, each row
+	// is encoded twice instead, below.)
+	*blank = false;
+	if (rows_skipped() && row & 1)
+		return page_duplicate(out, encoder, last);
 
-		// Compress the printable part of the row and append it to the
-		// output block buffer, then advance to the next input row. The
-		// last line is not used for compressing the first row of a block.
-		// I think a new block resets the printer's last-row buffer.
-		uint8_t *last_row = (block_rows < 128 && row) ? in - row_length : 0;
-		size_t out_length = compress(out_row, in, last_row, printable_length);
-		raster_data(out_block, &block_len, &block_rows, out_row, out_length);
-		in += row_length;
+	// Compress the printable part of the row and append it to the
+	// output block buffer. The last line is not used for compressing
+	// the first row of a block. I think a new block resets the printer's
+	// last-row buffer. If blocks are planned, start a new block wherever
+	// the plan says to. If the row was compressed ahead of time the same
+	// way, copy it. Otherwise, compress it now right into the block buffer.
+	bool first = page->starts ? page->starts[row] :
+		encoder->block_rows >= BLOCK_ROWS || !row;
+	if (page->starts && first && encoder->block_rows &&
+			!block_next(out, encoder))
+		return false;
+	uint8_t *last_row = first ? 0 : last;
+	uint8_t *out_row = row_space(out, encoder);
+	if (!out_row) return false;
+	size_t out_length;
+	bool fallback;
+	if (page->bands && (page->starts || last_row || !row)) {
+		struct band *band = &page->bands[row / BAND_ROWS];
+		bool alone = page->starts && first;
+		const size_t *offsets = alone ? band->first_offsets : band->offsets;
+		size_t offset = offsets[row % BAND_ROWS];
+		out_length = offsets[row % BAND_ROWS + 1] - offset;
+		memcpy(out_row, (alone ? band->first_data : band->data) + offset,
+			out_length);
 
-		// In 600x300 resolution mode, encode a duplicate line after each
-		// input line. I guess I'm not sure if this is purely a "software"
-		// mode to save communication time or if the printer can do some
-		// optimization too.
-		if (p_resolution == RES_600x300) {
-			out_row[0] = 0;
-			raster_data(out_block, &block_len, &block_rows, out_row, 1);
-		}
+		// Only a row with all the groups a row can have may have run out of
+		// them. For statistics, such a row is compressed again (to the same
+		// bytes) to find out.
+		fallback = false;
+		if (p_stats >= 0 && *out_row == 254)
+			compress(out_row, in, last_row, encoder->printable_length,
+				&fallback);
+	} else
+		out_length = compress(out_row, in, last_row,
+			encoder->printable_length, &fallback);
+
+	// If the row doesn't fit in the block, it will begin the next block,
+	// where it can't be compressed against the last row. Compress it again
+	// on its own.
+	if (!first && out_length + encoder->block_len > BLOCK_BYTES) {
+		if (!block_next(out, encoder)) return false;
+		out_row = encoder->block;
+		out_length = compress(out_row, in, 0, encoder->printable_length,
+			&fallback);
+	}
+	*blank = out_length == 1 && *out_row == 255;
+	if (!raster_data(out, encoder, out_length, fallback)) return false;
+
+	// In 600x300 resolution mode, encode a duplicate line after each
+	// input line. I guess I'm not sure if this is purely a "software"
+	// mode to save communication time or if the printer can do some
+	// optimization too. Input at half height in the 1200 DPI modes is
+	// encoded the same way.
+	return !rows_doubled() || page_duplicate(out, encoder, in);
+}
+
+/**
+ * Encode a duplicate of the last row into the output block buffer.
+ *
+ * A duplicate is a single byte (0, the same as the last row), unless it
+ * begins a block, in which case the row is compressed again on its own.
+ *
+ * @param out Output buffer
+ * @param encoder Encoder for the page
+ * @param in First printable byte of the input row to duplicate
+ * @return Whether the output is whole
+ */
+static bool page_duplicate(struct output *out, struct encoder *encoder,
+		uint8_t *in) {
+	uint8_t *space = row_space(out, encoder);
+	if (!space) return false;
+	if (encoder->block_rows && encoder->block_len < BLOCK_BYTES) {
+		*space = 0;
+		return raster_data(out, encoder, 1, false);
+	}
+	if (encoder->block_rows) {
+		if (!block_next(out, encoder)) return false;
+		space = encoder->block;
+	}
+	bool fallback;
+	size_t length = compress(space, in, 0, encoder->printable_length,
+		&fallback);
+	return raster_data(out, encoder, length, fallback);
+}
+
+/**
+ * Count the blank printable rows of a page starting from a row.
+ *
+ * In HQ1200A mode (for full-height input), only the even rows are looked at,
+ * since the odd rows are encoded as duplicates whatever they hold.
+ *
+ * @param page Page
+ * @param row Index of the first row to look at among the printable rows
+ * @return Number of blank rows
+ */
+static size_t blank_rows(const struct page *page, size_t row) {
+	size_t count = 0;
+	for (; row + count < page->printable_rows; count++) {
+		size_t r = row + count;
+		if (rows_skipped() && r & 1) continue;
+		if (!scan_blank(page->in + r * page->row_length,
+				page->printable_length))
+			break;
 	}
+	return count;
+}
 
-	// All rows have been compressed, no need for this buffer anymore.
-	free(out_row);
+/**
+ * Check whether each input row is encoded twice, the second time as a
+ * duplicate: in 600x300 mode, and for half-height input in the 1200 DPI
+ * modes.
+ *
+ * @return True if rows are doubled
+ */
+static bool rows_doubled() {
+	return p_resolution == RES_600x300 || p_scale_y == SCALE_UP;
+}
 
-	// If there are any rows in the output block buffer, emit one more
-	// continuing raster data parameter.
-	if (block_len) {
-		fprintf(stdout, "%zuw%c%c", block_len + 2, 0, block_rows);
-		fwrite(out_block, 1, block_len, stdout);
+/**
+ * Check whether odd input rows are skipped, and encoded as duplicates of
+ * the even rows: in HQ1200A mode, for full-height input.
+ *
+ * @return True if odd rows are skipped
+ */
+static bool rows_skipped() {
+	return p_resolution == RES_HQ1200A && p_scale_y != SCALE_UP;
+}
+
+/**
+ * Count how many input rows back the last row the printer was given is,
+ * for compressing a row against it. When odd rows are skipped, an even row
+ * follows a duplicate of the even row before it, not the odd row between.
+ *
+ * @param row Index of the row among the printable rows
+ * @return Number of rows back
+ */
+static size_t last_distance(size_t row) {
+	return rows_skipped() && !(row & 1) ? 2 : 1;
+}
+
+/**
+ * Put a run of blank printable rows into the output block buffer.
+ *
+ * A blank row is encoded as a single byte (255), so as many rows are put
+ * into each block at once as will fit. The blocks are the same as
+ * page_row() would give. The duplicate rows in HQ1200A and 600x300 modes
+ * are encoded as usual (as blank rows where they begin a block).
+ *
+ * @param out Output buffer
+ * @param encoder Encoder for the page
+ * @param row Index of the first blank row among the printable rows
+ * @param count Number of blank rows
+ * @return Whether the output is whole
+ */
+static bool page_blank(struct output *out, struct encoder *encoder,
+		size_t row, size_t count) {
+	// Index of the first encoded row, counting duplicates. Duplicates are
+	// the odd ones.
+	size_t first = rows_skipped() ? row : 0;
+	if (rows_doubled()) count *= 2;
+
+	for (size_t done = 0; done < count;) {
+		uint8_t *space = row_space(out, encoder);
+		if (!space) return false;
+		if (encoder->block_len >= BLOCK_BYTES) {
+			if (!block_next(out, encoder)) return false;
+			space = encoder->block;
+		}
+		size_t length = count - done;
+		if (length > (size_t)(BLOCK_ROWS - encoder->block_rows))
+			length = BLOCK_ROWS - encoder->block_rows;
+		if (length > BLOCK_BYTES - encoder->block_len)
+			length = BLOCK_BYTES - encoder->block_len;
+		if (rows_skipped() || rows_doubled())
+			for (size_t i = 0; i < length; i++)
+				space[i] = (first + done + i) & 1 &&
+					(i || encoder->block_rows) ? 0 : 255;
+		else
+			memset(space, 255, length);
+		if (p_stats >= 0)
+			for (size_t i = 0; i < length; i++)
+				stats_row(&out->stats, space[i], false);
+		encoder->block_len += length;
+		encoder->block_rows += length;
+		done += length;
 	}
+	return true;
+}
 
-	// All rows have been emitted, no need for this buffer anymore.
-	free(out_block);
+/**
+ * Conclude the raster data for a page.
+ *
+ * @param out Output buffer
+ * @param encoder Encoder for the page
+ * @return Whether the output is whole
+ */
+static bool page_end(struct output *out, struct encoder *encoder) {
+	// If there are any rows in the output block buffer, emit one more
+	// continuing raster data parameter.
+	if (encoder->block_len &&
+			!output_block_end(out, encoder->block_len, encoder->block_rows))
+		return false;
 
 	// Conclude the ongoing command with a (redundant?) Set Compression
 	// Method parameter (upper-case to end the command).
-	fputs("1030M\f", stdout);
+	return output_puts(out, "1030M\f");
+}
+
+/**
+ * Compress all the rows of a page in bands using worker threads.
+ *
+ * The worker threads and band buffers are set up the first time they're
+ * needed and kept for later pages (and later jobs, unless they ask for a
+ * different number of threads).
+ *
+ * @param page Page to compress (bands are set on return)
+ * @return Whether the page was compressed (false if errors are caught)
+ */
+bool compress_bands(struct page *page) {
+	if (workers && worker_threads != p_threads) {
+		workers_destroy(workers);
+		workers = NULL;
+	}
+	if (!workers) {
+		workers = workers_create(p_threads - 1);
+		if (!workers) return false;
+		worker_threads = p_threads;
+	}
+
+	size_t count = (page->printable_rows + BAND_ROWS - 1) / BAND_ROWS;
+	if (count > band_count) {
+		struct band *more = realloc(bands, count * sizeof(*bands));
+		if (!more) return fail_errno(EX_OSERR, "allocate band buffers");
+		memset(more + band_count, 0, (count - band_count) * sizeof(*bands));
+		bands = more;
+		band_count = count;
+	}
+
+	// Worker threads take the parameters of the thread giving them work.
+	struct params params;
+	param_get(&params);
+	page->params = &params;
+	page->bands = bands;
+	workers_run(workers, compress_band, page, count);
+
+	// Workers can't fail, so they leave it to this thread.
+	for (size_t i = 0; i < count; i++)
+		if (bands[i].failed) {
+			errno = ENOMEM;
+			return fail_errno(EX_OSERR, "allocate band buffer");
+		}
+	return true;
+}
+
+/**
+ * Compress one band of rows of a page.
+ *
+ * Each row is compressed against the input row before it (except the first
+ * row of the page). If blocks are planned, each row is also compressed on
+ * its own, as the first row of a block. Odd rows are skipped in HQ1200A
+ * mode since they aren't compressed anyway. If the cache is enabled, rows
+ * compressed against the row before are looked up there first, by the rows
+ * of the band and the row before it. Runs on worker threads, so rather
+ * than failing, a band whose buffers can't be grown is marked failed.
+ *
+ * @param arg Page being compressed
+ * @param index Index of the band to compress
+ */
+void compress_band(void *arg, size_t index) {
+	struct page *page = arg;
+	param_set(page->params);
+	uint64_t start = trace_now();
+	struct band *band = &page->bands[index];
+	size_t first = index * BAND_ROWS;
+	size_t rows = page->printable_rows - first;
+	if (rows > BAND_ROWS) rows = BAND_ROWS;
+
+	// Make sure there's room for the worst case before each row (twice the
+	// input row length, same as the output row buffer). Compressed rows are
+	// usually much smaller, so the buffer rarely needs to grow.
+	size_t worst = 2 * page->printable_length;
+	struct cache_key key = {
+		.rows = page->in + (first ? first - last_distance(first) : 0) *
+			page->row_length,
+		.stride = page->row_length,
+		.length = page->printable_length,
+		.count = first ? rows + last_distance(first) : rows,
+		.salt = p_padding | (uint64_t)p_resolution << 32 |
+			(uint64_t)p_compression << 40 | (uint64_t)!first << 48 |
+			(uint64_t)rows_doubled() << 49
+	};
+	bool use_cache = caching();
+	bool cached = use_cache && cache_get(&key, band->offsets, rows + 1,
+		&band->data, &band->capacity);
+	band->failed = false;
+	band->offsets[0] = 0;
+	band->first_offsets[0] = 0;
+	for (size_t i = 0; i < rows; i++) {
+		size_t row = first + i;
+		size_t used = band->offsets[i];
+		size_t first_used = band->first_offsets[i];
+		if (rows_skipped() && row & 1) {
+			if (!cached) band->offsets[i + 1] = used;
+			band->first_offsets[i + 1] = first_used;
+			continue;
+		}
+		uint8_t *in = page->in + row * page->row_length;
+		uint8_t *last_row = row ? in - last_distance(row) * page->row_length :
+			0;
+		if (!cached) {
+			if (!band_room(&band->data, &band->capacity, used, worst)) {
+				band->failed = true;
+				return;
+			}
+			band->offsets[i + 1] = used + compress(band->data + used, in,
+				last_row, page->printable_length, NULL);
+		}
+		if (page->starts) {
+			if (!band_room(&band->first_data, &band->first_capacity,
+					first_used, worst)) {
+				band->failed = true;
+				return;
+			}
+			band->first_offsets[i + 1] = first_used + compress(
+				band->first_data + first_used, in, 0, page->printable_length,
+				NULL);
+		}
+	}
+	if (use_cache && !cached)
+		cache_put(&key, band->offsets, rows + 1, band->data);
+	trace_event(cached ? "compress_band (cached)" : "compress_band", start);
+}
+
+/**
+ * Make sure there's room for a row at the end of a band buffer.
+ *
+ * @param data Band buffer (may be reallocated)
+ * @param capacity Size of the band buffer (updated if reallocated)
+ * @param used Number of bytes in use
+ * @param worst Largest number of bytes a row may need
+ * @return True if there's room (false if the buffer couldn't be grown)
+ */
+static bool band_room(uint8_t **data, size_t *capacity, size_t used,
+		size_t worst) {
+	if (*capacity - used >= worst) return true;
+	size_t more = *capacity ? *capacity : worst;
+	while (more - used < worst) more *= 2;
+	uint8_t *grown = realloc(*data, more);
+	if (!grown) return false;
+	*data = grown;
+	*capacity = more;
+	return true;
+}
+
+/**
+ * Check whether the job on this thread uses the cache. The cache is shared
+ * by all the jobs of a process, but only jobs which give it a size use it.
+ *
+ * @return True if the cache is used
+ */
+static bool caching() {
+	return p_cache && cache_enabled();
+}
+
+/**
+ * Make sure the worker threads and buffers of this thread are freed when
+ * it exits. Called before any are set up.
+ */
+static void keep_state() {
+	pthread_once(&key_once, make_key);
+	if (key_made && !pthread_getspecific(key))
+		pthread_setspecific(key, &stream);
+}
+
+static void make_key() {
+	key_made = !pthread_key_create(&key, free_state);
+}
+
+/**
+ * Stop the worker threads and free the buffers of a thread as it exits.
+ * Thread-local variables are still there when thread-specific data is
+ * destroyed.
+ *
+ * @param unused Value of the key
+ */
+static void free_state(void *unused) {
+	(void)unused;
+	if (workers) workers_destroy(workers);
+	workers = NULL;
+	for (size_t i = 0; i < band_count; i++) {
+		free(bands[i].data);
+		free(bands[i].first_data);
+	}
+	free(bands);
+	bands = NULL;
+	band_count = 0;
+	free(plan.alone);
+	plan = (struct plan){0};
+	free(stream.kept);
+	stream.kept = NULL;
+	stream.kept_capacity = 0;
+}
+
+/**
+ * Decide which rows of a page start a block.
+ *
+ * Any row can start a block (except the duplicate odd rows in HQ1200A
+ * mode), as long as no block has more than 128 rows or 16kB. A row which
+ * starts a block costs its size compressed on its own, and every other row
+ * its size compressed against the row before it. Each block also costs its
+ * header. The cheapest placement is found by dynamic programming over the
+ * rows of the page, using the sizes from compress_bands().
+ *
+ * @param page Page (bands must be compressed; starts are set on return)
+ */
+static void plan_blocks(struct page *page) {
+	// Sizes of the rows compressed each way. A row which can't start a
+	// block is given a size too big to fit in one.
+	for (size_t row = 0; row < page->printable_rows; row++) {
+		plan.with[row] = plan_row(page, row, false);
+		plan.alone[row] = rows_skipped() && row & 1 ?
+			SIZE_MAX / 2 : plan_row(page, row, true);
+	}
+
+	size_t rows_each = rows_doubled() ? 2 : 1;
+	plan.cost[0] = 0;
+	for (size_t end = 1; end <= page->printable_rows; end++) {
+		// Try each block ending with this row, longest last. The rest is the
+		// size of the rows after the block's first row.
+		plan.cost[end] = SIZE_MAX;
+		size_t rest = 0;
+		for (size_t start = end; start-- &&
+				(end - start) * rows_each <= BLOCK_ROWS;) {
+			size_t length = plan.alone[start] + rest;
+			if (length <= BLOCK_BYTES) {
+				// Header: the length plus two in decimal, w, 0, row count.
+				size_t header = 4 + (length + 2 >= 10) +
+					(length + 2 >= 100) + (length + 2 >= 1000) +
+					(length + 2 >= 10000);
+				size_t cost = plan.cost[start] + header + length;
+				if (cost < plan.cost[end]) {
+					plan.cost[end] = cost;
+					plan.from[end] = start;
+				}
+			}
+			rest += plan.with[start];
+			if (rest > BLOCK_BYTES) break;
+		}
+	}
+
+	memset(page->starts, 0, page->printable_rows * sizeof(*page->starts));
+	for (size_t end = page->printable_rows; end; end = plan.from[end])
+		page->starts[plan.from[end]] = true;
+}
+
+/**
+ * Get the compressed size of a printable row of a page, including the
+ * duplicate row which follows it in 600x300 mode (or for half-height
+ * input).
+ *
+ * @param page Page (bands must be compressed)
+ * @param row Index of the row among the printable rows
+ * @param first Whether the row is the first row of a block
+ * @return Size in bytes
+ */
+static size_t plan_row(const struct page *page, size_t row, bool first) {
+	if (rows_skipped() && row & 1)
+		return 1;
+	const struct band *band = &page->bands[row / BAND_ROWS];
+	const size_t *offsets = first ? band->first_offsets : band->offsets;
+	size_t length = offsets[row % BAND_ROWS + 1] - offsets[row % BAND_ROWS];
+	return rows_doubled() ? length + 1 : length;
+}
+
+/**
+ * Emit the block being built and begin the next one.
+ *
+ * @param out Output
+ * @param encoder Encoder for the page
+ * @return Whether the output is whole
+ */
+static bool block_next(struct output *out, struct encoder *encoder) {
+	if (!output_block_end(out, encoder->block_len, encoder->block_rows))
+		return false;
+	encoder->block = output_block(out);
+	encoder->block_len = 0;
+	encoder->block_rows = 0;
+	return encoder->block;
+}
+
+/**
+ * Get room for the next row at the end of the block buffer.
+ *
+ * If the block buffer is already full by rows, it is emitted first. There
+ * is always room for a compressed row (twice the input row length) past the
+ * end of the block, even if it won't end up fitting in the block.
+ *
+ * @param out Output
+ * @param encoder Encoder for the page
+ * @return Where to put the next row, or NULL if the output isn't whole
+ */
+static uint8_t *row_space(struct output *out, struct encoder *encoder) {
+	if (encoder->block_rows >= BLOCK_ROWS && !block_next(out, encoder))
+		return NULL;
+	return encoder->block + encoder->block_len;
 }
 
 /**
  * Buffer (and possibly emit) raster data.
  *
- * If the given block buffer is already full (by bytes or by rows), it is
- * emitted and the buffer is reset. Then the given row of raster data is
- * appended to the buffer.
+ * The row has already been put at the end of the block buffer (see
+ * row_space()). If the block is too full by bytes to hold it, the block is
+ * emitted without the row and the row is moved to the beginning of the
+ * next block buffer. Then the row is added to the block.
  *
  * It is assumed that the data emitted by this function will be part of a
  * parameterized command with the same parameterized character and group
@@ -235,24 +1096,25 @@ void pcl_page(uint8_t *in, size_t row_length, size_t row_count) {
  * added to the command. The command must eventually be concluded with
  * an upper-case parameter.
  *
- * @param buffer Block buffer
- * @param buffer_length Number of bytes in the block buffer
- * @param buffer_rows Number of rows in the block buffer
- * @param row Row data to be appended
+ * @param out Output
+ * @param encoder Encoder for the page
  * @param row_length Number of bytes in the row
+ * @param fallback True if the row ran out of groups (see compress())
+ * @return Whether the output is whole
  */
-void raster_data(uint8_t *buffer, size_t *buffer_length, uint8_t *buffer_rows,
-		const uint8_t *row, size_t row_length) {
-	// Flush the buffer if it's full by bytes or rows
-	if(row_length + *buffer_length > 16384 || *buffer_rows >= 128)
-	{
-		printf("%zuw%c%c", *buffer_length + 2, 0, *buffer_rows);
-		fwrite(buffer, sizeof(*buffer), *buffer_length, stdout);
-		*buffer_length = 0;
-		*buffer_rows = 0;
+bool raster_data(struct output *out, struct encoder *encoder,
+		size_t row_length, bool fallback) {
+	// Flush the buffer if it's full by bytes
+	if (row_length + encoder->block_len > BLOCK_BYTES) {
+		uint8_t *row = encoder->block + encoder->block_len;
+		if (!block_next(out, encoder)) return false;
+		memcpy(encoder->block, row, row_length);
 	}
-	// Append row to buffer
-	memcpy(buffer + *buffer_length, row, row_length);
-	*buffer_length += row_length;
-	++*buffer_rows;
+	// Add row to block
+	if (p_stats >= 0)
+		stats_row(&out->stats, encoder->block[encoder->block_len],
+			fallback);
+	encoder->block_len += row_length;
+	++encoder->block_rows;
+	return true;
 }
@@ -1,5 +1,17 @@
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-void pcl_begin();
-void pcl_page(uint8_t *in, size_t row_length, size_t row_count);
+struct output;
+
+bool pcl_begin(struct output *out);
+bool pcl_page(struct output *out, uint8_t *in, size_t row_length,
+	size_t row_count);
+void pcl_stream_begin(size_t row_length, size_t row_count);
+bool pcl_stream_row(struct output *out, uint8_t *in, uint8_t *last);
+void pcl_stream_end(struct output *out);
+void pcl_layout(size_t row_length, size_t row_count, size_t *margin_rows,
+	size_t *margin_bytes, size_t *printable_length, size_t *printable_rows);
+void pcl_min_size(size_t *row_length, size_t *row_count);
+void pcl_raster(struct output *out, const uint8_t *rows,
+	const size_t *lengths, size_t count);
@@ -0,0 +1,169 @@
+/**
+ * Read, compress, and write pages at the same time.
+ *
+ * A reader thread reads pages from the input, the calling thread
+ * compresses them, and a writer thread writes the compressed pages out,
+ * each through the job (see job.h). The stages pass pages along in order
+ * through queues. A
+ * small, fixed number of page buffers circulate among the stages, so the
+ * reader can't get too far ahead of the writer.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "input.h"
+#include "job.h"
+#include "ohbrother.h"
+#include "output.h"
+#include "parameters.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "queue.h"
+#include "trace.h"
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/**
+ * A page and the output for the page.
+ */
+struct slot {
+	uint8_t *buffer; // Page buffer (unless the input is mapped)
+	uint8_t *page; // Page data (in the page buffer or the mapped input)
+	struct output out;
+};
+
+/**
+ * Everything the stages share.
+ */
+struct pipeline {
+	struct ohb_job *job;
+	size_t row_length;
+	size_t row_count;
+	struct params params; // Parameters of the job, taken by each stage
+	// Queues of slots between stages. A null slot marks the end of input.
+	struct queue empty; // Slots ready to be read into
+	struct queue read; // Slots read and ready to be compressed
+	struct queue compressed; // Slots compressed and ready to be written
+};
+
+static void *reader(void *arg);
+static void *writer(void *arg);
+static pthread_t start(void *(*stage)(void *), struct pipeline *pipeline);
+
+// Slots are kept from run to run (for later jobs), along with their output
+// buffers. Their page buffers are taken from the pool for each run.
+static struct slot *slots;
+static unsigned int slot_count;
+
+/**
+ * Read, compress, and emit pages until the input data is consumed.
+ *
+ * Partial pages of data are not processed.
+ *
+ * @param job Job the pages are encoded and written for
+ * @param depth Number of pages which may be in the pipeline at once
+ */
+void pipeline_run(struct ohb_job *job, unsigned int depth) {
+	size_t row_length, row_count;
+	ohb_job_size(job, &row_length, &row_count);
+	struct pipeline pipeline = {
+		.job = job,
+		.row_length = row_length,
+		.row_count = row_count
+	};
+	param_get(&pipeline.params);
+
+	// Each queue has room for every slot plus the end marker, so pushing
+	// never has to wait.
+	queue_init(&pipeline.empty, depth + 1);
+	queue_init(&pipeline.read, depth + 1);
+	queue_init(&pipeline.compressed, depth + 1);
+
+	if (depth > slot_count) {
+		struct slot *more = realloc(slots, depth * sizeof(*slots));
+		if (!more) err(EX_OSERR, "allocate page slots");
+		memset(more + slot_count, 0, (depth - slot_count) * sizeof(*slots));
+		slots = more;
+		slot_count = depth;
+	}
+	for (unsigned int i = 0; i < depth; i++) {
+		slots[i].buffer = input_mapped() ? NULL :
+			pool_get(row_count * row_length);
+		queue_push(&pipeline.empty, &slots[i]);
+	}
+
+	pthread_t reader_thread = start(reader, &pipeline);
+	pthread_t writer_thread = start(writer, &pipeline);
+
+	// Compress pages as they're read and pass them along to be written.
+	struct slot *slot;
+	while ((slot = queue_pop(&pipeline.read))) {
+		job_encode(job, &slot->out, slot->page);
+		queue_push(&pipeline.compressed, slot);
+	}
+	queue_push(&pipeline.compressed, NULL);
+
+	pthread_join(reader_thread, NULL);
+	pthread_join(writer_thread, NULL);
+	for (unsigned int i = 0; i < depth; i++)
+		pool_put(slots[i].buffer, row_count * row_length);
+
+	queue_destroy(&pipeline.compressed);
+	queue_destroy(&pipeline.read);
+	queue_destroy(&pipeline.empty);
+}
+
+/**
+ * Read pages from the input into empty slots.
+ *
+ * @param arg Pipeline
+ * @return Nothing
+ */
+static void *reader(void *arg) {
+	struct pipeline *pipeline = arg;
+	struct slot *slot;
+	param_set(&pipeline->params);
+	trace_thread("reader");
+	while ((slot = queue_pop(&pipeline->empty))) {
+		if (!(slot->page = input_page(slot->buffer)))
+			break;
+		queue_push(&pipeline->read, slot);
+	}
+	queue_push(&pipeline->read, NULL);
+	return NULL;
+}
+
+/**
+ * Write compressed pages out and recycle their slots.
+ *
+ * @param arg Pipeline
+ * @return Nothing
+ */
+static void *writer(void *arg) {
+	struct pipeline *pipeline = arg;
+	struct slot *slot;
+	param_set(&pipeline->params);
+	trace_thread("writer");
+	while ((slot = queue_pop(&pipeline->compressed))) {
+		job_write(pipeline->job, &slot->out);
+		queue_push(&pipeline->empty, slot);
+	}
+	return NULL;
+}
+
+static pthread_t start(void *(*stage)(void *), struct pipeline *pipeline) {
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, stage, pipeline);
+	if (error) {
+		errno = error;
+		err(EX_OSERR, "start pipeline thread");
+	}
+	return thread;
+}
@@ -0,0 +1,3 @@
+struct ohb_job;
+
+void pipeline_run(struct ohb_job *job, unsigned int depth);
@@ -4,23 +4,26 @@
  * @copyright 2022 Parks Digital LLC
  */
 
+#include "output.h"
 #include "parameters.h"
 #include "pjl.h"
-#include <stdio.h>
 
 /**
  * Emit PJL that is required at the beginning of a job.
+ *
+ * @param out Output buffer
+ * @return Whether the output is whole
  */
-void pjl_begin() {
+bool pjl_begin(struct output *out) {
 	// Emit Universal Exit Language command and enter PJL mode.
-	fputs("\e%-12345X", stdout);
-	puts("@PJL");
+	output_puts(out, "\e%-12345X");
+	output_puts(out, "@PJL\n");
 
 	// The JOB/EOJ commands can be suppressed. I imagine certain models don't
 	// support JOB/EOJ commands? I don't know if the hard-coded name means
 	// something to the printer or if it's just a place-holder.
 	if (!p_suppress_job)
-		puts("@PJL JOB NAME=\"Brother HL-XXX\"");
+		output_puts(out, "@PJL JOB NAME=\"Brother HL-XXX\"\n");
 
 	// Set Current Environment variables which depend on the selected
 	// resolution. Some settings can be suppressed. I suppose different
@@ -28,129 +31,129 @@ void pjl_begin() {
 	switch (p_resolution)	{
 		case RES_300:
 			if (!p_suppress_ras1200mode_off)
-				puts("@PJL SET RAS1200MODE = OFF");
-			puts("@PJL SET RESOLUTION = 300");
+				output_puts(out, "@PJL SET RAS1200MODE = OFF\n");
+			output_puts(out, "@PJL SET RESOLUTION = 300\n");
 			break;
 		case RES_1200:
-			puts("@PJL SET RESOLUTION = 1200");
-			puts("@PJL SET PAPERFEEDSPEED=HALF");
+			output_puts(out, "@PJL SET RESOLUTION = 1200\n");
+			output_puts(out, "@PJL SET PAPERFEEDSPEED=HALF\n");
 			break;
 		case RES_HQ1200A:
-			puts("@PJL SET RESOLUTION = 600");
-			puts("@PJL SET RAS1200MODE = TRUE");
+			output_puts(out, "@PJL SET RESOLUTION = 600\n");
+			output_puts(out, "@PJL SET RAS1200MODE = TRUE\n");
 			break;
 		case RES_HQ1200B:
-			puts("@PJL SET RESOLUTION = 1200");
-			puts("@PJL SET PAPERFEEDSPEED=FULL");
+			output_puts(out, "@PJL SET RESOLUTION = 1200\n");
+			output_puts(out, "@PJL SET PAPERFEEDSPEED=FULL\n");
 			break;
 		case RES_600x300:
-			puts("@PJL SET RESOLUTION = 600");
+			output_puts(out, "@PJL SET RESOLUTION = 600\n");
 			break;
 		case RES_600:
 		default:
 			if (!p_suppress_ras1200mode_off)
-				puts("@PJL SET RAS1200MODE = OFF");
-			puts("@PJL SET RESOLUTION = 600");
+				output_puts(out, "@PJL SET RAS1200MODE = OFF\n");
+			output_puts(out, "@PJL SET RESOLUTION = 600\n");
 			if (p_emit_hqmmode)
-				puts("@PJL SET HQMMODE = ON");
+				output_puts(out, "@PJL SET HQMMODE = ON\n");
 	}
 
 	// Enable or disable toner-saving feature.
-	printf("@PJL SET ECONOMODE = %s\n", p_econo_mode ? "ON" : "OFF");
+	output_printf(out, "@PJL SET ECONOMODE = %s\n", p_econo_mode ? "ON" : "OFF");
 
 	// Set source tray, unless "MANUAL" was given.
 	switch (p_source_tray) {
 		case ST_TRAY1:
-			puts("@PJL SET SOURCETRAY = TRAY1");
+			output_puts(out, "@PJL SET SOURCETRAY = TRAY1\n");
 			break;
 		case ST_TRAY2:
-			puts("@PJL SET SOURCETRAY = TRAY2");
+			output_puts(out, "@PJL SET SOURCETRAY = TRAY2\n");
 			break;
 		case ST_TRAY3:
-			puts("@PJL SET SOURCETRAY = TRAY3");
+			output_puts(out, "@PJL SET SOURCETRAY = TRAY3\n");
 			break;
 		case ST_TRAY4:
-			puts("@PJL SET SOURCETRAY = TRAY4");
+			output_puts(out, "@PJL SET SOURCETRAY = TRAY4\n");
 			break;
 		case ST_TRAY5:
-			puts("@PJL SET SOURCETRAY = TRAY5");
+			output_puts(out, "@PJL SET SOURCETRAY = TRAY5\n");
 			break;
 		case ST_MANUAL:
 			break;
 		case ST_MPTRAY:
-			puts("@PJL SET SOURCETRAY = MPTRAY");
+			output_puts(out, "@PJL SET SOURCETRAY = MPTRAY\n");
 			break;
 		case ST_AUTO:
 		default:
-			puts("@PJL SET SOURCETRAY = AUTO");
+			output_puts(out, "@PJL SET SOURCETRAY = AUTO\n");
 	}
 
 	// Set media type.
 	switch (p_media_type)	{
 		case MT_THIN:
-			puts("@PJL SET MEDIATYPE = THIN");
+			output_puts(out, "@PJL SET MEDIATYPE = THIN\n");
 			break;
 		case MT_THICK:
-			puts("@PJL SET MEDIATYPE = THICK");
+			output_puts(out, "@PJL SET MEDIATYPE = THICK\n");
 			break;
 		case MT_THICK2:
-			puts("@PJL SET MEDIATYPE = THICK2");
+			output_puts(out, "@PJL SET MEDIATYPE = THICK2\n");
 			break;
 		case MT_TRANSPARENCY:
-			puts("@PJL SET MEDIATYPE = TRANSPARENCY");
+			output_puts(out, "@PJL SET MEDIATYPE = TRANSPARENCY\n");
 			break;
 		case MT_ENVELOPES:
-			puts("@PJL SET MEDIATYPE = ENVELOPES");
+			output_puts(out, "@PJL SET MEDIATYPE = ENVELOPES\n");
 			break;
 		case MT_ENVTHICK:
-			puts("@PJL SET MEDIATYPE = ENVTHICK");
+			output_puts(out, "@PJL SET MEDIATYPE = ENVTHICK\n");
 			break;
 		case MT_RECYCLED:
-			puts("@PJL SET MEDIATYPE = RECYCLED");
+			output_puts(out, "@PJL SET MEDIATYPE = RECYCLED\n");
 			break;
 		case MT_REGULAR:
 		default:
-			puts("@PJL SET MEDIATYPE = REGULAR");
+			output_puts(out, "@PJL SET MEDIATYPE = REGULAR\n");
 	}
 
 	// Configure sleep settings. Also sets the defaults, so it sticks. I'm
 	// not sure how you'd turn off auto-sleep. Maybe it's not possible.
 	if (p_time_out_sleep) {
-		puts("@PJL DEFAULT AUTOSLEEP = ON");
-		printf("@PJL DEFAULT TIMEOUTSLEEP = %u\n", p_time_out_sleep);
-		puts("@PJL SET AUTOSLEEP = ON");
-		printf("@PJL SET TIMEOUTSLEEP = %u\n", p_time_out_sleep);
+		output_puts(out, "@PJL DEFAULT AUTOSLEEP = ON\n");
+		output_printf(out, "@PJL DEFAULT TIMEOUTSLEEP = %u\n", p_time_out_sleep);
+		output_puts(out, "@PJL SET AUTOSLEEP = ON\n");
+		output_printf(out, "@PJL SET TIMEOUTSLEEP = %u\n", p_time_out_sleep);
 	}
 
 	// I guess the orientation is always portrait.
-	puts("@PJL SET ORIENTATION = PORTRAIT");
+	output_puts(out, "@PJL SET ORIENTATION = PORTRAIT\n");
 
 	// Set paper size name, if appropriate (some paper sizes are set up with
 	// a PCL command instead).
 	switch (p_paper) {
 		case P_EXECUTIVE:
-			puts("@PJL SET PAPER = EXECUTIVE");
+			output_puts(out, "@PJL SET PAPER = EXECUTIVE\n");
 			break;
 		case P_JISB5:
-			puts("@PJL SET PAPER = JISB5");
+			output_puts(out, "@PJL SET PAPER = JISB5\n");
 			break;
 		case P_B5:
-			puts("@PJL SET PAPER = B5");
+			output_puts(out, "@PJL SET PAPER = B5\n");
 			break;
 		case P_B6:
-			puts("@PJL SET PAPER = B6");
+			output_puts(out, "@PJL SET PAPER = B6\n");
 			break;
 		case P_C5:
-			puts("@PJL SET PAPER = C5");
+			output_puts(out, "@PJL SET PAPER = C5\n");
 			break;
 		case P_DL:
-			puts("@PJL SET PAPER = DL");
+			output_puts(out, "@PJL SET PAPER = DL\n");
 			break;
 		case P_COM10:
-			puts("@PJL SET PAPER = COM10");
+			output_puts(out, "@PJL SET PAPER = COM10\n");
 			break;
 		case P_MONARCH:
-			puts("@PJL SET PAPER = MONARCH");
+			output_puts(out, "@PJL SET PAPER = MONARCH\n");
 			break;
 		case P_LEGAL:
 		case P_LETTER:
@@ -164,26 +167,29 @@ void pjl_begin() {
 	// I think usually this is supposed to reserve a block of memory for the
 	// page. I'm not sure exactly what effect it has on these printers or
 	// if other values are valid.
-	puts("@PJL SET PAGEPROTECT = AUTO");
+	output_puts(out, "@PJL SET PAGEPROTECT = AUTO\n");
 
 	// Enter PCL mode.
-	puts("@PJL ENTER LANGUAGE = PCL");
+	return output_puts(out, "@PJL ENTER LANGUAGE = PCL\n");
 }
 
 /**
  * Emit PJL that is required at the end of a job.
+ *
+ * @param out Output buffer
+ * @return Whether the output is whole
  */
-void pjl_end() {
+bool pjl_end(struct output *out) {
 	// Unless suppressed, emit Universal Exit Language command to exit from
 	// PCL to PJL, then emit a PJL EOJ command to match the JOB command
 	// which was emitted at the beginning of the job (they go in pairs).
 	if(!p_suppress_job) {
-		fputs("\e%-12345X", stdout);
-		fputs("@PJL EOJ NAME=\"Brother HL-XXX\"\n", stdout);
+		output_puts(out, "\e%-12345X");
+		output_puts(out, "@PJL EOJ NAME=\"Brother HL-XXX\"\n");
 	}
 	// The last thing emitted is a Universal Exit Language command. I think
 	// this is just to be sure the printer is in a known state after the
 	// job is finished.
-	fputs("\e%-12345X", stdout);
+	return output_puts(out, "\e%-12345X");
 }
 
@@ -1,2 +1,6 @@
-void pjl_begin();
-void pjl_end();
+#include <stdbool.h>
+
+struct output;
+
+bool pjl_begin(struct output *out);
+bool pjl_end(struct output *out);
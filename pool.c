@@ -0,0 +1,182 @@
+/**
+ * Keep page buffers for reuse, from page to page and job to job.
+ *
+ * A page buffer runs to megabytes at the higher resolutions, and each
+ * memory page of a freshly allocated buffer is faulted in as it's first
+ * touched. Buffers given back to the pool stay mapped and are handed out
+ * again, so a process takes those faults once rather than once per job.
+ * Buffers of 2 MB or more are aligned to 2 MB, and the system is asked to
+ * back them with transparent huge pages where it can, which cuts the first
+ * faults (and TLB misses) by as much as 512 times. The pool is shared by
+ * all the threads of a process.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "pool.h"
+#include "fail.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+// Size (and alignment) of a transparent huge page.
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/**
+ * A buffer in the pool, not in use.
+ */
+struct buffer {
+	void *data;
+	size_t size; // Bytes mapped
+};
+
+static void *map(size_t size);
+static void unmap(size_t index);
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer *buffers; // Buffers not in use
+static size_t buffer_count;
+static size_t buffer_capacity;
+static size_t mapped; // Bytes mapped for all buffers, in use or not
+
+/**
+ * Take a buffer from the pool, or map a new one if none is big enough.
+ *
+ * A new buffer is zeroed. A buffer used before holds whatever it was last
+ * given.
+ *
+ * @param length Length of the buffer in bytes
+ * @return Buffer, or NULL if none could be mapped (when errors are caught)
+ */
+void *pool_get(size_t length) {
+	size_t size = pool_size(length);
+	pthread_mutex_lock(&mutex);
+
+	// Take the smallest buffer that's big enough.
+	size_t best = buffer_count;
+	for (size_t i = 0; i < buffer_count; i++)
+		if (buffers[i].size >= size &&
+				(best == buffer_count || buffers[i].size < buffers[best].size))
+			best = i;
+	if (best < buffer_count) {
+		void *data = buffers[best].data;
+		buffers[best] = buffers[--buffer_count];
+		pthread_mutex_unlock(&mutex);
+		return data;
+	}
+
+	// Buffers too small for pages this size are let go, since later pages
+	// are most likely the same size.
+	for (size_t i = buffer_count; i-- > 0;)
+		unmap(i);
+	mapped += size;
+	pthread_mutex_unlock(&mutex);
+	void *data = map(size);
+	if (!data) {
+		pthread_mutex_lock(&mutex);
+		mapped -= size;
+		pthread_mutex_unlock(&mutex);
+		fail_errno(EX_OSERR, "allocate page buffer");
+		return NULL;
+	}
+	return data;
+}
+
+/**
+ * Give a buffer back to the pool. If the pool can't be grown to hold it,
+ * the buffer is unmapped instead.
+ *
+ * @param buffer Buffer (from pool_get(), or NULL to do nothing)
+ * @param length Length the buffer was taken for
+ */
+void pool_put(void *buffer, size_t length) {
+	if (!buffer) return;
+	pthread_mutex_lock(&mutex);
+	if (buffer_count == buffer_capacity) {
+		size_t capacity = buffer_capacity ? buffer_capacity * 2 : 8;
+		struct buffer *more = realloc(buffers, capacity * sizeof(*buffers));
+		if (!more) {
+			munmap(buffer, pool_size(length));
+			mapped -= pool_size(length);
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+		buffers = more;
+		buffer_capacity = capacity;
+	}
+	buffers[buffer_count++] = (struct buffer){buffer, pool_size(length)};
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Unmap buffers not in use until no more than a given number of bytes are
+ * mapped for the pool (or none are left to unmap). The largest buffers go
+ * first.
+ *
+ * @param limit Number of bytes
+ */
+void pool_trim(size_t limit) {
+	pthread_mutex_lock(&mutex);
+	while (mapped > limit && buffer_count) {
+		size_t largest = 0;
+		for (size_t i = 1; i < buffer_count; i++)
+			if (buffers[i].size > buffers[largest].size) largest = i;
+		unmap(largest);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Get the memory a buffer takes: a whole number of huge pages for 2 MB or
+ * more, or of memory pages for less.
+ *
+ * @param length Length of the buffer in bytes
+ * @return Size in bytes
+ */
+size_t pool_size(size_t length) {
+	size_t unit = length >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE :
+		(size_t)sysconf(_SC_PAGESIZE);
+	if (!length) length = 1;
+	return (length + unit - 1) / unit * unit;
+}
+
+/**
+ * Map memory for a buffer. A buffer of huge pages is aligned to a huge page,
+ * by mapping a huge page more than needed and unmapping what's left over on
+ * either side.
+ *
+ * @param size Size in bytes (from pool_size())
+ * @return Memory, or NULL if it can't be mapped
+ */
+static void *map(size_t size) {
+	size_t extra = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 0;
+	uint8_t *data = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) return NULL;
+	if (extra) {
+		size_t before = -(uintptr_t)data & (HUGE_PAGE_SIZE - 1);
+		if (before) munmap(data, before);
+		if (extra - before) munmap(data + before + size, extra - before);
+		data += before;
+#ifdef MADV_HUGEPAGE
+		madvise(data, size, MADV_HUGEPAGE);
+#endif
+	}
+	return data;
+}
+
+/**
+ * Unmap a buffer not in use, and take it out of the pool. The mutex must be
+ * held.
+ *
+ * @param index Index of the buffer
+ */
+static void unmap(size_t index) {
+	munmap(buffers[index].data, buffers[index].size);
+	mapped -= buffers[index].size;
+	buffers[index] = buffers[--buffer_count];
+}
@@ -0,0 +1,6 @@
+#include <stddef.h>
+
+void *pool_get(size_t length);
+void pool_put(void *buffer, size_t length);
+void pool_trim(size_t limit);
+size_t pool_size(size_t length);
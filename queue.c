@@ -0,0 +1,84 @@
+/**
+ * Pass items from one thread to another, in order.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "queue.h"
+#include <err.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+/**
+ * Set up an empty queue.
+ *
+ * @param queue Queue
+ * @param capacity Most items the queue holds
+ */
+void queue_init(struct queue *queue, size_t capacity) {
+	queue->items = calloc(capacity, sizeof(*queue->items));
+	if (!queue->items) err(EX_OSERR, "allocate queue");
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->changed, NULL);
+}
+
+/**
+ * Free a queue no thread is using.
+ *
+ * @param queue Queue
+ */
+void queue_destroy(struct queue *queue) {
+	pthread_cond_destroy(&queue->changed);
+	pthread_mutex_destroy(&queue->mutex);
+	free(queue->items);
+}
+
+/**
+ * Add an item to the end of a queue, waiting for room if it's full.
+ *
+ * @param queue Queue
+ * @param item Item (may be NULL)
+ */
+void queue_push(struct queue *queue, void *item) {
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count == queue->capacity)
+		pthread_cond_wait(&queue->changed, &queue->mutex);
+	queue->items[(queue->head + queue->count++) % queue->capacity] = item;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * Take the item at the front of a queue, waiting for one if it's empty.
+ *
+ * @param queue Queue
+ * @return Item
+ */
+void *queue_pop(struct queue *queue) {
+	pthread_mutex_lock(&queue->mutex);
+	while (!queue->count)
+		pthread_cond_wait(&queue->changed, &queue->mutex);
+	void *item = queue->items[queue->head];
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->mutex);
+	return item;
+}
+
+/**
+ * Get the number of items in a queue, which may change right away.
+ *
+ * @param queue Queue
+ * @return Number of items
+ */
+size_t queue_count(struct queue *queue) {
+	pthread_mutex_lock(&queue->mutex);
+	size_t count = queue->count;
+	pthread_mutex_unlock(&queue->mutex);
+	return count;
+}
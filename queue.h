@@ -0,0 +1,21 @@
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * A queue of items between threads, of fixed capacity. Pushing waits while
+ * it's full and popping waits while it's empty.
+ */
+struct queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	void **items;
+	size_t capacity;
+	size_t head;
+	size_t count;
+};
+
+void queue_init(struct queue *queue, size_t capacity);
+void queue_destroy(struct queue *queue);
+void queue_push(struct queue *queue, void *item);
+void *queue_pop(struct queue *queue);
+size_t queue_count(struct queue *queue);
@@ -0,0 +1,121 @@
+/**
+ * Scale raster data between resolutions as it's read.
+ *
+ * Input at 600 DPI can be printed at 300 DPI or 1200 DPI without rendering
+ * it again. Scaling up doubles each dot across, a byte at a time by table.
+ * Rows aren't doubled here: each row is encoded twice instead, the second
+ * time as "same as the last row", which costs a byte. Scaling down sets
+ * each dot if any of the 2x2 dots it covers are set, so thin lines and
+ * small text don't drop out. Pairs of rows are combined, then pairs of dots
+ * by table.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "scale.h"
+#include "parameters.h"
+#include <string.h>
+
+static void up(uint8_t *out, const uint8_t *in, size_t in_length,
+	size_t out_length);
+static void down(uint8_t *out, const uint8_t *in, const uint8_t *next,
+	size_t in_length, size_t out_length);
+static void init();
+
+// Each byte with its dots doubled across.
+static uint16_t doubled[256];
+
+// Each byte with its pairs of dots combined (in the low four bits).
+static uint8_t halved[256];
+
+/**
+ * Scale rows of raster data to the selected resolution.
+ *
+ * @param out Buffer for the scaled rows (each padded to a full byte)
+ * @param in Rows at the input resolution
+ * @param width Width of the input rows in dots
+ * @param rows Number of input rows (when scaling down, an odd row left
+ * over is combined with white)
+ */
+void scale_page(uint8_t *out, const uint8_t *in, size_t width, size_t rows) {
+	if (!doubled[1]) init();
+	size_t in_length = (width + 7) >> 3;
+	size_t out_length = (p_scaled_width + 7) >> 3;
+
+	if (p_scale_y != SCALE_DOWN) {
+		for (size_t row = 0; row < rows; row++) {
+			if (p_scale_x == SCALE_UP)
+				up(out, in, in_length, out_length);
+			else
+				memcpy(out, in, out_length);
+			in += in_length;
+			out += out_length;
+		}
+		return;
+	}
+
+	for (size_t row = 0; row < rows; row += 2) {
+		down(out, in, row + 1 < rows ? in + in_length : NULL, in_length,
+			out_length);
+		in += 2 * in_length;
+		out += out_length;
+	}
+}
+
+/**
+ * Double the dots of a row across.
+ *
+ * @param out Scaled row
+ * @param in Input row
+ * @param in_length Length of the input row in bytes
+ * @param out_length Length of the scaled row in bytes (the last byte of
+ * the input may only fill half a byte)
+ */
+static void up(uint8_t *out, const uint8_t *in, size_t in_length,
+		size_t out_length) {
+	size_t i = 0;
+	for (; 2 * i + 1 < out_length; i++) {
+		*out++ = doubled[in[i]] >> 8;
+		*out++ = doubled[in[i]];
+	}
+	if (i < in_length && 2 * i < out_length)
+		*out = doubled[in[i]] >> 8;
+}
+
+/**
+ * Combine a pair of rows and pairs of dots across.
+ *
+ * @param out Scaled row
+ * @param in First input row
+ * @param next Second input row (NULL if none)
+ * @param in_length Length of the input rows in bytes
+ * @param out_length Length of the scaled row in bytes
+ */
+static void down(uint8_t *out, const uint8_t *in, const uint8_t *next,
+		size_t in_length, size_t out_length) {
+	for (size_t j = 0; j < out_length; j++) {
+		size_t i = 2 * j;
+		uint8_t a = in[i] | (next ? next[i] : 0);
+		uint8_t b = 0;
+		if (i + 1 < in_length) b = in[i + 1] | (next ? next[i + 1] : 0);
+		out[j] = halved[a] << 4 | halved[b];
+	}
+}
+
+/**
+ * Build the tables.
+ */
+static void init() {
+	for (unsigned int byte = 0; byte < 256; byte++) {
+		uint16_t d = 0;
+		uint8_t h = 0;
+		for (int bit = 0; bit < 8; bit++)
+			if (byte & 1 << bit) {
+				d |= 3 << 2 * bit;
+				h |= 1 << bit / 2;
+			}
+		doubled[byte] = d;
+		halved[byte] = h;
+	}
+}
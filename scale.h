@@ -0,0 +1,4 @@
+#include <stddef.h>
+#include <stdint.h>
+
+void scale_page(uint8_t *out, const uint8_t *in, size_t width, size_t rows);
@@ -0,0 +1,423 @@
+/**
+ * Scan raster data for the compression algorithm.
+ *
+ * The compressor spends nearly all of its time looking for the ends of
+ * spans: blank rows, bytes the same as in the last row, bytes different from
+ * the last row, repeated bytes, and bytes without repeats. These kernels find
+ * those spans a byte at a time (scalar), a 64-bit word at a time (word), or
+ * a vector at a time (SSE2 or AVX2). The best kernels supported by the CPU
+ * are selected at startup. All kernels give exactly the same results, so the
+ * compressed output doesn't depend on which kernels are selected.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Check whether a buffer is blank (all zero bytes).
+ *
+ * @param buffer Buffer to examine
+ * @param length Length of buffer
+ * @return True if every byte of the buffer is zero
+ */
+static bool blank_scalar(const uint8_t *buffer, size_t length) {
+	for (size_t i = 0; i < length; i++)
+		if (buffer[i]) return false;
+	return true;
+}
+
+/**
+ * Count bytes which are the same in two buffers.
+ *
+ * @param a First buffer to examine
+ * @param b Second buffer to examine
+ * @param length Length of both buffers
+ * @return Number of leading bytes which are the same in both buffers
+ */
+static size_t same_scalar(const uint8_t *a, const uint8_t *b, size_t length) {
+	size_t i;
+	for (i = 0; i < length && a[i] == b[i]; i++);
+	return i;
+}
+
+/**
+ * Count bytes which are different in two buffers.
+ *
+ * @param a First buffer to examine
+ * @param b Second buffer to examine
+ * @param length Length of both buffers
+ * @return Number of leading bytes which are different in the two buffers
+ */
+static size_t different_scalar(const uint8_t *a, const uint8_t *b,
+		size_t length) {
+	size_t i;
+	for (i = 0; i < length && a[i] != b[i]; i++);
+	return i;
+}
+
+/**
+ * Count repeated byte.
+ *
+ * Counts the number of times the first byte in a buffer is repeated. At least
+ * the first three bytes of the buffer must be the same.
+ *
+ * @param buffer Buffer to examine
+ * @param length Length of buffer
+ * @return Repeat count
+ */
+static size_t repeat_scalar(const uint8_t *buffer, size_t length) {
+	size_t i;
+	for (i = 3; i < length && buffer[i] == buffer[i - 1]; i++);
+	return i;
+}
+
+/**
+ * Count bytes without repeat.
+ *
+ * Counts the number of bytes in a buffer before the first group of three
+ * repeats of the same byte.
+ *
+ * @param buffer Buffer to examine
+ * @param length Length of buffer
+ * @return Number of bytes without repeat
+ */
+static size_t no_repeat_scalar(const uint8_t *buffer, size_t length) {
+	size_t i;
+	for (i = length <= 2 ? length : 2; i < length; i++)
+		if (buffer[i] == buffer[i - 1] && buffer[i] == buffer[i - 2]) {
+			i -= 2;
+			break;
+		}
+	return i;
+}
+
+// The word kernels work on 64-bit words loaded from unaligned addresses.
+// Bytes are compared by XOR (same bytes give zero bytes) and the first
+// interesting byte of a word is found by counting zero bits from the end
+// of the word which holds the lowest address.
+
+static uint64_t load_word(const uint8_t *buffer) {
+	uint64_t word;
+	memcpy(&word, buffer, sizeof(word));
+	return word;
+}
+
+static size_t first_nonzero_byte(uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_clzll(word) >> 3;
+#else
+	return __builtin_ctzll(word) >> 3;
+#endif
+}
+
+// Set the high bit of each byte which is zero and clear all other bits. This
+// is exact (no false positives from carries between bytes).
+static uint64_t zero_bytes(uint64_t word) {
+	const uint64_t low_bits = 0x7f7f7f7f7f7f7f7f;
+	return ~(((word & low_bits) + low_bits) | word | low_bits);
+}
+
+static bool blank_word(const uint8_t *buffer, size_t length) {
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32)
+		if (load_word(buffer + i) | load_word(buffer + i + 8) |
+				load_word(buffer + i + 16) | load_word(buffer + i + 24))
+			return false;
+	for (; i + 8 <= length; i += 8)
+		if (load_word(buffer + i)) return false;
+	return blank_scalar(buffer + i, length - i);
+}
+
+static size_t same_word(const uint8_t *a, const uint8_t *b, size_t length) {
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t diff = load_word(a + i) ^ load_word(b + i);
+		if (diff) return i + first_nonzero_byte(diff);
+	}
+	return i + same_scalar(a + i, b + i, length - i);
+}
+
+static size_t different_word(const uint8_t *a, const uint8_t *b,
+		size_t length) {
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t same = zero_bytes(load_word(a + i) ^ load_word(b + i));
+		if (same) return i + first_nonzero_byte(same);
+	}
+	return i + different_scalar(a + i, b + i, length - i);
+}
+
+static size_t repeat_word(const uint8_t *buffer, size_t length) {
+	uint64_t repeated = buffer[0] * 0x0101010101010101;
+	size_t i = 3;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t diff = load_word(buffer + i) ^ repeated;
+		if (diff) return i + first_nonzero_byte(diff);
+	}
+	for (; i < length && buffer[i] == buffer[0]; i++);
+	return i;
+}
+
+static size_t no_repeat_word(const uint8_t *buffer, size_t length) {
+	// A repeat begins at each byte which is the same as the next two bytes.
+	size_t i = 0;
+	for (; i + 10 <= length; i += 8) {
+		uint64_t word = load_word(buffer + i);
+		uint64_t repeats = zero_bytes((word ^ load_word(buffer + i + 1)) |
+			(word ^ load_word(buffer + i + 2)));
+		if (repeats) return i + first_nonzero_byte(repeats);
+	}
+	if (!i) return no_repeat_scalar(buffer, length);
+	for (i += 2; i < length; i++)
+		if (buffer[i] == buffer[i - 1] && buffer[i] == buffer[i - 2])
+			return i - 2;
+	return length;
+}
+
+#ifdef SCAN_X86
+
+// The vector kernels compare 16 (SSE2) or 32 (AVX2) bytes at once and
+// gather the results into a bit mask with one bit per byte (lowest address
+// in the lowest bit). Tails shorter than a vector are finished by the
+// scalar kernels.
+
+__attribute__((target("sse2")))
+static bool blank_sse2(const uint8_t *buffer, size_t length) {
+	size_t i = 0;
+	for (; i + 64 <= length; i += 64) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(buffer + i)),
+				_mm_loadu_si128((const __m128i *)(buffer + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(buffer + i + 32)),
+				_mm_loadu_si128((const __m128i *)(buffer + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+				!= 0xffff)
+			return false;
+	}
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+				!= 0xffff)
+			return false;
+	}
+	return blank_scalar(buffer + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static size_t same_sse2(const uint8_t *a, const uint8_t *b, size_t length) {
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + i)),
+			_mm_loadu_si128((const __m128i *)(b + i))));
+		if (mask != 0xffff) return i + __builtin_ctz(~mask);
+	}
+	return i + same_scalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static size_t different_sse2(const uint8_t *a, const uint8_t *b,
+		size_t length) {
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + i)),
+			_mm_loadu_si128((const __m128i *)(b + i))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + different_scalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static size_t repeat_sse2(const uint8_t *buffer, size_t length) {
+	__m128i repeated = _mm_set1_epi8(buffer[0]);
+	size_t i = 3;
+	for (; i + 16 <= length; i += 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(buffer + i)), repeated));
+		if (mask != 0xffff) return i + __builtin_ctz(~mask);
+	}
+	for (; i < length && buffer[i] == buffer[0]; i++);
+	return i;
+}
+
+__attribute__((target("sse2")))
+static size_t no_repeat_sse2(const uint8_t *buffer, size_t length) {
+	size_t i = 0;
+	for (; i + 18 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(v,
+				_mm_loadu_si128((const __m128i *)(buffer + i + 1))),
+			_mm_cmpeq_epi8(v,
+				_mm_loadu_si128((const __m128i *)(buffer + i + 2)))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + no_repeat_word(buffer + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static bool blank_avx2(const uint8_t *buffer, size_t length) {
+	size_t i = 0;
+	for (; i + 128 <= length; i += 128) {
+		__m256i v = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *)(buffer + i)),
+				_mm256_loadu_si256((const __m256i *)(buffer + i + 32))),
+			_mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *)(buffer + i + 64)),
+				_mm256_loadu_si256((const __m256i *)(buffer + i + 96))));
+		if (!_mm256_testz_si256(v, v)) return false;
+	}
+	for (; i + 32 <= length; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+		if (!_mm256_testz_si256(v, v)) return false;
+	}
+	return blank_word(buffer + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t same_avx2(const uint8_t *a, const uint8_t *b, size_t length) {
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(a + i)),
+			_mm256_loadu_si256((const __m256i *)(b + i))));
+		if (mask != 0xffffffff) return i + __builtin_ctz(~mask);
+	}
+	return i + same_word(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t different_avx2(const uint8_t *a, const uint8_t *b,
+		size_t length) {
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(a + i)),
+			_mm256_loadu_si256((const __m256i *)(b + i))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + different_word(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t repeat_avx2(const uint8_t *buffer, size_t length) {
+	__m256i repeated = _mm256_set1_epi8(buffer[0]);
+	size_t i = 3;
+	for (; i + 32 <= length; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(buffer + i)), repeated));
+		if (mask != 0xffffffff) return i + __builtin_ctz(~mask);
+	}
+	for (; i < length && buffer[i] == buffer[0]; i++);
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t no_repeat_avx2(const uint8_t *buffer, size_t length) {
+	size_t i = 0;
+	for (; i + 34 <= length; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(v,
+				_mm256_loadu_si256((const __m256i *)(buffer + i + 1))),
+			_mm256_cmpeq_epi8(v,
+				_mm256_loadu_si256((const __m256i *)(buffer + i + 2)))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + no_repeat_word(buffer + i, length - i);
+}
+
+#endif // SCAN_X86
+
+enum ScanKernels scan_kernels = SK_SCALAR;
+bool (*scan_blank)(const uint8_t *buffer, size_t length) = blank_scalar;
+size_t (*scan_same)(const uint8_t *a, const uint8_t *b, size_t length) =
+	same_scalar;
+size_t (*scan_different)(const uint8_t *a, const uint8_t *b, size_t length) =
+	different_scalar;
+size_t (*scan_repeat)(const uint8_t *buffer, size_t length) = repeat_scalar;
+size_t (*scan_no_repeat)(const uint8_t *buffer, size_t length) =
+	no_repeat_scalar;
+
+/**
+ * Select the best scan kernels supported by the CPU.
+ */
+void scan_init() {
+	if (!scan_use(SK_AVX2) && !scan_use(SK_SSE2))
+		scan_use(SK_WORD);
+}
+
+/**
+ * Select a particular set of scan kernels.
+ *
+ * @param kernels Kernels to select
+ * @return True if selected, false if not supported by the CPU
+ */
+bool scan_use(enum ScanKernels kernels) {
+	switch (kernels) {
+		case SK_SCALAR:
+			scan_blank = blank_scalar;
+			scan_same = same_scalar;
+			scan_different = different_scalar;
+			scan_repeat = repeat_scalar;
+			scan_no_repeat = no_repeat_scalar;
+			break;
+		case SK_WORD:
+			scan_blank = blank_word;
+			scan_same = same_word;
+			scan_different = different_word;
+			scan_repeat = repeat_word;
+			scan_no_repeat = no_repeat_word;
+			break;
+#ifdef SCAN_X86
+		case SK_SSE2:
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("sse2")) return false;
+			scan_blank = blank_sse2;
+			scan_same = same_sse2;
+			scan_different = different_sse2;
+			scan_repeat = repeat_sse2;
+			scan_no_repeat = no_repeat_sse2;
+			break;
+		case SK_AVX2:
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("avx2")) return false;
+			scan_blank = blank_avx2;
+			scan_same = same_avx2;
+			scan_different = different_avx2;
+			scan_repeat = repeat_avx2;
+			scan_no_repeat = no_repeat_avx2;
+			break;
+#endif
+		default:
+			return false;
+	}
+	scan_kernels = kernels;
+	return true;
+}
+
+/**
+ * Get the name of a set of scan kernels.
+ *
+ * @param kernels Kernels to name
+ * @return Name of the kernels
+ */
+const char *scan_name(enum ScanKernels kernels) {
+	switch (kernels) {
+		case SK_WORD: return "word";
+		case SK_SSE2: return "sse2";
+		case SK_AVX2: return "avx2";
+		case SK_SCALAR:
+		default: return "scalar";
+	}
+}
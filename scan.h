@@ -0,0 +1,21 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern enum ScanKernels {
+	SK_SCALAR,
+	SK_WORD,
+	SK_SSE2,
+	SK_AVX2
+} scan_kernels;
+
+extern bool (*scan_blank)(const uint8_t *buffer, size_t length);
+extern size_t (*scan_same)(const uint8_t *a, const uint8_t *b, size_t length);
+extern size_t (*scan_different)(const uint8_t *a, const uint8_t *b,
+	size_t length);
+extern size_t (*scan_repeat)(const uint8_t *buffer, size_t length);
+extern size_t (*scan_no_repeat)(const uint8_t *buffer, size_t length);
+
+void scan_init();
+bool scan_use(enum ScanKernels kernels);
+const char *scan_name(enum ScanKernels kernels);
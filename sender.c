@@ -0,0 +1,136 @@
+/**
+ * Send output straight to a printer over TCP (as to a JetDirect-style print
+ * server on port 9100).
+ *
+ * The connection takes the place of standard output, so everything written
+ * there goes to the printer without another process or pipe in between.
+ * The send buffer is made large so a page or more can be handed to the
+ * system at once, which then sends it while the next page is compressed.
+ * Output written with output_flush() doesn't block (see output.c), so
+ * stalls on a slow printer can be told apart from time spent writing.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "sender.h"
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+// Size of the send buffer to ask for, in bytes. The system may give less.
+#define SEND_BUFFER (4 << 20)
+
+// Longest time to wait for the printer to close the connection at the end
+// of the job, in milliseconds.
+#define CLOSE_TIMEOUT 60000
+
+/**
+ * Connect to a printer and send standard output there.
+ *
+ * @param destination Host name or address and port, separated by a colon
+ * (an IPv6 address may be given in brackets)
+ */
+void sender_open(const char *destination) {
+	int fd = sender_connect(destination);
+	fflush(stdout);
+	if (dup2(fd, STDOUT_FILENO) < 0) err(EX_OSERR, "redirect output");
+	close(fd);
+}
+
+/**
+ * Finish sending and close the connection.
+ *
+ * Waits for the printer to close its side, so the job has been taken in full
+ * before this returns. Anything the printer sends back is discarded.
+ */
+void sender_close() {
+	if (fflush(stdout)) err(EX_IOERR, "write output");
+	sender_finish(STDOUT_FILENO);
+}
+
+/**
+ * Connect to a printer.
+ *
+ * @param destination Host name or address and port, separated by a colon
+ * (an IPv6 address may be given in brackets)
+ * @return Connected socket
+ */
+int sender_connect(const char *destination) {
+	char *host = strdup(destination);
+	if (!host) err(EX_OSERR, "allocate host name");
+	char *port = strrchr(host, ':');
+	if (!port || port == host || !port[1])
+		errx(EX_USAGE, "send must be HOST:PORT");
+	*port++ = '\0';
+	char *name = host;
+	size_t length = strlen(name);
+	if (name[0] == '[' && name[length - 1] == ']') {
+		name[length - 1] = '\0';
+		name++;
+	}
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	struct addrinfo *addresses;
+	int error = getaddrinfo(name, port, &hints, &addresses);
+	if (error) errx(EX_NOHOST, "look up %s: %s", name, gai_strerror(error));
+
+	// Try each address until one connects. The send buffer is set before
+	// connecting so the window can be scaled to fit it.
+	int fd = -1;
+	for (struct addrinfo *address = addresses; address && fd < 0;
+			address = address->ai_next) {
+		fd = socket(address->ai_family, address->ai_socktype,
+			address->ai_protocol);
+		if (fd < 0) continue;
+		int size = SEND_BUFFER;
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		if (connect(fd, address->ai_addr, address->ai_addrlen)) {
+			error = errno;
+			close(fd);
+			fd = -1;
+			errno = error;
+		}
+	}
+	if (fd < 0) err(EX_UNAVAILABLE, "connect to %s", destination);
+	freeaddrinfo(addresses);
+	free(host);
+
+	// A printer that drops the connection shows up as a write error rather
+	// than killing the process.
+	signal(SIGPIPE, SIG_IGN);
+	return fd;
+}
+
+/**
+ * Finish sending to a printer and close the connection, waiting for the
+ * printer to close its side. Anything the printer sends back is discarded.
+ *
+ * @param fd Connected socket
+ */
+void sender_finish(int fd) {
+	if (shutdown(fd, SHUT_WR)) err(EX_IOERR, "finish output");
+
+	struct pollfd poll_fd = {.fd = fd, .events = POLLIN};
+	char discard[512];
+	for (;;) {
+		int ready = poll(&poll_fd, 1, CLOSE_TIMEOUT);
+		if (ready < 0 && errno == EINTR) continue;
+		if (ready <= 0) break;
+		ssize_t count = read(fd, discard, sizeof(discard));
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) break;
+	}
+	close(fd);
+}
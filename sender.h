@@ -0,0 +1,4 @@
+void sender_open(const char *destination);
+void sender_close();
+int sender_connect(const char *destination);
+void sender_finish(int fd);
@@ -0,0 +1,256 @@
+/**
+ * Take jobs from clients on a Unix domain socket.
+ *
+ * Starting a process for each job costs more than filtering a small job, so
+ * a few worker processes are started ahead of time and each takes one job
+ * after another, keeping its buffers, threads, and cache warm from job to
+ * job. Each worker is a separate process so a job that fails (and exits)
+ * takes down only its worker, which is replaced.
+ *
+ * A client connects and sends a header: one line of options, as would be
+ * given as arguments, separated by spaces. Raster data follows until the
+ * client shuts down its side of the connection. Output is sent back on the
+ * same connection, which is closed when the job is done. The header must
+ * come within a few seconds, so idle connections can't hold the workers, and
+ * a header which is late or too long is refused with a line saying why.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "server.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+// Longest header line, in bytes (including the newline).
+#define HEADER_LENGTH 4096
+
+// Most options in a header (counting names and values separately).
+#define HEADER_ARGS 128
+
+// Longest time for a header to come, in milliseconds from the connection.
+#define HEADER_TIME 10000
+
+static pid_t start_worker(int listener, void (*job)(int argc, char **argv));
+static void serve(int listener, void (*job)(int argc, char **argv));
+static int read_header(int connection, char *header, char **argv);
+static int refuse(int connection, const char *message);
+static long long now_ms();
+static void stop(int signum);
+
+static volatile sig_atomic_t stopping;
+
+/**
+ * Listen on a socket and run jobs from it until stopped by SIGTERM or
+ * SIGINT.
+ *
+ * @param path Path of the socket (an old socket there is replaced)
+ * @param jobs Number of jobs to run at once (one per worker process)
+ * @param job Function to run a job, given the options in its header
+ * (after a placeholder for the program name), with the connection as
+ * standard input and output
+ */
+void server_run(const char *path, unsigned int jobs,
+		void (*job)(int argc, char **argv)) {
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(address.sun_path))
+		errx(EX_USAGE, "listen path is too long");
+	strcpy(address.sun_path, path);
+
+	// Only replace what's at the path if it's a socket, so a mistyped path
+	// can't remove a file.
+	struct stat st;
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) err(EX_OSERR, "create socket");
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)))
+		err(EX_CANTCREAT, "bind %s", path);
+	if (listen(listener, SOMAXCONN)) err(EX_OSERR, "listen on %s", path);
+
+	// Stop on SIGTERM or SIGINT. System calls aren't restarted, so waiting
+	// for workers is interrupted.
+	struct sigaction action = {.sa_handler = stop};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	pid_t *workers = calloc(jobs, sizeof(*workers));
+	if (!workers) err(EX_OSERR, "allocate worker list");
+	for (unsigned int i = 0; i < jobs; i++)
+		workers[i] = start_worker(listener, job);
+
+	// Replace workers as they exit.
+	while (!stopping) {
+		pid_t pid = wait(NULL);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			err(EX_OSERR, "wait for workers");
+		}
+		for (unsigned int i = 0; i < jobs; i++)
+			if (workers[i] == pid && !stopping)
+				workers[i] = start_worker(listener, job);
+	}
+
+	for (unsigned int i = 0; i < jobs; i++)
+		kill(workers[i], SIGTERM);
+	while (wait(NULL) > 0 || errno == EINTR);
+	unlink(path);
+	free(workers);
+	exit(EX_OK);
+}
+
+/**
+ * Start a worker process to take jobs.
+ *
+ * @param listener Listening socket
+ * @param job Function to run a job
+ * @return Process ID of the worker
+ */
+static pid_t start_worker(int listener, void (*job)(int argc, char **argv)) {
+	pid_t pid = fork();
+	if (pid < 0) err(EX_OSERR, "start worker");
+	if (pid) return pid;
+
+	// A client that goes away before its output is written fails that
+	// write, which ends the worker, rather than killing it with SIGPIPE.
+	// The master stops workers with SIGTERM.
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_IGN);
+	serve(listener, job);
+	exit(EX_OK);
+}
+
+/**
+ * Take jobs one after another. Runs in a worker process.
+ *
+ * @param listener Listening socket
+ * @param job Function to run a job
+ */
+static void serve(int listener, void (*job)(int argc, char **argv)) {
+	int null_fd = open("/dev/null", O_RDWR);
+	if (null_fd < 0) err(EX_OSERR, "open /dev/null");
+
+	char header[HEADER_LENGTH];
+	char *argv[HEADER_ARGS + 2];
+	for (;;) {
+		int connection = accept(listener, NULL, NULL);
+		if (connection < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			err(EX_OSERR, "accept job");
+		}
+
+		int argc = read_header(connection, header, argv);
+		if (argc < 0) {
+			close(connection);
+			continue;
+		}
+
+		// The job reads and writes the connection as standard input and
+		// output. Anything left over from the last job is cleared first.
+		if (dup2(connection, STDIN_FILENO) < 0 ||
+				dup2(connection, STDOUT_FILENO) < 0)
+			err(EX_OSERR, "redirect job");
+		close(connection);
+		clearerr(stdin);
+		clearerr(stdout);
+
+		job(argc, argv);
+		fflush(stdout);
+
+		// Close the connection (both copies of it) so the client sees the
+		// end of its output.
+		if (dup2(null_fd, STDIN_FILENO) < 0 ||
+				dup2(null_fd, STDOUT_FILENO) < 0)
+			err(EX_OSERR, "redirect job");
+	}
+}
+
+/**
+ * Read the header of a job and split it into options.
+ *
+ * The header is read a byte at a time, so none of the raster data after it
+ * is consumed. If it doesn't all come within HEADER_TIME, the job is
+ * refused.
+ *
+ * @param connection Connection to read from
+ * @param header Buffer for the header (HEADER_LENGTH bytes)
+ * @param argv Set to a placeholder for the program name, the options, and a
+ * null pointer (HEADER_ARGS + 2 pointers)
+ * @return Number of arguments (including the placeholder), or -1 if the
+ * header is incomplete, late, or too long
+ */
+static int read_header(int connection, char *header, char **argv) {
+	long long deadline = now_ms() + HEADER_TIME;
+	size_t length = 0;
+	for (;;) {
+		if (length == HEADER_LENGTH)
+			return refuse(connection, "job header is too long");
+		long long left = deadline - now_ms();
+		struct pollfd poll_fd = {.fd = connection, .events = POLLIN};
+		int ready = left > 0 ? poll(&poll_fd, 1, left) : 0;
+		if (ready < 0 && errno == EINTR) continue;
+		if (!ready) return refuse(connection, "job header didn't come in time");
+		if (ready < 0) return -1;
+		ssize_t count = read(connection, header + length, 1);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return -1;
+		if (header[length] == '\n') break;
+		length++;
+	}
+	header[length] = '\0';
+
+	int argc = 0;
+	argv[argc++] = "oh_brother";
+	for (char *arg = strtok(header, " \t\r"); arg;
+			arg = strtok(NULL, " \t\r")) {
+		if (argc > HEADER_ARGS)
+			return refuse(connection, "job header has too many options");
+		argv[argc++] = arg;
+	}
+	argv[argc] = NULL;
+	return argc;
+}
+
+/**
+ * Refuse a job, saying why on standard error and to the client.
+ *
+ * @param connection Connection of the job
+ * @param message Why the job is refused
+ * @return -1
+ */
+static int refuse(int connection, const char *message) {
+	warnx("%s", message);
+	dprintf(connection, "oh_brother: %s\n", message);
+	return -1;
+}
+
+/**
+ * Get the time.
+ *
+ * @return Time in milliseconds from an arbitrary point
+ */
+static long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void stop(int signum) {
+	(void)signum;
+	stopping = 1;
+}
@@ -0,0 +1,2 @@
+void server_run(const char *path, unsigned int jobs,
+	void (*job)(int argc, char **argv));
@@ -0,0 +1,203 @@
+/**
+ * Write statistics about each page and the whole job as JSON lines.
+ *
+ * Each page's statistics are collected as it's encoded (see struct stats),
+ * then written with the size of its output once it's written. A last line
+ * gives the totals for the job. Each line is written with a single write
+ * call, so lines from jobs run at once by a server aren't mixed up.
+ *
+ * Nothing is collected unless statistics are enabled (the stats parameter
+ * gives a file descriptor), so the encoder only pays for a test per row.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "stats.h"
+#include "output.h"
+#include "parameters.h"
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+// Longest line written.
+#define LINE_LENGTH 1024
+
+static int format_counts(char *line, size_t size, const struct stats *stats);
+static void write_line(const char *line, int length);
+static double now(clockid_t clock);
+
+static struct stats total; // Totals for the job
+static unsigned long pages;
+static size_t out_total;
+static double write_total;
+static double stalled_total;
+static double job_started;
+static double job_cpu_started;
+
+/**
+ * Begin collecting statistics for a job, if enabled.
+ */
+void stats_begin() {
+	if (p_stats < 0) return;
+	if (fcntl(p_stats, F_GETFD) < 0)
+		err(EX_USAGE, "stats file descriptor %d", p_stats);
+	total = (struct stats){0};
+	pages = 0;
+	out_total = 0;
+	write_total = 0;
+	stalled_total = 0;
+	job_started = now(CLOCK_MONOTONIC);
+	job_cpu_started = now(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/**
+ * Start timing the encoding of a page.
+ *
+ * @param stats Statistics for the page
+ */
+void stats_start(struct stats *stats) {
+	stats->started = now(CLOCK_MONOTONIC);
+	stats->cpu_started = now(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/**
+ * Stop timing the encoding of a page, adding the time since it started.
+ *
+ * @param stats Statistics for the page
+ */
+void stats_stop(struct stats *stats) {
+	stats->seconds += now(CLOCK_MONOTONIC) - stats->started;
+	stats->cpu_seconds += now(CLOCK_PROCESS_CPUTIME_ID) - stats->cpu_started;
+}
+
+/**
+ * Count an encoded row.
+ *
+ * Rows are told apart by their first byte, the number of groups: 255 for
+ * a blank row, and 0 for a row the same as the last row. Whether a row used
+ * up the groups a row can have and put the rest of the row in its last group
+ * is given by compress().
+ *
+ * @param stats Statistics for the page
+ * @param groups First byte of the encoded row
+ * @param fallback True if the row ran out of groups
+ */
+void stats_row(struct stats *stats, uint8_t groups, bool fallback) {
+	stats->rows++;
+	if (groups == 255) {
+		stats->blank_rows++;
+		return;
+	}
+	if (!groups) stats->same_rows++;
+	if (fallback) stats->fallback_rows++;
+	size_t bucket = 0;
+	while (groups) {
+		bucket++;
+		groups >>= 1;
+	}
+	stats->groups[bucket]++;
+}
+
+/**
+ * Write the statistics for a page, and add them to the totals for the job.
+ *
+ * @param page Page number
+ * @param stats Statistics for the page
+ * @param out_bytes Bytes of output for the page
+ * @param write_seconds Time spent writing the page
+ * @param stalled Time spent waiting for room to write the page
+ */
+void stats_page(unsigned long page, const struct stats *stats,
+		size_t out_bytes, double write_seconds, double stalled) {
+	total.raster_bytes += stats->raster_bytes;
+	total.rows += stats->rows;
+	total.blank_rows += stats->blank_rows;
+	total.same_rows += stats->same_rows;
+	total.fallback_rows += stats->fallback_rows;
+	for (size_t i = 0; i < STATS_BUCKETS; i++)
+		total.groups[i] += stats->groups[i];
+	total.blocks += stats->blocks;
+	total.seconds += stats->seconds;
+	total.cpu_seconds += stats->cpu_seconds;
+	pages++;
+	out_total += out_bytes;
+	write_total += write_seconds;
+	stalled_total += stalled;
+
+	char line[LINE_LENGTH];
+	int length = snprintf(line, sizeof(line),
+		"{\"type\":\"page\",\"page\":%lu,\"out_bytes\":%zu,", page,
+		out_bytes);
+	length += format_counts(line + length, sizeof(line) - length, stats);
+	length += snprintf(line + length, sizeof(line) - length,
+		",\"ratio\":%.3f,\"encode_seconds\":%.6f,"
+		"\"encode_cpu_seconds\":%.6f,\"write_seconds\":%.6f,"
+		"\"stalled_seconds\":%.6f}\n",
+		out_bytes ? (double)stats->raster_bytes / out_bytes : 0.0,
+		stats->seconds, stats->cpu_seconds, write_seconds, stalled);
+	write_line(line, length);
+}
+
+/**
+ * Write the totals for the job, if enabled.
+ */
+void stats_end() {
+	if (p_stats < 0) return;
+	char line[LINE_LENGTH];
+	int length = snprintf(line, sizeof(line),
+		"{\"type\":\"job\",\"pages\":%lu,\"out_bytes\":%zu,", pages,
+		out_total);
+	length += format_counts(line + length, sizeof(line) - length, &total);
+	length += snprintf(line + length, sizeof(line) - length,
+		",\"ratio\":%.3f,\"encode_seconds\":%.6f,"
+		"\"encode_cpu_seconds\":%.6f,\"write_seconds\":%.6f,"
+		"\"stalled_seconds\":%.6f,\"seconds\":%.6f,\"cpu_seconds\":%.6f}\n",
+		out_total ? (double)total.raster_bytes / out_total : 0.0,
+		total.seconds, total.cpu_seconds, write_total, stalled_total,
+		now(CLOCK_MONOTONIC) - job_started,
+		now(CLOCK_PROCESS_CPUTIME_ID) - job_cpu_started);
+	write_line(line, length);
+}
+
+/**
+ * Format the counts of a page or job as JSON members.
+ *
+ * @param line Buffer to format into
+ * @param size Size of the buffer
+ * @param stats Counts
+ * @return Length formatted
+ */
+static int format_counts(char *line, size_t size, const struct stats *stats) {
+	int length = snprintf(line, size,
+		"\"raster_bytes\":%zu,\"rows\":%zu,\"blank_rows\":%zu,"
+		"\"same_rows\":%zu,\"fallback_rows\":%zu,\"blocks\":%zu,"
+		"\"groups\":[", stats->raster_bytes, stats->rows, stats->blank_rows,
+		stats->same_rows, stats->fallback_rows, stats->blocks);
+	for (size_t i = 0; i < STATS_BUCKETS; i++)
+		length += snprintf(line + length, size - length, i ? ",%zu" : "%zu",
+			stats->groups[i]);
+	length += snprintf(line + length, size - length, "]");
+	return length;
+}
+
+/**
+ * Write a line to the statistics file descriptor. Errors are warned about
+ * but don't stop the job.
+ *
+ * @param line Line
+ * @param length Length of the line
+ */
+static void write_line(const char *line, int length) {
+	if (write(p_stats, line, length) != length)
+		warn("write stats");
+}
+
+static double now(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
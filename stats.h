@@ -0,0 +1,13 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct stats;
+
+void stats_begin();
+void stats_start(struct stats *stats);
+void stats_stop(struct stats *stats);
+void stats_row(struct stats *stats, uint8_t groups, bool fallback);
+void stats_page(unsigned long page, const struct stats *stats,
+	size_t out_bytes, double write_seconds, double stalled);
+void stats_end();
@@ -0,0 +1,165 @@
+/**
+ * Trace the stages of a job, for viewing in Chrome or Perfetto.
+ *
+ * Each thread records the start and end of the things it does (reading a
+ * page, compressing a band, ending a block, writing output) into a ring of
+ * events of its own, set aside the first time the thread records anything.
+ * Nothing is shared while recording, so tracing costs two clock readings
+ * per event, and nothing at all but a test when it's off. If a ring fills
+ * up, the oldest events are dropped. At the end of the job, the events of
+ * all threads are written out in the Trace Event Format, which shows
+ * whether the job was waiting on the input, the CPU, or the printer.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "trace.h"
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <time.h>
+
+// Number of events kept by each thread.
+#define RING_EVENTS 65536
+
+/**
+ * Something a thread did, with its name and when it started and ended (in
+ * nanoseconds).
+ */
+struct event {
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+};
+
+/**
+ * The events recorded by a thread.
+ */
+struct ring {
+	struct event *events;
+	size_t next; // Where the next event goes
+	bool wrapped; // Whether older events have been overwritten
+	unsigned int tid; // Thread number in the trace
+	const char *name; // Thread name in the trace (NULL if unnamed)
+	struct ring *link; // Next ring of all rings
+};
+
+static struct ring *ring_get();
+
+static bool enabled;
+static FILE *file;
+static uint64_t origin; // Time the job began
+
+// Ring of each thread, and all rings.
+static __thread struct ring *ring;
+static struct ring *rings;
+static unsigned int ring_count;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Begin tracing a job, if a file is given.
+ *
+ * @param path File to write the trace to at the end of the job (NULL for
+ * no tracing)
+ */
+void trace_begin(const char *path) {
+	if (!path) return;
+	file = fopen(path, "w");
+	if (!file) err(EX_CANTCREAT, "open trace %s", path);
+	enabled = true;
+	origin = trace_now();
+	trace_thread("main");
+}
+
+/**
+ * Name the calling thread in the trace.
+ *
+ * @param name Name (must stay valid until the end of the job)
+ */
+void trace_thread(const char *name) {
+	if (!enabled) return;
+	ring_get()->name = name;
+}
+
+/**
+ * Get the time, for the start of an event.
+ *
+ * @return Time in nanoseconds, or 0 if not tracing
+ */
+uint64_t trace_now() {
+	if (!enabled) return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Record an event on the calling thread, ending now.
+ *
+ * @param name Name of the event (must stay valid until the end of the job)
+ * @param start Time the event started, from trace_now() (if 0, tracing was
+ * off and nothing is recorded)
+ */
+void trace_event(const char *name, uint64_t start) {
+	if (!start) return;
+	uint64_t end = trace_now();
+	struct ring *r = ring_get();
+	r->events[r->next] = (struct event){name, start, end};
+	if (++r->next == RING_EVENTS) {
+		r->next = 0;
+		r->wrapped = true;
+	}
+}
+
+/**
+ * Write the trace of the job, if tracing.
+ *
+ * Other threads must be done recording by now.
+ */
+void trace_end() {
+	if (!enabled) return;
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+	bool first = true;
+	for (struct ring *r = rings; r; r = r->link) {
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}", first ? "" : ",\n",
+			r->tid, r->name ? r->name : "thread", r->tid);
+		first = false;
+		size_t count = r->wrapped ? RING_EVENTS : r->next;
+		size_t i = r->wrapped ? r->next : 0;
+		for (; count--; i = (i + 1) % RING_EVENTS) {
+			struct event *e = &r->events[i];
+			// Times are in microseconds from the beginning of the job.
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+				"\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", e->name, r->tid,
+				(e->start - origin) / 1e3, (e->end - e->start) / 1e3);
+		}
+	}
+	fputs("\n]}\n", file);
+	if (fclose(file)) err(EX_IOERR, "write trace");
+	enabled = false;
+}
+
+/**
+ * Get the ring of the calling thread, setting it aside if it has none.
+ *
+ * @return Ring
+ */
+static struct ring *ring_get() {
+	if (ring) return ring;
+	struct ring *r = calloc(1, sizeof(*r));
+	if (r) r->events = malloc(RING_EVENTS * sizeof(*r->events));
+	if (!r || !r->events) err(EX_OSERR, "allocate trace events");
+	pthread_mutex_lock(&mutex);
+	r->tid = ++ring_count;
+	// Add to the end, so threads are listed in the order they started.
+	struct ring **tail = &rings;
+	while (*tail) tail = &(*tail)->link;
+	*tail = r;
+	pthread_mutex_unlock(&mutex);
+	return ring = r;
+}
@@ -0,0 +1,7 @@
+#include <stdint.h>
+
+void trace_begin(const char *path);
+void trace_thread(const char *name);
+uint64_t trace_now();
+void trace_event(const char *name, uint64_t start);
+void trace_end();
@@ -0,0 +1,167 @@
+/**
+ * Run tasks on a pool of worker threads.
+ *
+ * The pool runs one batch of tasks at a time. Each task in a batch is the
+ * same function called with a different index. The thread which starts a
+ * batch also runs tasks from it, then waits for the workers to finish the
+ * rest.
+ *
+ * @author Aaron D. Parks
+ * @copyright 2022 Parks Digital LLC
+ */
+
+#include "workers.h"
+#include "fail.h"
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+struct workers {
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+	pthread_cond_t finish;
+	pthread_t *threads;
+	size_t thread_count;
+	void (*task)(void *arg, size_t index);
+	void *arg;
+	size_t count;
+	size_t next;
+	size_t done;
+	unsigned long batch;
+	bool stop;
+};
+
+static void *worker(void *arg);
+static void run_tasks(struct workers *workers);
+
+/**
+ * Create a pool of worker threads.
+ *
+ * @param thread_count Number of threads to start (in addition to the
+ * thread which runs batches)
+ * @return Worker pool, or NULL if it couldn't be created (when errors are
+ * caught)
+ */
+struct workers *workers_create(size_t thread_count) {
+	struct workers *workers = calloc(1, sizeof(*workers));
+	if (!workers) {
+		fail_errno(EX_OSERR, "allocate worker pool");
+		return NULL;
+	}
+	workers->threads = calloc(thread_count, sizeof(pthread_t));
+	if (thread_count && !workers->threads) {
+		free(workers);
+		fail_errno(EX_OSERR, "allocate worker threads");
+		return NULL;
+	}
+	pthread_mutex_init(&workers->mutex, NULL);
+	pthread_cond_init(&workers->start, NULL);
+	pthread_cond_init(&workers->finish, NULL);
+
+	for (; workers->thread_count < thread_count; workers->thread_count++) {
+		int error = pthread_create(&workers->threads[workers->thread_count],
+			NULL, worker, workers);
+		if (error) {
+			workers_destroy(workers);
+			errno = error;
+			fail_errno(EX_OSERR, "start worker thread");
+			return NULL;
+		}
+	}
+	return workers;
+}
+
+/**
+ * Run a batch of tasks and wait for all of them to finish.
+ *
+ * @param workers Worker pool
+ * @param task Function to call for each task
+ * @param arg Argument passed to each task
+ * @param count Number of tasks (indices 0 through count - 1)
+ */
+void workers_run(struct workers *workers,
+		void (*task)(void *arg, size_t index), void *arg, size_t count) {
+	pthread_mutex_lock(&workers->mutex);
+	workers->task = task;
+	workers->arg = arg;
+	workers->count = count;
+	workers->next = 0;
+	workers->done = 0;
+	workers->batch++;
+	pthread_cond_broadcast(&workers->start);
+
+	// Pitch in rather than sitting idle, then wait for tasks still running
+	// on the workers.
+	run_tasks(workers);
+	while (workers->done < workers->count)
+		pthread_cond_wait(&workers->finish, &workers->mutex);
+	pthread_mutex_unlock(&workers->mutex);
+}
+
+/**
+ * Stop the worker threads and free the pool.
+ *
+ * @param workers Worker pool
+ */
+void workers_destroy(struct workers *workers) {
+	pthread_mutex_lock(&workers->mutex);
+	workers->stop = true;
+	pthread_cond_broadcast(&workers->start);
+	pthread_mutex_unlock(&workers->mutex);
+
+	for (size_t i = 0; i < workers->thread_count; i++)
+		pthread_join(workers->threads[i], NULL);
+
+	pthread_cond_destroy(&workers->finish);
+	pthread_cond_destroy(&workers->start);
+	pthread_mutex_destroy(&workers->mutex);
+	free(workers->threads);
+	free(workers);
+}
+
+/**
+ * Wait for batches and run tasks from them until the pool is stopped.
+ *
+ * @param arg Worker pool
+ * @return Nothing
+ */
+static void *worker(void *arg) {
+	struct workers *workers = arg;
+	unsigned long batch = 0;
+	trace_thread("worker");
+
+	pthread_mutex_lock(&workers->mutex);
+	for (;;) {
+		while (!workers->stop && workers->batch == batch)
+			pthread_cond_wait(&workers->start, &workers->mutex);
+		if (workers->stop) break;
+		batch = workers->batch;
+		run_tasks(workers);
+	}
+	pthread_mutex_unlock(&workers->mutex);
+	return NULL;
+}
+
+/**
+ * Run tasks from the current batch until none are left to start.
+ *
+ * Must be called with the pool mutex locked. The mutex is released while
+ * each task runs.
+ *
+ * @param workers Worker pool
+ */
+static void run_tasks(struct workers *workers) {
+	while (workers->next < workers->count) {
+		size_t index = workers->next++;
+		void (*task)(void *arg, size_t index) = workers->task;
+		void *arg = workers->arg;
+		pthread_mutex_unlock(&workers->mutex);
+		task(arg, index);
+		pthread_mutex_lock(&workers->mutex);
+		if (++workers->done == workers->count)
+			pthread_cond_broadcast(&workers->finish);
+	}
+}
@@ -0,0 +1,8 @@
+#include <stddef.h>
+
+struct workers;
+
+struct workers *workers_create(size_t thread_count);
+void workers_run(struct workers *workers,
+	void (*task)(void *arg, size_t index), void *arg, size_t count);
+void workers_destroy(struct workers *workers);